@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "free.h"
+#include "inode.h"
+#include "dir.h"
+#include "journal.h"
+
+/*
+ * Microbenchmarks for the library. Each case runs an operation a fixed
+ * number of times on one or more threads, timing every call, and
+ * prints one JSON object per line:
+ *
+ *   {"bench":"path_lookup","params":"depth=8","threads":4,"ops":...,
+ *    "ops_per_sec":...,"p50_ns":...,"p99_ns":...,"p999_ns":...}
+ *
+ * The journal runs with VVSFS_DURABILITY_NONE so the numbers measure
+ * the library rather than fdatasync().
+ */
+#define BENCH_IMAGE   "bench.img"
+#define BENCH_THREADS 4
+
+typedef void (*bench_op)(int thread, int i, void *arg);
+
+// The image every case runs against.
+static struct vvsfs *fs;
+
+struct bench_thread {
+    bench_op       op;
+    void          *arg;
+    int            id;
+    int            iters;
+    unsigned long *lat;
+};
+
+static unsigned long
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static void *
+bench_thread(void *arg)
+{
+    struct bench_thread *t = arg;
+    for (int i = 0; i < t->iters; i++) {
+        unsigned long start = now_ns();
+        t->op(t->id, i, t->arg);
+        t->lat[i] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static int
+cmp_ul(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+bench_run(const char *name, const char *params, int threads, int iters,
+          bench_op op, void *arg)
+{
+    struct bench_thread t[BENCH_THREADS];
+    pthread_t tids[BENCH_THREADS];
+    unsigned long *lat = malloc((size_t)threads * iters * sizeof *lat);
+    if (!lat)
+        return;
+
+    // Start from a checkpointed journal so earlier setup does not leak
+    // background commits into the numbers.
+    journal_flush(fs);
+    unsigned long start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        t[i] = (struct bench_thread){ op, arg, i, iters, lat + (size_t)i * iters };
+        pthread_create(&tids[i], NULL, bench_thread, &t[i]);
+    }
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    double secs = (now_ns() - start) / 1e9;
+
+    size_t n = (size_t)threads * iters;
+    qsort(lat, n, sizeof *lat, cmp_ul);
+    printf("{\"bench\":\"%s\",\"params\":\"%s\",\"threads\":%d,\"ops\":%zu,"
+           "\"ops_per_sec\":%.0f,\"p50_ns\":%lu,\"p99_ns\":%lu,\"p999_ns\":%lu}\n",
+           name, params, threads, n, n / secs,
+           lat[n / 2], lat[n * 99 / 100], lat[n * 999 / 1000]);
+    fflush(stdout);
+    free(lat);
+}
+
+static unsigned int
+rnd(unsigned int *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+static void
+close_image(void)
+{
+    vvsfs_close(fs);
+    fs = NULL;
+}
+
+static void
+fresh_image(void)
+{
+    if (fs)
+        close_image();
+    fs = mkfs(BENCH_IMAGE);
+    if (!fs) {
+        perror(BENCH_IMAGE);
+        exit(1);
+    }
+    vvsfs_set_durability(fs, VVSFS_DURABILITY_NONE, 0);
+}
+
+/* ---- block layer ---- */
+
+static void
+op_bread(int thread, int i, void *arg)
+{
+    unsigned char block[BLOCK_SIZE];
+    unsigned int seed = thread * 7919 + i;
+    (void)arg;
+    bread(fs, INODE_FIRST_BLOCK + rnd(&seed) % INODE_BLOCK_COUNT, block);
+}
+
+static void
+op_bwrite(int thread, int i, void *arg)
+{
+    unsigned char block[BLOCK_SIZE];
+    int *blocks = arg;
+    memset(block, i, BLOCK_SIZE);
+    bwrite(fs, blocks[thread * 64 + i % 64], block);
+}
+
+static void
+op_find_free(int thread, int i, void *arg)
+{
+    (void)thread; (void)i;
+    find_free(arg);
+}
+
+static void
+op_alloc_free(int thread, int i, void *arg)
+{
+    (void)thread; (void)i; (void)arg;
+    int b = alloc(fs);
+    if (b >= 0)
+        bfree(fs, b);
+}
+
+static void
+fill_blocks(int percent)
+{
+    int want = (BLOCK_SIZE * 8 - DATA_FIRST_BLOCK) * percent / 100;
+    int *blocks = malloc(256 * sizeof *blocks);
+    for (; want > 0; want -= 256)
+        alloc_batch(fs, want < 256 ? want : 256, blocks);
+    free(blocks);
+}
+
+static void
+bench_blocks(void)
+{
+    char params[64];
+    int blocks[BENCH_THREADS * 64];
+
+    fresh_image();
+    for (int threads = 1; threads <= BENCH_THREADS; threads *= 2)
+        bench_run("bread", "inode_table", threads, 20000, op_bread, NULL);
+    alloc_batch(fs, BENCH_THREADS * 64, blocks);
+    for (int threads = 1; threads <= BENCH_THREADS; threads *= 2)
+        bench_run("bwrite", "data_region", threads, 5000, op_bwrite, blocks);
+
+    static const int fills[] = { 0, 50, 90, 99 };
+    for (unsigned int f = 0; f < sizeof fills / sizeof fills[0]; f++) {
+        unsigned char map[BLOCK_SIZE];
+        memset(map, 0, BLOCK_SIZE);
+        int used = BLOCK_SIZE * 8 * fills[f] / 100;
+        for (int b = 0; b < used; b++)
+            set_free(map, b, 1);
+        snprintf(params, sizeof params, "fill=%d", fills[f]);
+        bench_run("find_free", params, 1, 20000, op_find_free, map);
+
+        fresh_image();
+        fill_blocks(fills[f]);
+        bench_run("alloc_bfree", params, 1, 5000, op_alloc_free, NULL);
+    }
+    close_image();
+}
+
+/* ---- inodes ---- */
+
+static void
+op_ialloc(int thread, int i, void *arg)
+{
+    (void)thread; (void)i; (void)arg;
+    iput(ialloc(fs));
+}
+
+static void
+op_iget_iput(int thread, int i, void *arg)
+{
+    unsigned int *inos = arg;
+    (void)i;
+    iput(iget(fs, inos[thread]));
+}
+
+static void
+op_read_inode(int thread, int i, void *arg)
+{
+    struct inode in;
+    unsigned int seed = thread * 104729 + i;
+    (void)arg;
+    read_inode(fs, &in, rnd(&seed) % 1024);
+}
+
+static void
+op_write_inode(int thread, int i, void *arg)
+{
+    struct inode in;
+    (void)arg;
+    read_inode(fs, &in, 1 + thread);
+    in.inode_num = 1 + thread;
+    in.size = i;
+    write_inode(fs, &in);
+}
+
+static void
+bench_inodes(void)
+{
+    unsigned int inos[BENCH_THREADS];
+
+    fresh_image();
+    bench_run("ialloc", "", 1, 2000, op_ialloc, NULL);
+    for (int i = 0; i < BENCH_THREADS; i++)
+        inos[i] = 1 + i;
+    for (int threads = 1; threads <= BENCH_THREADS; threads *= 2)
+        bench_run("iget_iput", "", threads, 20000, op_iget_iput, inos);
+    for (int threads = 1; threads <= BENCH_THREADS; threads *= 2)
+        bench_run("read_inode", "", threads, 20000, op_read_inode, NULL);
+    for (int threads = 1; threads <= BENCH_THREADS; threads *= 2)
+        bench_run("write_inode", "", threads, 5000, op_write_inode, NULL);
+    close_image();
+}
+
+/* ---- directories ---- */
+
+static void
+op_directory_scan(int thread, int i, void *arg)
+{
+    struct directory_entry ent;
+    (void)thread; (void)i;
+    struct directory *d = directory_open(fs, *(unsigned int *)arg);
+    while (d && directory_get(d, &ent) == 0)
+        ;
+    if (d)
+        directory_close(d);
+}
+
+static void
+op_path_lookup(int thread, int i, void *arg)
+{
+    (void)thread; (void)i;
+    path_lookup(fs, arg);
+}
+
+static void
+op_directory_make(int thread, int i, void *arg)
+{
+    char path[64];
+    (void)arg;
+    snprintf(path, sizeof path, "/t%d/d%d", thread, i);
+    directory_make(fs, path);
+}
+
+static void
+bench_dirs(void)
+{
+    char params[64], path[256];
+
+    static const int sizes[] = { 4, 64, 512 };
+    for (unsigned int s = 0; s < sizeof sizes / sizeof sizes[0]; s++) {
+        fresh_image();
+        directory_make(fs, "/d");
+        for (int i = 0; i < sizes[s]; i++) {
+            snprintf(path, sizeof path, "/d/e%d", i);
+            file_make(fs, path);
+        }
+        unsigned int ino = path_lookup(fs, "/d");
+        snprintf(params, sizeof params, "entries=%d", sizes[s]);
+        bench_run("directory_get", params, 1, 2000, op_directory_scan, &ino);
+        close_image();
+    }
+
+    fresh_image();
+    strcpy(path, "");
+    for (int depth = 1; depth <= 8; depth++) {
+        snprintf(path + strlen(path), sizeof path - strlen(path), "/l%d", depth);
+        directory_make(fs, path);
+        for (int i = 0; i < 16; i++) {
+            char sib[300];
+            snprintf(sib, sizeof sib, "%s_s%d", path, i);
+            directory_make(fs, sib);
+        }
+        if (depth != 1 && depth != 4 && depth != 8)
+            continue;
+        snprintf(params, sizeof params, "depth=%d", depth);
+        for (int threads = 1; threads <= BENCH_THREADS; threads *= 2)
+            bench_run("path_lookup", params, threads, 5000, op_path_lookup, path);
+    }
+    close_image();
+
+    for (int threads = 1; threads <= BENCH_THREADS; threads *= 2) {
+        fresh_image();
+        for (int t = 0; t < threads; t++) {
+            snprintf(path, sizeof path, "/t%d", t);
+            directory_make(fs, path);
+        }
+        bench_run("directory_make", "", threads, 1000, op_directory_make, NULL);
+        close_image();
+    }
+}
+
+int main(void) {
+    bench_blocks();
+    bench_inodes();
+    bench_dirs();
+    unlink(BENCH_IMAGE);
+    return 0;
+}
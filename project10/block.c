@@ -1,4 +1,6 @@
+#include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -6,39 +8,240 @@
 #include "image.h"
 #include "block.h"
 #include "free.h"
+#include "journal.h"
+#include "inode.h"
+#include "csum.h"
+#include "stats.h"
+#include "probe.h"
 
-static pthread_mutex_t bitmap_lock = PTHREAD_MUTEX_INITIALIZER;
+// Metadata read: blocks that miss the journal cache are checked
+// against their recorded checksum, and NULL is returned on a mismatch.
+unsigned char *
+bread(struct vvsfs *fs, int block_num, unsigned char *block) {
+    STATS_START(t);
+    VVSFS_PROBE1(bread__entry, block_num);
+    unsigned char *res = block;
+    if (!journal_read(fs, block_num, block)) {
+        off_t offset = (off_t)block_num * BLOCK_SIZE;
+        if (image_pread(fs, block, BLOCK_SIZE, offset) != BLOCK_SIZE ||
+            csum_verify(fs, block_num, block) < 0)
+            res = NULL;
+    }
+    VVSFS_PROBE2(bread__return, block_num, res != NULL);
+    STATS_END(VVSFS_STAT_BREAD, t);
+    return res;
+}
 
+// File data read: the counterpart of dwrite(), without checksums.
 unsigned char *
-bread(int block_num, unsigned char *block) {
+dread(struct vvsfs *fs, int block_num, unsigned char *block) {
+    if (journal_read(fs, block_num, block)) return block;
     off_t offset = (off_t)block_num * BLOCK_SIZE;
-    if (lseek(image_fd, offset, SEEK_SET) < 0) return NULL;
-    if (read(image_fd, block, BLOCK_SIZE) != BLOCK_SIZE) return NULL;
+    if (image_data_pread(fs, block, BLOCK_SIZE, offset) != BLOCK_SIZE)
+        return NULL;
     return block;
 }
 
 void
-bwrite(int block_num, unsigned char *block) {
+bwrite(struct vvsfs *fs, int block_num, unsigned char *block) {
+    STATS_START(t);
+    VVSFS_PROBE1(bwrite__entry, block_num);
+    csum_update(fs, block_num, block);
+    if (!journal_write(fs, block_num, block)) {
+        off_t offset = (off_t)block_num * BLOCK_SIZE;
+        image_pwrite(fs, block, BLOCK_SIZE, offset);
+    }
+    VVSFS_PROBE1(bwrite__return, block_num);
+    STATS_END(VVSFS_STAT_BWRITE, t);
+}
+
+void
+dwrite(struct vvsfs *fs, int block_num, unsigned char *block) {
     off_t offset = (off_t)block_num * BLOCK_SIZE;
-    lseek(image_fd, offset, SEEK_SET);
-    write(image_fd, block, BLOCK_SIZE);
+    image_data_pwrite(fs, block, BLOCK_SIZE, offset);
+    if (fs->data_file >= 0)
+        journal_data(fs);
 }
 
 int
-alloc(void) {
+alloc(struct vvsfs *fs) {
     unsigned char map[BLOCK_SIZE];
 
-    pthread_mutex_lock(&bitmap_lock);
+    STATS_START(t);
+    VVSFS_PROBE0(alloc__entry);
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->bitmap_lock);
 
-    bread(BLOCK_MAP_BLOCK, map);
+    bread(fs, BLOCK_MAP_BLOCK, map);
     int idx = find_free(map);
     if (idx < 0) {
-        pthread_mutex_unlock(&bitmap_lock);
+        pthread_mutex_unlock(&fs->bitmap_lock);
+        journal_end(fs);
+        VVSFS_PROBE1(alloc__return, -1);
+        STATS_END(VVSFS_STAT_ALLOC, t);
         return -1;
     }
     set_free(map, idx, 1);
-    bwrite(BLOCK_MAP_BLOCK, map);
+    bwrite(fs, BLOCK_MAP_BLOCK, map);
 
-    pthread_mutex_unlock(&bitmap_lock);
+    pthread_mutex_unlock(&fs->bitmap_lock);
+    journal_end(fs);
+    VVSFS_PROBE1(alloc__return, idx);
+    STATS_END(VVSFS_STAT_ALLOC, t);
     return idx;
 }
+
+int
+alloc_batch(struct vvsfs *fs, int count, int *blocks) {
+    unsigned char map[BLOCK_SIZE];
+
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->bitmap_lock);
+
+    bread(fs, BLOCK_MAP_BLOCK, map);
+    int first = find_free_run(map, count);
+    for (int i = 0; i < count; i++) {
+        int idx = (first >= 0) ? first + i : find_free(map);
+        if (idx < 0) {
+            pthread_mutex_unlock(&fs->bitmap_lock);
+            journal_end(fs);
+            return -1;
+        }
+        set_free(map, idx, 1);
+        blocks[i] = idx;
+    }
+    bwrite(fs, BLOCK_MAP_BLOCK, map);
+
+    pthread_mutex_unlock(&fs->bitmap_lock);
+    journal_end(fs);
+    return count;
+}
+
+/*
+ * The refcount table holds one byte per block counting references
+ * beyond the first, so a zeroed table means every allocated block has
+ * a single owner. fs->refs keeps all of it in core; it changes only
+ * under bitmap_lock, together with the journaled block, so
+ * brefcount() reads one byte with neither the lock nor a bread().
+ */
+int
+refcount_init(struct vvsfs *fs)
+{
+    fs->refs = calloc(1, (size_t)REFCOUNT_BLOCK_COUNT * BLOCK_SIZE);
+    return fs->refs ? 0 : -1;
+}
+
+void
+refcount_destroy(struct vvsfs *fs)
+{
+    free(fs->refs);
+    fs->refs = NULL;
+}
+
+// Called once the journal is replayed, before the image is shared.
+void
+refcount_load(struct vvsfs *fs)
+{
+    for (int i = 0; i < REFCOUNT_BLOCK_COUNT; i++) {
+        unsigned char *refs = fs->refs + (size_t)i * BLOCK_SIZE;
+        if (!bread(fs, REFCOUNT_FIRST_BLOCK + i, refs))
+            memset(refs, 0, BLOCK_SIZE);
+    }
+}
+
+static void
+refcount_loc(int block_num, int *ref_block, int *ref_off)
+{
+    *ref_block = REFCOUNT_FIRST_BLOCK + block_num / BLOCK_SIZE;
+    *ref_off   = block_num % BLOCK_SIZE;
+}
+
+// Called with bitmap_lock held.
+static void
+refcount_read(struct vvsfs *fs, int ref_block, unsigned char *refs)
+{
+    memcpy(refs, fs->refs + (size_t)(ref_block - REFCOUNT_FIRST_BLOCK) *
+                 BLOCK_SIZE, BLOCK_SIZE);
+}
+
+// Called with bitmap_lock held; refs is the table block holding it.
+static void
+refcount_write(struct vvsfs *fs, int block_num, int ref_block,
+               unsigned char *refs)
+{
+    __atomic_store_n(&fs->refs[block_num], refs[block_num % BLOCK_SIZE],
+                     __ATOMIC_RELAXED);
+    bwrite(fs, ref_block, refs);
+}
+
+void
+bfree(struct vvsfs *fs, int block_num) {
+    unsigned char map[BLOCK_SIZE];
+    unsigned char refs[BLOCK_SIZE];
+    int ref_block, ref_off;
+    refcount_loc(block_num, &ref_block, &ref_off);
+
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->bitmap_lock);
+    refcount_read(fs, ref_block, refs);
+    if (refs[ref_off] > 0) {
+        refs[ref_off]--;
+        refcount_write(fs, block_num, ref_block, refs);
+    } else {
+        bread(fs, BLOCK_MAP_BLOCK, map);
+        set_free(map, block_num, 0);
+        bwrite(fs, BLOCK_MAP_BLOCK, map);
+    }
+    pthread_mutex_unlock(&fs->bitmap_lock);
+    journal_end(fs);
+}
+
+int
+bref(struct vvsfs *fs, int block_num) {
+    unsigned char refs[BLOCK_SIZE];
+    int ref_block, ref_off;
+    refcount_loc(block_num, &ref_block, &ref_off);
+
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->bitmap_lock);
+    refcount_read(fs, ref_block, refs);
+    int ok = refs[ref_off] < BLOCK_REF_MAX;
+    if (ok) {
+        refs[ref_off]++;
+        refcount_write(fs, block_num, ref_block, refs);
+    }
+    pthread_mutex_unlock(&fs->bitmap_lock);
+    journal_end(fs);
+    return ok ? 0 : -1;
+}
+
+/*
+ * Like bref(), but only for a block that is still allocated, checked
+ * under the same lock that frees it.
+ */
+int
+bshare(struct vvsfs *fs, int block_num) {
+    unsigned char map[BLOCK_SIZE];
+    unsigned char refs[BLOCK_SIZE];
+    int ref_block, ref_off;
+    refcount_loc(block_num, &ref_block, &ref_off);
+
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->bitmap_lock);
+    bread(fs, BLOCK_MAP_BLOCK, map);
+    refcount_read(fs, ref_block, refs);
+    int ok = (map[block_num / 8] & (1 << (block_num % 8))) &&
+             refs[ref_off] < BLOCK_REF_MAX;
+    if (ok) {
+        refs[ref_off]++;
+        refcount_write(fs, block_num, ref_block, refs);
+    }
+    pthread_mutex_unlock(&fs->bitmap_lock);
+    journal_end(fs);
+    return ok ? 0 : -1;
+}
+
+int
+brefcount(struct vvsfs *fs, int block_num) {
+    return __atomic_load_n(&fs->refs[block_num], __ATOMIC_RELAXED) + 1;
+}
@@ -4,9 +4,23 @@
 #define BLOCK_SIZE       4096
 #define INODE_MAP_BLOCK  1
 #define BLOCK_MAP_BLOCK  2
+#define BLOCK_REF_MAX    255
 
-unsigned char *bread(int block_num, unsigned char *block);
-void bwrite(int block_num, unsigned char *block);
-int alloc(void);
+struct vvsfs;
+
+unsigned char *bread(struct vvsfs *fs, int block_num, unsigned char *block);
+unsigned char *dread(struct vvsfs *fs, int block_num, unsigned char *block);
+void bwrite(struct vvsfs *fs, int block_num, unsigned char *block);
+void dwrite(struct vvsfs *fs, int block_num, unsigned char *block);
+int alloc(struct vvsfs *fs);
+int alloc_batch(struct vvsfs *fs, int count, int *blocks);
+void bfree(struct vvsfs *fs, int block_num);
+int  bref(struct vvsfs *fs, int block_num);
+int  bshare(struct vvsfs *fs, int block_num);
+int  brefcount(struct vvsfs *fs, int block_num);
+
+int  refcount_init(struct vvsfs *fs);
+void refcount_load(struct vvsfs *fs);
+void refcount_destroy(struct vvsfs *fs);
 
 #endif
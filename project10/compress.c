@@ -0,0 +1,131 @@
+#include <string.h>
+#include "compress.h"
+
+/*
+ * LZ4 block format: each sequence is a token (literal length in the
+ * high nibble, match length - 4 in the low), optional length extension
+ * bytes, the literals, a little-endian 16-bit match offset and optional
+ * match length extension bytes. The final sequence is literals only.
+ */
+#define LZ_MIN_MATCH  4
+#define LZ_HASH_BITS  12
+#define LZ_LAST_LIT   5
+#define LZ_MATCH_END  12
+
+static unsigned int
+lz_hash(const unsigned char *p)
+{
+    unsigned int v;
+    memcpy(&v, p, sizeof v);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static int
+lz_put_len(unsigned char *dst, int op, int cap, int len)
+{
+    for (; len >= 255; len -= 255) {
+        if (op >= cap) return -1;
+        dst[op++] = 255;
+    }
+    if (op >= cap) return -1;
+    dst[op++] = len;
+    return op;
+}
+
+static int
+lz_emit(unsigned char *dst, int op, int cap,
+        const unsigned char *lit, int nlit, int offset, int mlen)
+{
+    if (op >= cap) return -1;
+    int tok = op++;
+    int ml  = mlen ? mlen - LZ_MIN_MATCH : 0;
+    dst[tok] = (nlit >= 15 ? 15 : nlit) << 4 | (ml >= 15 ? 15 : ml);
+
+    if (nlit >= 15 && (op = lz_put_len(dst, op, cap, nlit - 15)) < 0)
+        return -1;
+    if (op + nlit > cap) return -1;
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+
+    if (!mlen)
+        return op;
+    if (op + 2 > cap) return -1;
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    if (ml >= 15 && (op = lz_put_len(dst, op, cap, ml - 15)) < 0)
+        return -1;
+    return op;
+}
+
+int
+lz_compress(const unsigned char *src, int len, unsigned char *dst, int cap)
+{
+    int table[1 << LZ_HASH_BITS];
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        table[i] = -1;
+
+    int ip = 0, anchor = 0, op = 0;
+    while (ip < len - LZ_MATCH_END) {
+        unsigned int h = lz_hash(src + ip);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > 65535 ||
+            memcmp(src + ref, src + ip, LZ_MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        int mlen = LZ_MIN_MATCH;
+        while (ip + mlen < len - LZ_LAST_LIT && src[ref + mlen] == src[ip + mlen])
+            mlen++;
+        op = lz_emit(dst, op, cap, src + anchor, ip - anchor, ip - ref, mlen);
+        if (op < 0) return -1;
+        ip    += mlen;
+        anchor = ip;
+    }
+    return lz_emit(dst, op, cap, src + anchor, len - anchor, 0, 0);
+}
+
+int
+lz_decompress(const unsigned char *src, int len, unsigned char *dst, int cap)
+{
+    int ip = 0, op = 0;
+    while (ip < len) {
+        int tok  = src[ip++];
+        int nlit = tok >> 4;
+        if (nlit == 15) {
+            int b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                nlit += b;
+            } while (b == 255);
+        }
+        if (ip + nlit > len || op + nlit > cap) return -1;
+        memcpy(dst + op, src + ip, nlit);
+        ip += nlit;
+        op += nlit;
+        if (ip >= len)
+            break;
+
+        if (ip + 2 > len) return -1;
+        int offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > op) return -1;
+
+        int mlen = tok & 15;
+        if (mlen == 15) {
+            int b;
+            do {
+                if (ip >= len) return -1;
+                b = src[ip++];
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if (op + mlen > cap) return -1;
+        for (int i = 0; i < mlen; i++, op++)
+            dst[op] = dst[op - offset];
+    }
+    return op;
+}
@@ -0,0 +1,9 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+int lz_compress(const unsigned char *src, int len,
+                unsigned char *dst, int cap);
+int lz_decompress(const unsigned char *src, int len,
+                  unsigned char *dst, int cap);
+
+#endif
@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "pack.h"
+#include "csum.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_HW 1
+#endif
+
+/*
+ * CRC32C (Castagnoli). The software path is slicing-by-8: eight 256
+ * entry tables let each step fold in eight input bytes. On x86-64 with
+ * SSE4.2 the crc32 instruction does the same eight bytes per cycle or
+ * so, and is picked at run time.
+ */
+#define CRC32C_POLY 0x82F63B78u
+
+static unsigned int    crc_table[8][256];
+static pthread_once_t  crc_once = PTHREAD_ONCE_INIT;
+static int             crc_hw;
+
+static void
+crc_init(void)
+{
+    for (unsigned int i = 0; i < 256; i++) {
+        unsigned int c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ (CRC32C_POLY & -(c & 1));
+        crc_table[0][i] = c;
+    }
+    for (unsigned int i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^
+                              crc_table[0][crc_table[t - 1][i] & 0xFF];
+#ifdef CRC32C_HW
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+unsigned int
+crc32c_sw(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+
+    pthread_once(&crc_once, crc_init);
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        unsigned int lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= crc;
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^
+              crc_table[3][hi & 0xFF] ^ crc_table[2][(hi >> 8) & 0xFF] ^
+              crc_table[1][(hi >> 16) & 0xFF] ^ crc_table[0][hi >> 24];
+    }
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+    return ~crc;
+}
+
+#ifdef CRC32C_HW
+__attribute__((target("sse4.2")))
+static unsigned int
+crc32c_hw(unsigned int crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    unsigned long long c = ~crc;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        unsigned long long w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    while (len--)
+        c = _mm_crc32_u8((unsigned int)c, *p++);
+    return ~(unsigned int)c;
+}
+#endif
+
+unsigned int
+crc32c(unsigned int crc, const void *buf, size_t len)
+{
+    pthread_once(&crc_once, crc_init);
+#ifdef CRC32C_HW
+    if (crc_hw)
+        return crc32c_hw(crc, buf, len);
+#endif
+    return crc32c_sw(crc, buf, len);
+}
+
+/*
+ * The checksum table holds a u32 CRC32C per block, 0 meaning "none
+ * recorded" (a real 0 is stored as 1). It is kept in memory and
+ * written through bwrite() next to the block it covers, so both land
+ * in the same journal transaction. Blocks written with dwrite() never
+ * get an entry; file data is read back with dread(), which does not
+ * verify, so a stale entry on a reused block is harmless.
+ */
+struct csum_table {
+    pthread_mutex_t lock;
+    unsigned long   bad;
+    unsigned char   table[CSUM_BLOCK_COUNT * BLOCK_SIZE];
+};
+
+int
+csum_init(struct vvsfs *fs)
+{
+    struct csum_table *c = calloc(1, sizeof *c);
+    if (!c)
+        return -1;
+    pthread_mutex_init(&c->lock, NULL);
+    fs->csum = c;
+    return 0;
+}
+
+void
+csum_destroy(struct vvsfs *fs)
+{
+    if (!fs->csum)
+        return;
+    pthread_mutex_destroy(&fs->csum->lock);
+    free(fs->csum);
+    fs->csum = NULL;
+}
+
+static int
+csum_covered(int block_num)
+{
+    if (block_num <= 0 || block_num >= BLOCK_SIZE * 8)
+        return 0;
+    if (block_num >= JOURNAL_FIRST_BLOCK &&
+        block_num < JOURNAL_FIRST_BLOCK + JOURNAL_BLOCK_COUNT)
+        return 0;
+    return block_num < CSUM_FIRST_BLOCK ||
+           block_num >= CSUM_FIRST_BLOCK + CSUM_BLOCK_COUNT;
+}
+
+static unsigned int
+csum_block(const unsigned char *block)
+{
+    unsigned int crc = crc32c(0, block, BLOCK_SIZE);
+    return crc ? crc : 1;
+}
+
+void
+csum_load(struct vvsfs *fs)
+{
+    struct csum_table *c = fs->csum;
+
+    pthread_mutex_lock(&c->lock);
+    for (int i = 0; i < CSUM_BLOCK_COUNT; i++)
+        if (!bread(fs, CSUM_FIRST_BLOCK + i, c->table + (size_t)i * BLOCK_SIZE))
+            memset(c->table + (size_t)i * BLOCK_SIZE, 0, BLOCK_SIZE);
+    c->bad = 0;
+    pthread_mutex_unlock(&c->lock);
+}
+
+void
+csum_update(struct vvsfs *fs, int block_num, const unsigned char *block)
+{
+    struct csum_table *c = fs->csum;
+    if (!csum_covered(block_num))
+        return;
+    unsigned int crc = csum_block(block);
+    size_t off = (size_t)block_num * 4;
+
+    pthread_mutex_lock(&c->lock);
+    if (read_u32(c->table + off) != crc) {
+        write_u32(c->table + off, crc);
+        bwrite(fs, CSUM_FIRST_BLOCK + off / BLOCK_SIZE,
+               c->table + off / BLOCK_SIZE * BLOCK_SIZE);
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Returns 0 when the block matches its recorded checksum or has none.
+int
+csum_verify(struct vvsfs *fs, int block_num, const unsigned char *block)
+{
+    struct csum_table *c = fs->csum;
+    if (!csum_covered(block_num))
+        return 0;
+    pthread_mutex_lock(&c->lock);
+    unsigned int want = read_u32(c->table + (size_t)block_num * 4);
+    pthread_mutex_unlock(&c->lock);
+    if (want == 0 || csum_block(block) == want)
+        return 0;
+
+    pthread_mutex_lock(&c->lock);
+    c->bad++;
+    pthread_mutex_unlock(&c->lock);
+    return -1;
+}
+
+unsigned long
+csum_errors(struct vvsfs *fs)
+{
+    struct csum_table *c = fs->csum;
+    pthread_mutex_lock(&c->lock);
+    unsigned long n = c->bad;
+    pthread_mutex_unlock(&c->lock);
+    return n;
+}
@@ -0,0 +1,18 @@
+#ifndef CSUM_H
+#define CSUM_H
+
+#include <stddef.h>
+
+unsigned int crc32c(unsigned int crc, const void *buf, size_t len);
+unsigned int crc32c_sw(unsigned int crc, const void *buf, size_t len);
+
+struct vvsfs;
+
+int  csum_init(struct vvsfs *fs);
+void csum_destroy(struct vvsfs *fs);
+void csum_load(struct vvsfs *fs);
+void csum_update(struct vvsfs *fs, int block_num, const unsigned char *block);
+int  csum_verify(struct vvsfs *fs, int block_num, const unsigned char *block);
+unsigned long csum_errors(struct vvsfs *fs);
+
+#endif
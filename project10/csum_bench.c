@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "block.h"
+#include "csum.h"
+
+#define BENCH_BYTES (256u << 20)
+
+static double
+now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+run(const char *name,
+    unsigned int (*fn)(unsigned int, const void *, size_t),
+    const unsigned char *buf)
+{
+    unsigned int crc = 0;
+    double start = now();
+    for (unsigned int done = 0; done < BENCH_BYTES; done += BLOCK_SIZE)
+        crc = fn(crc, buf + done % (1u << 20), BLOCK_SIZE);
+    double secs = now() - start;
+    printf("%-10s %8.1f MB/s  %6.0f ns/block  (crc %08x)\n", name,
+           BENCH_BYTES / secs / 1e6, secs * 1e9 / (BENCH_BYTES / BLOCK_SIZE),
+           crc);
+}
+
+int main(void) {
+    unsigned char *buf = malloc(1u << 20);
+    if (!buf)
+        return 1;
+    for (unsigned int i = 0; i < (1u << 20); i++)
+        buf[i] = (unsigned char)(i * 2654435761u >> 24);
+
+    run("crc32c", crc32c, buf);
+    run("slice-by-8", crc32c_sw, buf);
+    free(buf);
+    return 0;
+}
@@ -5,6 +5,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #define CTEST(suite, name) \
     void test_##suite##_##name(void)
@@ -48,5 +50,164 @@ do { \
         100.0 * ctest_pass_count / t); \
 } while (0)
 
+/*
+ * Benchmarks. A CTEST_BENCH case does its setup, then times a body with
+ * CTEST_BENCH_LOOP(iters, warmup) { ... }: the warmup runs are not
+ * recorded, and min/median/mean/stddev of the rest are printed. The
+ * median can then be checked against a fixed bound with
+ * CTEST_BENCH_EXPECT(ns, m) and against the baseline file set with
+ * CTEST_BENCH_BASELINE(path, tolerance_pct): a case missing from the
+ * file (or every case, when CTEST_BENCH_UPDATE is set in the
+ * environment) is recorded instead of checked. Medians only compare on
+ * the machine that recorded them, so a NULL path (the default) skips
+ * the baseline check and never touches a file.
+ */
+#define CTEST_BENCH(suite, name) \
+    void bench_##suite##_##name(void)
+
+struct ctest_bench {
+    int            iters, warmup, done;
+    unsigned long  start;
+    unsigned long *samples;
+    unsigned long  min, median;
+    double         mean, stddev;
+};
+
+const char *ctest_bench_file      = NULL;
+int         ctest_bench_tolerance = 0;
+
+#define CTEST_BENCH_BASELINE(path, pct) \
+    do { ctest_bench_file = (path); ctest_bench_tolerance = (pct); } while (0)
+
+static unsigned long
+ctest_bench_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+static int
+ctest_bench_cmp(const void *a, const void *b)
+{
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+static void
+ctest_bench_begin(struct ctest_bench *b, int iters, int warmup)
+{
+    memset(b, 0, sizeof *b);
+    b->iters   = iters;
+    b->warmup  = warmup;
+    b->samples = calloc(iters > 0 ? iters : 1, sizeof *b->samples);
+}
+
+static void
+ctest_bench_stats(struct ctest_bench *b, const char *name)
+{
+    int n = b->iters;
+    double sum = 0, sq = 0;
+
+    qsort(b->samples, n, sizeof *b->samples, ctest_bench_cmp);
+    for (int i = 0; i < n; i++)
+        sum += b->samples[i];
+    b->mean = sum / n;
+    for (int i = 0; i < n; i++)
+        sq += (b->samples[i] - b->mean) * (b->samples[i] - b->mean);
+    // Newton's method, to stay clear of libm.
+    double v = sq / n, r = v > 1 ? v : 1;
+    for (int i = 0; i < 64; i++)
+        r = (r + v / r) / 2;
+    b->stddev = v > 0 ? r : 0;
+    b->min    = b->samples[0];
+    b->median = b->samples[n / 2];
+    free(b->samples);
+    b->samples = NULL;
+
+    if (ctest_verbose)
+        printf("BENCH: %s: n=%d min=%luns median=%luns mean=%.0fns "
+               "stddev=%.0fns\n", name, n, b->min, b->median, b->mean,
+               b->stddev);
+}
+
+static int
+ctest_bench_next(struct ctest_bench *b, const char *name)
+{
+    unsigned long now = ctest_bench_now();
+    if (b->start) {
+        if (b->done >= b->warmup && b->samples)
+            b->samples[b->done - b->warmup] = now - b->start;
+        b->done++;
+    }
+    if (!b->samples || b->done == b->iters + b->warmup) {
+        if (b->samples)
+            ctest_bench_stats(b, name);
+        return 0;
+    }
+    b->start = ctest_bench_now();
+    return 1;
+}
+
+/*
+ * Baseline file lines are "<name> <median ns>". Returns the stored
+ * median for name, or 0 after recording the new one.
+ */
+static unsigned long
+ctest_bench_baseline(const char *name, unsigned long median)
+{
+    char line[256], key[200];
+    unsigned long value, found = 0;
+    char *text = calloc(1, 1);
+    size_t len = 0;
+
+    FILE *fp = fopen(ctest_bench_file, "r");
+    while (fp && text && fgets(line, sizeof line, fp)) {
+        if (sscanf(line, "%199s %lu", key, &value) == 2 &&
+            strcmp(key, name) == 0) {
+            found = value;
+            continue;
+        }
+        char *grown = realloc(text, len + strlen(line) + 1);
+        if (!grown)
+            break;
+        text = grown;
+        strcpy(text + len, line);
+        len += strlen(line);
+    }
+    if (fp)
+        fclose(fp);
+
+    if (text && (!found || getenv("CTEST_BENCH_UPDATE"))) {
+        fp = fopen(ctest_bench_file, "w");
+        if (fp) {
+            fprintf(fp, "%s%s %lu\n", text, name, median);
+            fclose(fp);
+        }
+        found = 0;
+    }
+    free(text);
+    return found;
+}
+
+#define CTEST_BENCH_LOOP(n, w) \
+    for (ctest_bench_begin(&ctest_bench_state, (n), (w)); \
+         ctest_bench_next(&ctest_bench_state, __func__); )
+
+struct ctest_bench ctest_bench_state;
+
+#define CTEST_BENCH_EXPECT(ns, m) \
+    CTEST_ASSERT(ctest_bench_state.median <= (unsigned long)(ns), m)
+
+#define CTEST_BENCH_CHECK_BASELINE(m) \
+do { \
+    if (ctest_bench_file) { \
+        unsigned long base = ctest_bench_baseline(__func__, \
+                                                  ctest_bench_state.median); \
+        CTEST_ASSERT(base == 0 || ctest_bench_state.median <= \
+                     base + base * ctest_bench_tolerance / 100, m); \
+    } \
+} while (0)
+
 #endif /* CTEST_ENABLE */
 #endif /* CTEST_H */
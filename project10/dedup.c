@@ -0,0 +1,209 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "file.h"
+#include "journal.h"
+#include "pack.h"
+#include "dedup.h"
+
+/*
+ * The fingerprint index is a hash table spread over DEDUP_BLOCK_COUNT
+ * blocks: a fingerprint picks one index block and a starting slot in
+ * it, and lookups probe DEDUP_PROBE slots from there. Each slot holds
+ * the fingerprint (two u32s) and the block number, 0 meaning empty.
+ * The index is only a hint: a full probe window overwrites its first
+ * slot, and a candidate block is always compared byte for byte before
+ * it is shared, so stale entries cost a read but never corrupt data.
+ */
+unsigned long long
+dedup_fingerprint(const unsigned char *block)
+{
+    unsigned long long h = 0x9E3779B97F4A7C15ull;
+    for (int i = 0; i < BLOCK_SIZE; i += 8) {
+        unsigned long long w;
+        memcpy(&w, block + i, sizeof w);
+        h ^= w * 0xC2B2AE3D27D4EB4Full;
+        h = ((h << 31) | (h >> 33)) * 0x9E3779B97F4A7C15ull;
+    }
+    h ^= h >> 29;
+    h *= 0xBF58476D1CE4E5B9ull;
+    return h ^ (h >> 32);
+}
+
+static int
+index_block(struct vvsfs *fs, unsigned long long fp, unsigned char *block)
+{
+    int bnum = DEDUP_FIRST_BLOCK + (int)(fp % DEDUP_BLOCK_COUNT);
+    if (!bread(fs, bnum, block))
+        memset(block, 0, BLOCK_SIZE);
+    return bnum;
+}
+
+static unsigned char *
+index_slot(unsigned char *block, unsigned long long fp, int probe)
+{
+    int slot = (int)((fp >> 32) % DEDUP_SLOTS);
+    return block + ((slot + probe) % DEDUP_SLOTS) * DEDUP_SLOT_SIZE;
+}
+
+static int
+slot_match(unsigned char *slot, unsigned long long fp)
+{
+    return read_u32(slot) == (unsigned int)(fp >> 32) &&
+           read_u32(slot + 4) == (unsigned int)fp;
+}
+
+// Returns a block already holding these bytes with a reference taken
+// for the caller, or -1.
+int
+dedup_share(struct vvsfs *fs, const unsigned char *data, unsigned long long fp)
+{
+    unsigned char block[BLOCK_SIZE];
+    int cand[DEDUP_PROBE];
+    int n = 0;
+
+    pthread_mutex_lock(&fs->dedup_lock);
+    index_block(fs, fp, block);
+    for (int p = 0; p < DEDUP_PROBE; p++) {
+        unsigned char *slot = index_slot(block, fp, p);
+        int bnum = read_u32(slot + 8);
+        if (bnum == 0)
+            break;
+        if (slot_match(slot, fp))
+            cand[n++] = bnum;
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+
+    for (int i = 0; i < n; i++) {
+        if (cand[i] < DATA_FIRST_BLOCK || cand[i] >= BLOCK_SIZE * 8)
+            continue;
+        if (!dread(fs, cand[i], block) || memcmp(block, data, BLOCK_SIZE) != 0)
+            continue;
+        if (bshare(fs, cand[i]) < 0)
+            continue;
+        // Recheck now that the extra reference stops in-place rewrites.
+        if (dread(fs, cand[i], block) && memcmp(block, data, BLOCK_SIZE) == 0)
+            return cand[i];
+        bfree(fs, cand[i]);
+    }
+    return -1;
+}
+
+void
+dedup_insert(struct vvsfs *fs, unsigned long long fp, int block_num)
+{
+    unsigned char block[BLOCK_SIZE];
+
+    journal_begin(fs);
+    pthread_mutex_lock(&fs->dedup_lock);
+    int bnum = index_block(fs, fp, block);
+    unsigned char *slot = index_slot(block, fp, 0);
+    for (int p = 0; p < DEDUP_PROBE; p++) {
+        unsigned char *s = index_slot(block, fp, p);
+        if (read_u32(s + 8) == 0 || slot_match(s, fp)) {
+            slot = s;
+            break;
+        }
+    }
+    if (!(slot_match(slot, fp) && (int)read_u32(slot + 8) == block_num)) {
+        write_u32(slot, fp >> 32);
+        write_u32(slot + 4, (unsigned int)fp);
+        write_u32(slot + 8, block_num);
+        bwrite(fs, bnum, block);
+    }
+    pthread_mutex_unlock(&fs->dedup_lock);
+    journal_end(fs);
+}
+
+/*
+ * Offline pass over every file in the image: blocks whose contents
+ * were seen earlier in the pass are remapped to the first copy and
+ * released, and every surviving block is added to the on-disk index so
+ * later writes can share it. Compressed clusters are left alone since
+ * their payload blocks key the decompressed-cluster cache. Returns the
+ * number of block pointers remapped.
+ */
+#define SEEN_SIZE (BLOCK_SIZE * 8 * 2)
+
+struct seen {
+    unsigned long long fp;
+    int                block_num;
+};
+
+static int
+seen_lookup(struct vvsfs *fs, struct seen *seen, unsigned long long fp,
+            int block_num, const unsigned char *data)
+{
+    unsigned char block[BLOCK_SIZE];
+    unsigned int h = (unsigned int)(fp % SEEN_SIZE);
+
+    for (;; h = (h + 1) % SEEN_SIZE) {
+        if (seen[h].block_num == 0) {
+            seen[h].fp = fp;
+            seen[h].block_num = block_num;
+            return block_num;
+        }
+        if (seen[h].block_num == block_num)
+            return block_num;
+        if (seen[h].fp == fp &&
+            dread(fs, seen[h].block_num, block) &&
+            memcmp(block, data, BLOCK_SIZE) == 0)
+            return seen[h].block_num;
+    }
+}
+
+int
+dedup_image(struct vvsfs *fs)
+{
+    unsigned char map[BLOCK_SIZE];
+    unsigned char data[BLOCK_SIZE];
+    int remapped = 0;
+
+    struct seen *seen = calloc(SEEN_SIZE, sizeof *seen);
+    if (!seen)
+        return -1;
+    bread(fs, INODE_MAP_BLOCK, map);
+
+    for (unsigned int ino = 0; ino < INODE_COUNT; ino++) {
+        if (!(map[ino / 8] & (1 << (ino % 8))))
+            continue;
+        journal_begin(fs);
+        struct inode *in = iget(fs, ino);
+        if (!in || !(in->flags & INODE_FLAG_FILE) ||
+            (in->flags & INODE_FLAG_INLINE)) {
+            iput(in);
+            journal_end(fs);
+            continue;
+        }
+        file_flush(in);
+
+        int dirty = 0;
+        for (int i = 0; i < INODE_PTR_COUNT; i++) {
+            int first = i - i % COMPRESS_CLUSTER_BLOCKS;
+            int bnum = in->block_ptr[i];
+            if (bnum == 0 || in->block_ptr[first] == COMPRESS_ADDR)
+                continue;
+            dread(fs, bnum, data);
+            unsigned long long fp = dedup_fingerprint(data);
+            int keep = seen_lookup(fs, seen, fp, bnum, data);
+            if (keep != bnum && bshare(fs, keep) == 0) {
+                bfree(fs, bnum);
+                in->block_ptr[i] = keep;
+                dirty = 1;
+                remapped++;
+            } else {
+                keep = bnum;
+            }
+            dedup_insert(fs, fp, keep);
+        }
+        if (dirty)
+            write_inode(fs, in);
+        iput(in);
+        journal_end(fs);
+    }
+    free(seen);
+    return remapped;
+}
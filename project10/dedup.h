@@ -0,0 +1,16 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#define DEDUP_SLOT_SIZE  16
+#define DEDUP_SLOTS      (BLOCK_SIZE / DEDUP_SLOT_SIZE)
+#define DEDUP_PROBE      16
+
+struct vvsfs;
+
+unsigned long long dedup_fingerprint(const unsigned char *block);
+int  dedup_share(struct vvsfs *fs, const unsigned char *block,
+                 unsigned long long fp);
+void dedup_insert(struct vvsfs *fs, unsigned long long fp, int block_num);
+int  dedup_image(struct vvsfs *fs);
+
+#endif
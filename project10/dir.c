@@ -2,47 +2,180 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 #include <pthread.h>
 #include "image.h"
 #include "block.h"
 #include "inode.h"
 #include "dir.h"
 #include "pack.h"
+#include "free.h"
+#include "journal.h"
+#include "file.h"
+#include "super.h"
+#include "stats.h"
+#include "probe.h"
 
 #define DIRECTORY_ENTRY_SIZE 32
 
-static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
-
-void
-mkfs(const char *image_name)
+/*
+ * Small directories keep their entries inside the inode: "." is implied,
+ * ".." is a u16 at the start of inline_data, and the rest are packed
+ * (u16 inode, 15-byte name) records. Entry offsets still advance in
+ * DIRECTORY_ENTRY_SIZE steps so size means the same thing either way.
+ */
+static void
+directory_inline_init(struct inode *in, unsigned int parent_ino)
 {
-    image_open((char *)image_name, 1);
+    in->flags = INODE_FLAG_DIR | INODE_FLAG_INLINE;
+    in->size  = 2 * DIRECTORY_ENTRY_SIZE;
+    memset(in->inline_data, 0, INODE_INLINE_SIZE);
+    write_u16(in->inline_data, parent_ino);
+}
 
-    struct inode *in       = ialloc();
-    unsigned int  root_ino = in->inode_num;
-    unsigned int  blk      = alloc();
+static void
+directory_inline_get(struct inode *in, unsigned int idx,
+                     struct directory_entry *ent)
+{
+    memset(ent->name, 0, sizeof ent->name);
+    if (idx == 0) {
+        ent->inode_num = in->inode_num;
+        strcpy(ent->name, ".");
+    } else if (idx == 1) {
+        ent->inode_num = read_u16(in->inline_data);
+        strcpy(ent->name, "..");
+    } else {
+        directory_entry_unpack(ent, in->inline_data + 2 +
+                                    (idx - 2) * DIRECTORY_INLINE_ENTRY);
+    }
+}
 
-    in->flags        = 2;
-    in->size         = 2 * DIRECTORY_ENTRY_SIZE;
-    in->block_ptr[0] = blk;
+static int
+directory_spill_inline(struct inode *dir)
+{
+    struct vvsfs *fs = dir->fs;
+    int blk = alloc(fs);
+    if (blk < 0)
+        return -1;
 
     unsigned char buf[BLOCK_SIZE];
     memset(buf, 0, BLOCK_SIZE);
+    unsigned int count = dir->size / DIRECTORY_ENTRY_SIZE;
+    for (unsigned int i = 0; i < count; i++) {
+        struct directory_entry ent;
+        unsigned int off = i * DIRECTORY_ENTRY_SIZE;
+        directory_inline_get(dir, i, &ent);
+        directory_entry_pack(&ent, buf + off);
+    }
+    bwrite(fs, blk, buf);
 
-    write_u16(buf + 0, root_ino);
-    strcpy((char *)(buf + 2), ".");
+    dir->flags &= ~INODE_FLAG_INLINE;
+    memset(dir->inline_data, 0, INODE_INLINE_SIZE);
+    dir->block_ptr[0] = blk;
+    return 0;
+}
 
-    write_u16(buf + DIRECTORY_ENTRY_SIZE, root_ino);
-    strcpy((char *)(buf + DIRECTORY_ENTRY_SIZE + 2), "..");
+static int
+directory_add(struct inode *dir, unsigned int inode_num, const char *name)
+{
+    struct vvsfs *fs = dir->fs;
+    unsigned int count = dir->size / DIRECTORY_ENTRY_SIZE;
+    struct directory_entry ent = { .inode_num = inode_num };
+    strncpy(ent.name, name, DIRECTORY_INLINE_NAME);
+
+    if (dir->flags & INODE_FLAG_INLINE) {
+        if (count < DIRECTORY_INLINE_MAX) {
+            directory_entry_pack(&ent, dir->inline_data + 2 +
+                                       (count - 2) * DIRECTORY_INLINE_ENTRY);
+            dir->size += DIRECTORY_ENTRY_SIZE;
+            return 0;
+        }
+        if (directory_spill_inline(dir) < 0)
+            return -1;
+    }
 
-    bwrite(blk, buf);
+    unsigned int  idx = dir->size / BLOCK_SIZE;
+    unsigned int  off = dir->size % BLOCK_SIZE;
+    unsigned char buf[BLOCK_SIZE];
+    if (off == 0) {
+        if (idx >= INODE_PTR_COUNT)
+            return -1;
+        int blk = alloc(fs);
+        if (blk < 0)
+            return -1;
+        dir->block_ptr[idx] = blk;
+        memset(buf, 0, BLOCK_SIZE);
+    } else {
+        bread(fs, dir->block_ptr[idx], buf);
+    }
+    directory_entry_pack(&ent, buf + off);
+    bwrite(fs, dir->block_ptr[idx], buf);
+    dir->size += DIRECTORY_ENTRY_SIZE;
+    return 0;
+}
+
+// Formats a just-created image; closes it and returns NULL on failure.
+static struct vvsfs *
+mkfs_format(struct vvsfs *fs)
+{
+    // One ftruncate() per file sizes the image; everything unwritten
+    // reads as zeros, so only the blocks below are ever written.
+    if (!fs)
+        return NULL;
+    if (image_truncate(fs, (off_t)IMAGE_BLOCK_COUNT * BLOCK_SIZE) < 0) {
+        vvsfs_close(fs);
+        return NULL;
+    }
+    journal_begin(fs);
+    super_format(fs);
+
+    unsigned char map[BLOCK_SIZE];
+    memset(map, 0, BLOCK_SIZE);
+    bwrite(fs, INODE_MAP_BLOCK, map);
+    for (int i = 0; i < DATA_FIRST_BLOCK; i++)
+        set_free(map, i, 1);
+    bwrite(fs, BLOCK_MAP_BLOCK, map);
+
+    struct inode *in = ialloc(fs);
+    directory_inline_init(in, in->inode_num);
     iput(in);
+    journal_end(fs);
+    return fs;
+}
+
+// Creates a fresh image and returns it open, or NULL.
+struct vvsfs *
+mkfs(const char *image_name)
+{
+    return mkfs_format(vvsfs_open(image_name, 1));
+}
+
+// mkfs() over a stripe set; see vvsfs_open_striped().
+struct vvsfs *
+mkfs_striped(const char *const *files, int nfiles, unsigned int stripe_blocks)
+{
+    return mkfs_format(vvsfs_open_striped(files, nfiles, stripe_blocks, 1));
+}
+
+// mkfs() with file data in its own file; see vvsfs_open_tiered().
+struct vvsfs *
+mkfs_tiered(const char *meta_file, const char *data_file)
+{
+    return mkfs_format(vvsfs_open_tiered(meta_file, data_file, 1));
+}
+
+void
+directory_init(struct directory *d, struct inode *in)
+{
+    d->inode      = in;
+    d->offset     = 0;
+    d->cached_blk = -1;
 }
 
 struct directory *
-directory_open(unsigned int inode_num)
+directory_open(struct vvsfs *fs, unsigned int inode_num)
 {
-    struct inode *in = iget(inode_num);
+    struct inode *in = iget(fs, inode_num);
     if (!in) return NULL;
 
     struct directory *d = malloc(sizeof *d);
@@ -50,32 +183,58 @@ directory_open(unsigned int inode_num)
         iput(in);
         return NULL;
     }
-    d->inode  = in;
-    d->offset = 0;
+    directory_init(d, in);
     return d;
 }
 
-int
-directory_get(struct directory *d, struct directory_entry *ent)
+/*
+ * The current directory block is kept in d->block, so reading a block
+ * of entries costs one bread(). The copy is refreshed if the directory
+ * has grown since it was read.
+ */
+static int
+directory_get_locked(struct directory *d, struct directory_entry *ent)
 {
     if (d->offset >= d->inode->size)
         return -1;
 
+    if (d->inode->flags & INODE_FLAG_INLINE) {
+        directory_inline_get(d->inode, d->offset / DIRECTORY_ENTRY_SIZE, ent);
+        d->offset += DIRECTORY_ENTRY_SIZE;
+        return 0;
+    }
+
     unsigned int idx      = d->offset / BLOCK_SIZE;
-    unsigned int disk_blk = d->inode->block_ptr[idx];
+    int          disk_blk = d->inode->block_ptr[idx];
 
-    unsigned char block[BLOCK_SIZE];
-    bread(disk_blk, block);
+    if (disk_blk != d->cached_blk || d->inode->size != d->cached_size) {
+        if (!bread(d->inode->fs, disk_blk, d->block))
+            memset(d->block, 0, BLOCK_SIZE);
+        d->cached_blk  = disk_blk;
+        d->cached_size = d->inode->size;
+    }
 
-    unsigned int off   = d->offset % BLOCK_SIZE;
-    ent->inode_num     = read_u16(block + off);
-    memcpy(ent->name, block + off + 2, 16);
-    ent->name[15]      = '\0';
+    directory_entry_unpack(ent, d->block + d->offset % BLOCK_SIZE);
 
     d->offset += DIRECTORY_ENTRY_SIZE;
     return 0;
 }
 
+/*
+ * Directory contents, including the size and block pointers of every
+ * in-core directory inode, change only under the write side of the
+ * image's dir_lock; each directory_get() reads under the read side.
+ */
+int
+directory_get(struct directory *d, struct directory_entry *ent)
+{
+    pthread_rwlock_t *lock = &d->inode->fs->dir_lock;
+    vvsfs_rwlock_rdlock(lock);
+    int res = directory_get_locked(d, ent);
+    pthread_rwlock_unlock(lock);
+    return res;
+}
+
 void
 directory_close(struct directory *d)
 {
@@ -84,9 +243,9 @@ directory_close(struct directory *d)
 }
 
 void
-ls(void)
+ls(struct vvsfs *fs)
 {
-    struct directory *d = directory_open(0);
+    struct directory *d = directory_open(fs, 0);
     if (!d) return;
 
     struct directory_entry ent;
@@ -96,8 +255,8 @@ ls(void)
     directory_close(d);
 }
 
-int
-path_lookup(const char *path)
+static int
+path_walk(struct vvsfs *fs, const char *path)
 {
     if (!path) return -1;
     if (path[0] == '\0' || (path[0] == '/' && path[1] == '\0'))
@@ -107,10 +266,11 @@ path_lookup(const char *path)
     if (!copy) return -1;
 
     int cur_ino = 0;
-    char *token = strtok(copy, "/");
+    char *save;
+    char *token = strtok_r(copy, "/", &save);
     while (token) {
         bool found = false;
-        struct directory *d = directory_open(cur_ino);
+        struct directory *d = directory_open(fs, cur_ino);
         if (!d) {
             free(copy);
             return -1;
@@ -128,99 +288,458 @@ path_lookup(const char *path)
             free(copy);
             return -1;
         }
-        token = strtok(NULL, "/");
+        token = strtok_r(NULL, "/", &save);
     }
 
     free(copy);
     return cur_ino;
 }
 
+int
+path_lookup(struct vvsfs *fs, const char *path)
+{
+    STATS_START(t);
+    VVSFS_PROBE1(path_lookup__entry, path);
+    int ino = path_walk(fs, path);
+    VVSFS_PROBE2(path_lookup__return, path, ino);
+    STATS_END(VVSFS_STAT_LOOKUP, t);
+    return ino;
+}
+
+/*
+ * Resolves n paths at once. The paths are split into components and
+ * sorted, so paths sharing a prefix are adjacent; a stack of the
+ * directories along the current prefix is kept, each read once into a
+ * sorted entry table, and each path only walks the part that differs
+ * from the previous one. out[i] gets the inode of paths[i] or -1.
+ * Returns how many were found.
+ */
+struct batch_path {
+    char  *copy;
+    char **comp;
+    int    ncomp;
+    int    idx;
+};
+
+struct batch_dir {
+    const char             *name;
+    int                     ino;
+    struct directory_entry *ents;
+    int                     count;
+};
+
+static int
+batch_path_cmp(const void *a, const void *b)
+{
+    const struct batch_path *x = a, *y = b;
+    for (int i = 0; i < x->ncomp && i < y->ncomp; i++) {
+        int c = strcmp(x->comp[i], y->comp[i]);
+        if (c)
+            return c;
+    }
+    return x->ncomp - y->ncomp;
+}
+
+static int
+batch_ent_cmp(const void *a, const void *b)
+{
+    return strcmp(((const struct directory_entry *)a)->name,
+                  ((const struct directory_entry *)b)->name);
+}
+
+static int
+batch_load(struct vvsfs *fs, struct batch_dir *bd)
+{
+    struct inode *in = iget(fs, bd->ino);
+    if (!in || !(in->flags & INODE_FLAG_DIR)) {
+        iput(in);
+        return -1;
+    }
+    int cap = in->size / DIRECTORY_ENTRY_SIZE;
+    bd->ents  = malloc((cap + 1) * sizeof *bd->ents);
+    bd->count = 0;
+    if (!bd->ents) {
+        iput(in);
+        return -1;
+    }
+    struct directory d;
+    directory_init(&d, in);
+    while (bd->count < cap && directory_get(&d, &bd->ents[bd->count]) == 0)
+        bd->count++;
+    iput(in);
+    qsort(bd->ents, bd->count, sizeof *bd->ents, batch_ent_cmp);
+    return 0;
+}
+
+static int
+batch_find(struct vvsfs *fs, struct batch_dir *bd, const char *name)
+{
+    if (!bd->ents && batch_load(fs, bd) < 0)
+        return -1;
+    struct directory_entry key;
+    if (strlen(name) >= sizeof key.name)
+        return -1;
+    strcpy(key.name, name);
+    struct directory_entry *e = bsearch(&key, bd->ents, bd->count,
+                                        sizeof *bd->ents, batch_ent_cmp);
+    return e ? (int)e->inode_num : -1;
+}
+
+int
+path_lookup_batch(struct vvsfs *fs, const char **paths, int n, int *out)
+{
+    struct batch_path *bp = calloc(n > 0 ? n : 1, sizeof *bp);
+    struct batch_dir  *stack = NULL;
+    int found = 0, depth_cap = 1;
+
+    if (!bp)
+        return -1;
+    for (int i = 0; i < n; i++) {
+        out[i] = -1;
+        bp[i].idx = i;
+        if (!paths[i])
+            continue;
+        bp[i].copy = strdup(paths[i]);
+        bp[i].comp = malloc((strlen(paths[i]) / 2 + 1) * sizeof *bp[i].comp);
+        if (!bp[i].copy || !bp[i].comp) {
+            found = -1;
+            goto out;
+        }
+        char *save;
+        for (char *t = strtok_r(bp[i].copy, "/", &save); t;
+             t = strtok_r(NULL, "/", &save))
+            bp[i].comp[bp[i].ncomp++] = t;
+        if (bp[i].ncomp + 1 > depth_cap)
+            depth_cap = bp[i].ncomp + 1;
+    }
+    qsort(bp, n, sizeof *bp, batch_path_cmp);
+
+    stack = calloc(depth_cap, sizeof *stack);
+    if (!stack) {
+        found = -1;
+        goto out;
+    }
+    stack[0].ino = 0;
+    int top = 0;
+
+    for (int i = 0; i < n; i++) {
+        struct batch_path *p = &bp[i];
+        if (!paths[p->idx])
+            continue;
+
+        // Keep the directories this path shares with the previous one.
+        int keep = 0;
+        while (keep < top && keep < p->ncomp &&
+               strcmp(stack[keep + 1].name, p->comp[keep]) == 0)
+            keep++;
+        for (; top > keep; top--) {
+            free(stack[top].ents);
+            stack[top].ents = NULL;
+        }
+
+        int ino = stack[top].ino;
+        for (int k = top; k < p->ncomp && ino >= 0; k++) {
+            ino = batch_find(fs, &stack[top], p->comp[k]);
+            if (ino >= 0 && k < p->ncomp - 1) {
+                top++;
+                stack[top] = (struct batch_dir){ .name = p->comp[k], .ino = ino };
+            }
+        }
+        out[p->idx] = ino;
+        found += ino >= 0;
+    }
+
+out:
+    for (int i = 0; stack && i < depth_cap; i++)
+        free(stack[i].ents);
+    free(stack);
+    for (int i = 0; i < n; i++) {
+        free(bp[i].copy);
+        free(bp[i].comp);
+    }
+    free(bp);
+    return found;
+}
+
 struct inode *
-namei(char *path)
+namei(struct vvsfs *fs, char *path)
 {
     if (!path) return NULL;
     if (path[0] == '\0' || (path[0] == '/' && path[1] == '\0'))
-        return iget(0);
+        return iget(fs, 0);
 
-    int ino = path_lookup(path);
+    int ino = path_lookup(fs, path);
     if (ino < 0) return NULL;
-    return iget((unsigned int)ino);
+    return iget(fs, (unsigned int)ino);
 }
 
-int
-directory_make(char *path)
+// Called with dir_lock held for writing. Names compare as stored,
+// cut to DIRECTORY_INLINE_NAME bytes.
+static int
+directory_has(struct inode *dir, const char *name)
+{
+    struct directory d;
+    struct directory_entry ent;
+    directory_init(&d, dir);
+    while (directory_get_locked(&d, &ent) == 0)
+        if (strncmp(ent.name, name, DIRECTORY_INLINE_NAME) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * The name check, the inode allocation and the entry all happen under
+ * one hold of dir_lock, so two racing creates of one name cannot both
+ * succeed, and a name that is taken costs no inode.
+ */
+static struct inode *
+directory_create(struct inode *parent, const char *name, int flags)
+{
+    struct vvsfs *fs = parent->fs;
+
+    vvsfs_rwlock_wrlock(&fs->dir_lock);
+    if (directory_has(parent, name)) {
+        pthread_rwlock_unlock(&fs->dir_lock);
+        return NULL;
+    }
+    struct inode *in = ialloc(fs);
+    if (!in) {
+        pthread_rwlock_unlock(&fs->dir_lock);
+        return NULL;
+    }
+
+    if (flags & INODE_FLAG_DIR)
+        directory_inline_init(in, parent->inode_num);
+    else
+        in->flags = flags;
+
+    int res = directory_add(parent, in->inode_num, name);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    if (res < 0) {
+        // No entry points at it, so give the inode back.
+        unsigned int num = in->inode_num;
+        memset(in->inline_data, 0, INODE_INLINE_SIZE);
+        in->size  = 0;
+        in->flags = 0;
+        iput(in);
+        ifree(fs, num);
+        return NULL;
+    }
+    return in;
+}
+
+/*
+ * Splits an absolute path into its parent's path and its last name.
+ * Returns a copy of path that *name points into, for the caller to
+ * free, or NULL if the path has no last name.
+ */
+static char *
+path_split(const char *path, char parent_path[256], char **name)
 {
     if (!path || path[0] != '/')
-        return -1;
+        return NULL;
 
     char *copy = strdup(path);
     if (!copy)
-        return -1;
+        return NULL;
 
     char *last_slash = strrchr(copy, '/');
-    char  parent_path[256];
-    char *name;
     if (last_slash == copy) {
         strcpy(parent_path, "/");
-        name = copy + 1;
+        *name = copy + 1;
     } else {
         *last_slash = '\0';
-        strncpy(parent_path, copy, sizeof(parent_path) - 1);
-        parent_path[sizeof(parent_path) - 1] = '\0';
-        name = last_slash + 1;
+        strncpy(parent_path, copy, 255);
+        parent_path[255] = '\0';
+        *name = last_slash + 1;
     }
-    if (strlen(name) == 0) {
+    if (strlen(*name) == 0) {
         free(copy);
-        return -1;
+        return NULL;
     }
+    return copy;
+}
 
-    struct inode *parent = namei(parent_path);
+static struct inode *
+node_make(struct vvsfs *fs, char *path, int flags)
+{
+    char  parent_path[256];
+    char *name;
+    char *copy = path_split(path, parent_path, &name);
+    if (!copy)
+        return NULL;
+
+    journal_begin(fs);
+    struct inode *parent = namei(fs, parent_path);
     if (!parent) {
+        journal_end(fs);
         free(copy);
-        return -1;
+        return NULL;
     }
 
-    struct inode *newdir = ialloc();
-    if (!newdir) {
-        iput(parent);
-        free(copy);
+    struct inode *in = directory_create(parent, name, flags);
+
+    iput(parent);
+    journal_end(fs);
+    free(copy);
+    return in;
+}
+
+int
+directory_make(struct vvsfs *fs, char *path)
+{
+    STATS_START(t);
+    VVSFS_PROBE1(directory_make__entry, path);
+    struct inode *in = node_make(fs, path, INODE_FLAG_DIR);
+    int ino = in ? (int)in->inode_num : -1;
+    if (in)
+        iput(in);
+    VVSFS_PROBE2(directory_make__return, path, ino);
+    STATS_END(VVSFS_STAT_MKDIR, t);
+    return in ? 0 : -1;
+}
+
+int
+file_make(struct vvsfs *fs, char *path)
+{
+    struct inode *in = node_make(fs, path, INODE_FLAG_FILE);
+    if (!in)
         return -1;
+    iput(in);
+    return 0;
+}
+
+/*
+ * Called between the entries of a clone, inside its handle, which is
+ * ended and reopened every VVSFS_TXN_MAX_BLOCKS blocks so that no
+ * transaction outgrows the log and other writers get their commits.
+ */
+static void
+clone_batch(struct vvsfs *fs)
+{
+    if (journal_blocks(fs) >= VVSFS_TXN_MAX_BLOCKS) {
+        journal_end(fs);
+        journal_begin(fs);
     }
+}
 
-    unsigned int blk = alloc();
-    if (blk == 0) {
-        iput(newdir);
-        iput(parent);
-        free(copy);
+// Frees an unlinked tree that a failed clone built, inode by inode.
+static void
+clone_release(struct vvsfs *fs, unsigned int ino)
+{
+    struct inode *in = iget(fs, ino);
+    if (!in)
+        return;
+    if (in->flags & INODE_FLAG_DIR) {
+        struct directory *d = directory_open(fs, ino);
+        struct directory_entry ent;
+        while (d && directory_get(d, &ent) == 0)
+            if (strcmp(ent.name, ".") != 0 && strcmp(ent.name, "..") != 0)
+                clone_release(fs, ent.inode_num);
+        if (d)
+            directory_close(d);
+    }
+    if (!(in->flags & INODE_FLAG_INLINE))
+        file_truncate(in);
+    memset(in->inline_data, 0, INODE_INLINE_SIZE);
+    in->size  = 0;
+    in->flags = 0;
+    iput(in);
+    ifree(fs, ino);
+    clone_batch(fs);
+}
+
+static int
+directory_clone_into(unsigned int src_ino, struct inode *dst)
+{
+    struct vvsfs *fs = dst->fs;
+    struct directory *d = directory_open(fs, src_ino);
+    if (!d)
         return -1;
+
+    struct directory_entry ent;
+    int res = 0;
+    while (res == 0 && directory_get(d, &ent) == 0) {
+        if (strcmp(ent.name, ".") == 0 || strcmp(ent.name, "..") == 0)
+            continue;
+
+        struct inode *src = iget(fs, ent.inode_num);
+        if (!src) {
+            res = -1;
+            break;
+        }
+        struct inode *copy;
+        if (src->flags & INODE_FLAG_DIR) {
+            copy = directory_create(dst, ent.name, INODE_FLAG_DIR);
+            res  = copy ? directory_clone_into(src->inode_num, copy) : -1;
+        } else {
+            copy = directory_create(dst, ent.name, src->flags);
+            res  = copy ? file_clone(src, copy) : -1;
+        }
+        iput(copy);
+        iput(src);
+        clone_batch(fs);
     }
+    directory_close(d);
+    return res;
+}
 
-    newdir->flags        = 2;
-    newdir->size         = 2 * DIRECTORY_ENTRY_SIZE;
-    newdir->block_ptr[0] = blk;
+/*
+ * Recreates the tree under src at dst, sharing file data blocks by
+ * reference count instead of copying them; later writes to either side
+ * copy the block first. dst may live inside src, so
+ * directory_clone("/", "/snap") takes a snapshot of the whole image.
+ *
+ * The copy is built under a directory that nothing links to yet, in
+ * transactions of about VVSFS_TXN_MAX_BLOCKS blocks, and is linked at
+ * dst last. A crash part way leaves only leaked inodes and blocks for
+ * fsck; a failure frees the copy again.
+ */
+int
+directory_clone(struct vvsfs *fs, char *src, char *dst)
+{
+    char  parent_path[256];
+    char *name;
+    char *copy = path_split(dst, parent_path, &name);
+    if (!copy)
+        return -1;
 
-    unsigned char buf[BLOCK_SIZE];
-    memset(buf, 0, BLOCK_SIZE);
-    write_u16(buf + 0, newdir->inode_num);
-    strncpy((char *)(buf + 2), ".", 15);
-    write_u16(buf + DIRECTORY_ENTRY_SIZE, parent->inode_num);
-    strncpy((char *)(buf + DIRECTORY_ENTRY_SIZE + 2), "..", 15);
-    bwrite(blk, buf);
-    iput(newdir);
-
-    pthread_mutex_lock(&dir_lock);
-      unsigned int idx        = parent->size / BLOCK_SIZE;
-      unsigned int parent_blk = parent->block_ptr[idx];
-      unsigned char pbuf[BLOCK_SIZE];
-      bread(parent_blk, pbuf);
-      unsigned int off = parent->size % BLOCK_SIZE;
-      write_u16(pbuf + off, newdir->inode_num);
-      strncpy((char *)(pbuf + off + 2), name, 15);
-      bwrite(parent_blk, pbuf);
-      parent->size += DIRECTORY_ENTRY_SIZE;
-    pthread_mutex_unlock(&dir_lock);
+    journal_begin(fs);
+    int src_ino = path_lookup(fs, src);
+    struct inode *sin = src_ino < 0 ? NULL : iget(fs, src_ino);
+    struct inode *parent = namei(fs, parent_path);
+    struct inode *top = NULL;
+    int res = -1;
+    if (!sin || !(sin->flags & INODE_FLAG_DIR) || !parent ||
+        !(parent->flags & INODE_FLAG_DIR))
+        goto out;
+
+    vvsfs_rwlock_wrlock(&fs->dir_lock);
+    int taken = directory_has(parent, name);
+    pthread_rwlock_unlock(&fs->dir_lock);
+    if (taken || !(top = ialloc(fs)))
+        goto out;
+    directory_inline_init(top, parent->inode_num);
+
+    res = directory_clone_into(src_ino, top);
+    if (res == 0) {
+        vvsfs_rwlock_wrlock(&fs->dir_lock);
+        res = directory_has(parent, name) ? -1
+            : directory_add(parent, top->inode_num, name);
+        pthread_rwlock_unlock(&fs->dir_lock);
+    }
+    if (res < 0) {
+        unsigned int num = top->inode_num;
+        iput(top);
+        top = NULL;
+        clone_release(fs, num);
+    }
 
+out:
+    iput(top);
     iput(parent);
+    iput(sin);
+    journal_end(fs);
     free(copy);
-    return 0;
+    return res;
 }
@@ -1,31 +1,76 @@
 #ifndef DIR_H
 #define DIR_H
 
+#include <string.h>
+#include "block.h"
 #include "inode.h"
+#include "pack.h"
 
 #define DIRECTORY_ENTRY_SIZE 32
 
+#define DIRECTORY_INLINE_NAME  15
+#define DIRECTORY_INLINE_ENTRY (2 + DIRECTORY_INLINE_NAME)
+#define DIRECTORY_INLINE_MAX   \
+    (2 + (INODE_INLINE_SIZE - 2) / DIRECTORY_INLINE_ENTRY)
+
 struct directory_entry {
     unsigned int inode_num;
     char         name[16];
 };
 
+/*
+ * On-disk directory entry: the fields below, then the name at
+ * DIRECTORY_NAME_OFFSET, NUL-padded to DIRECTORY_INLINE_NAME bytes.
+ * Inline records are DIRECTORY_INLINE_ENTRY bytes apart, block records
+ * DIRECTORY_ENTRY_SIZE.
+ */
+#define DIRECTORY_ENTRY_LAYOUT(X) \
+    X(inode_num, u16, 0)
+#define DIRECTORY_NAME_OFFSET 2
+
+static inline void
+directory_entry_unpack(struct directory_entry *s, const unsigned char *rec)
+{
+    DIRECTORY_ENTRY_LAYOUT(PACK_DECODE)
+    memcpy(s->name, rec + DIRECTORY_NAME_OFFSET, DIRECTORY_INLINE_NAME);
+    s->name[DIRECTORY_INLINE_NAME] = '\0';
+}
+
+static inline void
+directory_entry_pack(const struct directory_entry *s, unsigned char *rec)
+{
+    DIRECTORY_ENTRY_LAYOUT(PACK_ENCODE)
+    size_t n = strnlen(s->name, DIRECTORY_INLINE_NAME);
+    memcpy(rec + DIRECTORY_NAME_OFFSET, s->name, n);
+    memset(rec + DIRECTORY_NAME_OFFSET + n, 0, DIRECTORY_INLINE_NAME - n);
+}
+
 struct directory {
     struct inode *inode;
     unsigned int  offset;
+    int           cached_blk;
+    unsigned int  cached_size;
+    unsigned char block[BLOCK_SIZE];
 };
 
-void mkfs(const char *image_name);
+struct vvsfs *mkfs(const char *image_name);
+struct vvsfs *mkfs_striped(const char *const *files, int nfiles,
+                           unsigned int stripe_blocks);
+struct vvsfs *mkfs_tiered(const char *meta_file, const char *data_file);
 
-struct directory *directory_open(unsigned int inode_num);
+void               directory_init(struct directory *d, struct inode *in);
+struct directory *directory_open(struct vvsfs *fs, unsigned int inode_num);
 int                directory_get(struct directory *d,
                                  struct directory_entry *ent);
 void               directory_close(struct directory *d);
 
-void ls(void);
-int  path_lookup(const char *path);
+void ls(struct vvsfs *fs);
+int  path_lookup(struct vvsfs *fs, const char *path);
+int  path_lookup_batch(struct vvsfs *fs, const char **paths, int n, int *out);
 
-struct inode *namei(char *path);
-int           directory_make(char *path);
+struct inode *namei(struct vvsfs *fs, char *path);
+int           directory_make(struct vvsfs *fs, char *path);
+int           file_make(struct vvsfs *fs, char *path);
+int           directory_clone(struct vvsfs *fs, char *src, char *dst);
 
 #endif
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "dir.h"
+#include "file.h"
+#include "export.h"
+
+/*
+ * Streams the whole tree out of the image, either as a ustar archive
+ * or into a host directory. Directories are read level by level, each
+ * level in order of where the directory lives on disk, and files are
+ * then copied in order of their first data block, so the image is read
+ * mostly front to back. Each run of contiguous data blocks is moved
+ * with copy_file_range() (or sendfile() when the output is a pipe)
+ * straight from the image file; inline and compressed files go through
+ * file_read(). Only flushed data is seen: callers should iput() or
+ * file_flush() files they are writing.
+ */
+#define TAR_BLOCK     512
+#define TAR_NAME_MAX  100
+#define TAR_PREFIX_MAX 155
+
+struct export_node {
+    char         *path;         // relative to the export root
+    unsigned int  ino;
+    int           is_dir;
+    unsigned int  key;          // on-disk position used for ordering
+};
+
+struct export {
+    struct vvsfs         *fs;
+    struct export_node   *nodes;
+    unsigned int          count;
+    unsigned int          cap;
+    struct export_result *res;
+};
+
+static unsigned int
+disk_key(struct inode *in)
+{
+    if (!(in->flags & INODE_FLAG_INLINE) && in->block_ptr[0] &&
+        in->block_ptr[0] != COMPRESS_ADDR)
+        return in->block_ptr[0];
+    if (in->block_ptr[1] && in->block_ptr[0] == COMPRESS_ADDR)
+        return in->block_ptr[1];
+    return INODE_FIRST_BLOCK + in->inode_num / INODES_PER_BLOCK;
+}
+
+static int
+node_add(struct export *e, const char *parent, const char *name,
+         struct inode *in)
+{
+    if (e->count == e->cap) {
+        unsigned int cap = e->cap ? e->cap * 2 : 256;
+        struct export_node *n = realloc(e->nodes, cap * sizeof *n);
+        if (!n)
+            return -1;
+        e->nodes = n;
+        e->cap   = cap;
+    }
+    struct export_node *n = &e->nodes[e->count];
+    size_t len = strlen(parent) + strlen(name) + 2;
+    n->path = malloc(len);
+    if (!n->path)
+        return -1;
+    snprintf(n->path, len, "%s%s%s", parent, *parent ? "/" : "", name);
+    n->ino    = in->inode_num;
+    n->is_dir = (in->flags & INODE_FLAG_DIR) != 0;
+    n->key    = disk_key(in);
+    e->count++;
+    return 0;
+}
+
+static int
+by_key(const void *a, const void *b)
+{
+    const struct export_node *x = a, *y = b;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+// Collects every node; directories end up before their contents.
+static int
+export_walk(struct export *e)
+{
+    struct inode *root = iget(e->fs, 0);
+    if (!root)
+        return -1;
+    int r = node_add(e, "", "", root);
+    iput(root);
+    if (r < 0)
+        return -1;
+
+    unsigned int level = 0, level_end = 1;
+    while (level < level_end) {
+        qsort(e->nodes + level, level_end - level, sizeof *e->nodes, by_key);
+        for (unsigned int i = level; i < level_end; i++) {
+            if (!e->nodes[i].is_dir)
+                continue;
+            struct directory *d = directory_open(e->fs, e->nodes[i].ino);
+            if (!d)
+                return -1;
+            struct directory_entry ent;
+            while (directory_get(d, &ent) == 0) {
+                if (strcmp(ent.name, ".") == 0 || strcmp(ent.name, "..") == 0)
+                    continue;
+                struct inode *in = iget(e->fs, ent.inode_num);
+                // e->nodes may move; copy the parent path first.
+                char *parent = strdup(e->nodes[i].path);
+                r = (in && parent) ? node_add(e, parent, ent.name, in) : -1;
+                free(parent);
+                iput(in);
+                if (r < 0) {
+                    directory_close(d);
+                    return -1;
+                }
+            }
+            directory_close(d);
+        }
+        level     = level_end;
+        level_end = e->count;
+    }
+    return 0;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p   += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Moves len bytes at offset off of image to fd, in the kernel if it can.
+static int
+copy_extent(int image, int fd, off_t off, size_t len,
+            struct export_result *res)
+{
+    while (len > 0) {
+        off_t in_off = off;
+        ssize_t n = copy_file_range(image, &in_off, fd, NULL, len, 0);
+        if (n < 0 && (errno == EXDEV || errno == EINVAL ||
+                      errno == ENOSYS || errno == EOPNOTSUPP || errno == EBADF))
+            n = sendfile(fd, image, &in_off, len);
+        if (n <= 0)
+            break;
+        res->zero_copy_bytes += n;
+        off += n;
+        len -= n;
+    }
+
+    unsigned char buf[BLOCK_SIZE];
+    while (len > 0) {
+        size_t chunk = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+        if (pread(image, buf, chunk, off) != (ssize_t)chunk ||
+            write_all(fd, buf, chunk) < 0)
+            return -1;
+        off += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// copy_extent() for a run of file data, one backing file at a time.
+static int
+copy_image(struct vvsfs *fs, int fd, off_t off, size_t len,
+           struct export_result *res)
+{
+    while (len > 0) {
+        int src;
+        off_t src_off;
+        size_t run = image_data_map(fs, off, len, &src, &src_off);
+        if (copy_extent(src, fd, src_off, run, res) < 0)
+            return -1;
+        off += run;
+        len -= run;
+    }
+    return 0;
+}
+
+static int
+write_zeros(int fd, size_t len)
+{
+    static const unsigned char zero[BLOCK_SIZE];
+    while (len > 0) {
+        size_t chunk = len < BLOCK_SIZE ? len : BLOCK_SIZE;
+        if (write_all(fd, zero, chunk) < 0)
+            return -1;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static int
+export_data(int fd, struct inode *in, struct export_result *res)
+{
+    unsigned int size = in->size;
+    int packed = 0;
+    for (int i = 0; i < INODE_PTR_COUNT; i++)
+        packed |= in->block_ptr[i] == COMPRESS_ADDR;
+
+    if ((in->flags & INODE_FLAG_INLINE) || packed) {
+        unsigned char buf[BLOCK_SIZE];
+        for (unsigned int off = 0; off < size; off += BLOCK_SIZE) {
+            unsigned int chunk = size - off < BLOCK_SIZE ? size - off
+                                                         : BLOCK_SIZE;
+            int n = file_read(in, off, buf, chunk);
+            if (n < 0)
+                return -1;
+            memset(buf + n, 0, chunk - n);
+            if (write_all(fd, buf, chunk) < 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    unsigned int idx = 0;
+    while (idx * BLOCK_SIZE < size) {
+        unsigned int run = 1;
+        while ((idx + run) * BLOCK_SIZE < size && in->block_ptr[idx] &&
+               in->block_ptr[idx + run] == in->block_ptr[idx] + run)
+            run++;
+        size_t len = (size_t)run * BLOCK_SIZE;
+        if (len > size - idx * BLOCK_SIZE)
+            len = size - idx * BLOCK_SIZE;
+        int r = in->block_ptr[idx]
+                ? copy_image(in->fs, fd,
+                             (off_t)in->block_ptr[idx] * BLOCK_SIZE, len, res)
+                : write_zeros(fd, len);
+        if (r < 0)
+            return -1;
+        idx += run;
+    }
+    return 0;
+}
+
+static void
+tar_octal(char *field, size_t width, unsigned long long value)
+{
+    snprintf(field, width, "%0*llo", (int)width - 1, value);
+}
+
+static int
+tar_header(int fd, const char *path, int is_dir, unsigned int size)
+{
+    char hdr[TAR_BLOCK];
+    memset(hdr, 0, sizeof hdr);
+
+    char name[TAR_NAME_MAX + TAR_PREFIX_MAX + 2];
+    snprintf(name, sizeof name, "%s%s", path, is_dir ? "/" : "");
+    size_t len = strlen(name);
+    if (len <= TAR_NAME_MAX) {
+        memcpy(hdr, name, len);
+    } else {
+        // Split at a '/' so the tail fits in name and the head in prefix.
+        char *cut = strchr(name + len - TAR_NAME_MAX - 1, '/');
+        if (!cut || cut - name > TAR_PREFIX_MAX || cut == name + len - 1)
+            return 1;
+        memcpy(hdr + 345, name, cut - name);
+        memcpy(hdr, cut + 1, len - (cut - name) - 1);
+    }
+    tar_octal(hdr + 100, 8, is_dir ? 0755 : 0644);
+    tar_octal(hdr + 108, 8, 0);
+    tar_octal(hdr + 116, 8, 0);
+    tar_octal(hdr + 124, 12, is_dir ? 0 : size);
+    tar_octal(hdr + 136, 12, 0);
+    hdr[156] = is_dir ? '5' : '0';
+    memcpy(hdr + 257, "ustar", 6);
+    memcpy(hdr + 263, "00", 2);
+
+    memset(hdr + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)hdr[i];
+    snprintf(hdr + 148, 8, "%06o", sum);
+    return write_all(fd, hdr, sizeof hdr);
+}
+
+static void
+export_free(struct export *e)
+{
+    for (unsigned int i = 0; i < e->count; i++)
+        free(e->nodes[i].path);
+    free(e->nodes);
+}
+
+static int
+dirs_first(const void *a, const void *b)
+{
+    const struct export_node *x = a, *y = b;
+    if (x->is_dir != y->is_dir)
+        return y->is_dir - x->is_dir;
+    return 0;
+}
+
+// Walks the tree and puts directories (in walk order) before files
+// (in data-block order).
+static int
+export_plan(struct export *e, struct export_result *res)
+{
+    memset(res, 0, sizeof *res);
+    e->res = res;
+    if (export_walk(e) < 0)
+        return -1;
+    // Directories keep walk order, so parents come first.
+    for (unsigned int i = 0; i < e->count; i++)
+        if (e->nodes[i].is_dir)
+            e->nodes[i].key = i;
+    qsort(e->nodes, e->count, sizeof *e->nodes, dirs_first);
+    unsigned int ndirs = 0;
+    while (ndirs < e->count && e->nodes[ndirs].is_dir)
+        ndirs++;
+    qsort(e->nodes, ndirs, sizeof *e->nodes, by_key);
+    qsort(e->nodes + ndirs, e->count - ndirs, sizeof *e->nodes, by_key);
+    return 0;
+}
+
+int
+export_tar(struct vvsfs *fs, int out_fd, struct export_result *res)
+{
+    struct export e = { .fs = fs };
+    int r = -1;
+
+    if (export_plan(&e, res) < 0)
+        goto out;
+    for (unsigned int i = 1; i < e.count; i++) {
+        struct export_node *n = &e.nodes[i];
+        struct inode *in = iget(fs, n->ino);
+        if (!in)
+            goto out;
+        int h = tar_header(out_fd, n->path, n->is_dir, in->size);
+        if (h == 1) {
+            res->skipped++;
+            iput(in);
+            continue;
+        }
+        if (h < 0 || (!n->is_dir &&
+                      (export_data(out_fd, in, res) < 0 ||
+                       write_zeros(out_fd, (TAR_BLOCK - in->size % TAR_BLOCK)
+                                           % TAR_BLOCK) < 0))) {
+            iput(in);
+            goto out;
+        }
+        if (n->is_dir) {
+            res->directories++;
+        } else {
+            res->files++;
+            res->bytes += in->size;
+        }
+        iput(in);
+    }
+    r = write_zeros(out_fd, 2 * TAR_BLOCK);
+out:
+    export_free(&e);
+    return r;
+}
+
+int
+export_dir(struct vvsfs *fs, const char *host_dir, struct export_result *res)
+{
+    struct export e = { .fs = fs };
+    int r = -1;
+
+    if (export_plan(&e, res) < 0)
+        goto out;
+    if (mkdir(host_dir, 0755) < 0 && errno != EEXIST)
+        goto out;
+    for (unsigned int i = 1; i < e.count; i++) {
+        struct export_node *n = &e.nodes[i];
+        size_t len = strlen(host_dir) + strlen(n->path) + 2;
+        char *path = malloc(len);
+        struct inode *in = path ? iget(fs, n->ino) : NULL;
+        if (!in) {
+            free(path);
+            goto out;
+        }
+        snprintf(path, len, "%s/%s", host_dir, n->path);
+        int ok;
+        if (n->is_dir) {
+            ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+            res->directories += ok;
+        } else {
+            int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            ok = fd >= 0 && export_data(fd, in, res) == 0;
+            if (fd >= 0)
+                close(fd);
+            if (ok) {
+                res->files++;
+                res->bytes += in->size;
+            }
+        }
+        iput(in);
+        free(path);
+        if (!ok)
+            goto out;
+    }
+    r = 0;
+out:
+    export_free(&e);
+    return r;
+}
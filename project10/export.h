@@ -0,0 +1,18 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+struct export_result {
+    unsigned int       files;
+    unsigned int       directories;
+    unsigned long long bytes;
+    unsigned long long zero_copy_bytes;
+    unsigned int       skipped;
+};
+
+struct vvsfs;
+
+int export_tar(struct vvsfs *fs, int out_fd, struct export_result *res);
+int export_dir(struct vvsfs *fs, const char *host_dir,
+               struct export_result *res);
+
+#endif
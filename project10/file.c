@@ -0,0 +1,561 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "file.h"
+#include "journal.h"
+#include "pack.h"
+#include "compress.h"
+#include "dedup.h"
+
+/*
+ * With INODE_FLAG_COMPRESS, data is flushed in clusters of
+ * COMPRESS_CLUSTER_BLOCKS logical blocks. A cluster that compresses
+ * into fewer blocks is stored as block_ptr[first] = COMPRESS_ADDR,
+ * followed by the blocks holding a u32 length and the LZ4 payload; the
+ * rest of the cluster's pointers are zero. Decompressed clusters are
+ * kept in a small per-image cache keyed by their first payload block.
+ */
+#define CLUSTER_BYTES (COMPRESS_CLUSTER_BLOCKS * BLOCK_SIZE)
+#define PACKED_BYTES  ((COMPRESS_CLUSTER_BLOCKS - 1) * BLOCK_SIZE)
+
+// Blocks written but not yet given a disk block live in in->pending[]
+// until file_flush() allocates them all in one contiguous batch; each
+// image allows DELALLOC_MAX_BLOCKS of them.
+struct file_cache {
+    pthread_mutex_t delalloc_lock;
+    int             delalloc_blocks;
+
+    pthread_mutex_t zcache_lock;
+    int             zcache_next;
+    struct {
+        unsigned int  key;
+        unsigned char data[CLUSTER_BYTES];
+    } zcache[ZCACHE_SIZE];
+};
+
+int
+file_cache_init(struct vvsfs *fs)
+{
+    struct file_cache *fc = calloc(1, sizeof *fc);
+    if (!fc)
+        return -1;
+    pthread_mutex_init(&fc->delalloc_lock, NULL);
+    pthread_mutex_init(&fc->zcache_lock, NULL);
+    fs->fcache = fc;
+    return 0;
+}
+
+void
+file_cache_destroy(struct vvsfs *fs)
+{
+    struct file_cache *fc = fs->fcache;
+    if (!fc)
+        return;
+    pthread_mutex_destroy(&fc->zcache_lock);
+    pthread_mutex_destroy(&fc->delalloc_lock);
+    free(fc);
+    fs->fcache = NULL;
+}
+
+static int
+delalloc_reserve(struct file_cache *fc)
+{
+    pthread_mutex_lock(&fc->delalloc_lock);
+    int ok = fc->delalloc_blocks < DELALLOC_MAX_BLOCKS;
+    if (ok) fc->delalloc_blocks++;
+    pthread_mutex_unlock(&fc->delalloc_lock);
+    return ok;
+}
+
+static void
+delalloc_release(struct file_cache *fc, int count)
+{
+    pthread_mutex_lock(&fc->delalloc_lock);
+    fc->delalloc_blocks -= count;
+    pthread_mutex_unlock(&fc->delalloc_lock);
+}
+
+static unsigned char *
+pending_get(struct inode *in, unsigned int idx)
+{
+    struct file_cache *fc = in->fs->fcache;
+
+    if (in->pending[idx])
+        return in->pending[idx];
+
+    if (!delalloc_reserve(fc)) {
+        // Memory pressure: push this file's delayed blocks out first.
+        // If other files hold the budget, the caller writes through.
+        if (file_flush(in) < 0 || !delalloc_reserve(fc))
+            return NULL;
+    }
+    in->pending[idx] = calloc(1, BLOCK_SIZE);
+    if (!in->pending[idx])
+        delalloc_release(fc, 1);
+    return in->pending[idx];
+}
+
+static unsigned int
+cluster_first(unsigned int idx)
+{
+    return idx - idx % COMPRESS_CLUSTER_BLOCKS;
+}
+
+static int
+cluster_compressed(struct inode *in, unsigned int idx)
+{
+    return in->block_ptr[cluster_first(idx)] == COMPRESS_ADDR;
+}
+
+static void
+zcache_invalidate(struct file_cache *fc, unsigned int key)
+{
+    pthread_mutex_lock(&fc->zcache_lock);
+    for (int i = 0; i < ZCACHE_SIZE; i++)
+        if (fc->zcache[i].key == key)
+            fc->zcache[i].key = 0;
+    pthread_mutex_unlock(&fc->zcache_lock);
+}
+
+static int
+cluster_load(struct inode *in, unsigned int first, unsigned char *out)
+{
+    struct vvsfs *fs = in->fs;
+    struct file_cache *fc = fs->fcache;
+    unsigned int key = in->block_ptr[first + 1];
+
+    pthread_mutex_lock(&fc->zcache_lock);
+    for (int i = 0; i < ZCACHE_SIZE; i++) {
+        if (fc->zcache[i].key == key) {
+            memcpy(out, fc->zcache[i].data, CLUSTER_BYTES);
+            pthread_mutex_unlock(&fc->zcache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&fc->zcache_lock);
+
+    unsigned char packed[PACKED_BYTES];
+    int nblk = 0;
+    for (int j = 1; j < COMPRESS_CLUSTER_BLOCKS && in->block_ptr[first + j]; j++)
+        dread(fs, in->block_ptr[first + j],
+              packed + (size_t)nblk++ * BLOCK_SIZE);
+    unsigned int clen = read_u32(packed);
+    if (nblk == 0 || clen > (unsigned int)nblk * BLOCK_SIZE - 4)
+        return -1;
+    int n = lz_decompress(packed + 4, clen, out, CLUSTER_BYTES);
+    if (n < 0)
+        return -1;
+    memset(out + n, 0, CLUSTER_BYTES - n);
+
+    pthread_mutex_lock(&fc->zcache_lock);
+    fc->zcache[fc->zcache_next].key = key;
+    memcpy(fc->zcache[fc->zcache_next].data, out, CLUSTER_BYTES);
+    fc->zcache_next = (fc->zcache_next + 1) % ZCACHE_SIZE;
+    pthread_mutex_unlock(&fc->zcache_lock);
+    return 0;
+}
+
+static void
+file_block_load(struct inode *in, unsigned int idx, unsigned char *block)
+{
+    struct vvsfs *fs = in->fs;
+
+    if (cluster_compressed(in, idx)) {
+        unsigned char cluster[CLUSTER_BYTES];
+        unsigned int  first = cluster_first(idx);
+        if (cluster_load(in, first, cluster) < 0)
+            memset(block, 0, BLOCK_SIZE);
+        else
+            memcpy(block, cluster + (size_t)(idx - first) * BLOCK_SIZE,
+                   BLOCK_SIZE);
+    } else if (in->block_ptr[idx]) {
+        dread(fs, in->block_ptr[idx], block);
+    } else {
+        memset(block, 0, BLOCK_SIZE);
+    }
+}
+
+static int
+file_inline_ok(struct inode *in)
+{
+    if (in->flags & INODE_FLAG_INLINE)
+        return 1;
+    return in->size == 0 && !in->block_ptr[0] && !in->pending[0];
+}
+
+static int
+file_spill_inline(struct inode *in)
+{
+    unsigned char data[INODE_INLINE_SIZE];
+
+    memcpy(data, in->inline_data, INODE_INLINE_SIZE);
+    memset(in->inline_data, 0, INODE_INLINE_SIZE);
+    in->flags &= ~INODE_FLAG_INLINE;
+
+    unsigned char *p = pending_get(in, 0);
+    if (!p) {
+        memcpy(in->inline_data, data, INODE_INLINE_SIZE);
+        in->flags |= INODE_FLAG_INLINE;
+        return -1;
+    }
+    memcpy(p, data, in->size);
+    return 0;
+}
+
+/*
+ * Gives block idx a disk block now, for when the delalloc budget is
+ * taken by other files. Flushing those from here would race with
+ * their writers, so this file pays one allocation and one inode write
+ * per block instead. Compressed clusters still need a delayed copy.
+ */
+static int
+file_write_through(struct inode *in, unsigned int idx, unsigned int off,
+                   const unsigned char *src, unsigned int n)
+{
+    struct vvsfs *fs = in->fs;
+    unsigned char block[BLOCK_SIZE];
+    int blk;
+
+    if (cluster_compressed(in, idx))
+        return -1;
+    if (n < BLOCK_SIZE)
+        file_block_load(in, idx, block);
+    memcpy(block + off, src, n);
+
+    journal_begin(fs);
+    if (alloc_batch(fs, 1, &blk) < 0) {
+        journal_end(fs);
+        return -1;
+    }
+    dwrite(fs, blk, block);
+    if (in->block_ptr[idx])
+        bfree(fs, in->block_ptr[idx]);
+    in->block_ptr[idx] = blk;
+    write_inode(fs, in);
+    journal_end(fs);
+    return 0;
+}
+
+/*
+ * Returns the number of bytes written. That is less than len only if
+ * a block could neither be delayed nor written through; -1 means
+ * nothing was written.
+ */
+int
+file_write(struct inode *in, unsigned int offset,
+           const void *buf, unsigned int len)
+{
+    struct vvsfs *fs = in->fs;
+
+    if (offset + len > INODE_PTR_COUNT * BLOCK_SIZE)
+        return -1;
+
+    if (offset + len <= INODE_INLINE_SIZE && file_inline_ok(in)) {
+        memcpy(in->inline_data + offset, buf, len);
+        in->flags |= INODE_FLAG_INLINE;
+        if (offset + len > in->size)
+            in->size = offset + len;
+        return (int)len;
+    }
+    if ((in->flags & INODE_FLAG_INLINE) && file_spill_inline(in) < 0)
+        return -1;
+
+    const unsigned char *src = buf;
+    unsigned int done = 0;
+    while (done < len) {
+        unsigned int pos = offset + done;
+        unsigned int idx = pos / BLOCK_SIZE;
+        unsigned int off = pos % BLOCK_SIZE;
+        unsigned int n   = BLOCK_SIZE - off;
+        if (n > len - done)
+            n = len - done;
+
+        unsigned int blk = in->block_ptr[idx];
+        if (blk && !in->pending[idx] && !cluster_compressed(in, idx) &&
+            brefcount(fs, blk) == 1) {
+            unsigned char block[BLOCK_SIZE];
+            if (n < BLOCK_SIZE)
+                dread(fs, blk, block);
+            memcpy(block + off, src + done, n);
+            dwrite(fs, blk, block);
+        } else {
+            // Shared and compressed blocks are copied into a delayed
+            // block; the old one is released when the copy is flushed.
+            int fresh = !in->pending[idx];
+            unsigned char *p = pending_get(in, idx);
+            if (!p) {
+                if (file_write_through(in, idx, off, src + done, n) < 0)
+                    break;
+            } else {
+                if (fresh && n < BLOCK_SIZE)
+                    file_block_load(in, idx, p);
+                memcpy(p + off, src + done, n);
+            }
+        }
+        done += n;
+    }
+
+    if (done == 0 && len > 0)
+        return -1;
+    if (offset + done > in->size)
+        in->size = offset + done;
+    return (int)done;
+}
+
+int
+file_read(struct inode *in, unsigned int offset,
+          void *buf, unsigned int len)
+{
+    if (offset >= in->size)
+        return 0;
+    if (len > in->size - offset)
+        len = in->size - offset;
+
+    if (in->flags & INODE_FLAG_INLINE) {
+        memcpy(buf, in->inline_data + offset, len);
+        return (int)len;
+    }
+
+    unsigned char *dst = buf;
+    unsigned int done = 0;
+    while (done < len) {
+        unsigned int pos = offset + done;
+        unsigned int idx = pos / BLOCK_SIZE;
+        unsigned int off = pos % BLOCK_SIZE;
+        unsigned int n   = BLOCK_SIZE - off;
+        if (n > len - done)
+            n = len - done;
+
+        if (in->pending[idx]) {
+            memcpy(dst + done, in->pending[idx] + off, n);
+        } else {
+            unsigned char block[BLOCK_SIZE];
+            file_block_load(in, idx, block);
+            memcpy(dst + done, block + off, n);
+        }
+        done += n;
+    }
+    return (int)len;
+}
+
+static int
+cluster_flush(struct inode *in, unsigned int first)
+{
+    struct vvsfs *fs = in->fs;
+    unsigned char raw[CLUSTER_BYTES];
+    unsigned char packed[PACKED_BYTES];
+    unsigned int  start = first * BLOCK_SIZE;
+    unsigned int  bytes = in->size > start ? in->size - start : 0;
+    if (bytes > CLUSTER_BYTES)
+        bytes = CLUSTER_BYTES;
+    int nblk = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (int j = 0; j < COMPRESS_CLUSTER_BLOCKS; j++) {
+        unsigned char *b = raw + (size_t)j * BLOCK_SIZE;
+        if (in->pending[first + j])
+            memcpy(b, in->pending[first + j], BLOCK_SIZE);
+        else
+            file_block_load(in, first + j, b);
+    }
+
+    int clen = -1;
+    if ((in->flags & INODE_FLAG_COMPRESS) && nblk > 1) {
+        memset(packed, 0, PACKED_BYTES);
+        clen = lz_compress(raw, bytes, packed + 4,
+                           (nblk - 1) * BLOCK_SIZE - 4);
+    }
+    int nnew = clen >= 0 ? (clen + 4 + BLOCK_SIZE - 1) / BLOCK_SIZE : nblk;
+    int blocks[COMPRESS_CLUSTER_BLOCKS];
+    if (nnew > 0 && alloc_batch(fs, nnew, blocks) < 0)
+        return -1;
+
+    unsigned short old[COMPRESS_CLUSTER_BLOCKS];
+    memcpy(old, &in->block_ptr[first], sizeof old);
+    memset(&in->block_ptr[first], 0, sizeof old);
+    if (old[0] == COMPRESS_ADDR)
+        zcache_invalidate(fs->fcache, old[1]);
+    for (int j = 0; j < COMPRESS_CLUSTER_BLOCKS; j++)
+        if (old[j] && old[j] != COMPRESS_ADDR)
+            bfree(fs, old[j]);
+
+    if (clen >= 0) {
+        write_u32(packed, clen);
+        in->block_ptr[first] = COMPRESS_ADDR;
+        for (int k = 0; k < nnew; k++) {
+            dwrite(fs, blocks[k], packed + (size_t)k * BLOCK_SIZE);
+            in->block_ptr[first + 1 + k] = blocks[k];
+        }
+    } else {
+        for (int j = 0; j < nblk; j++) {
+            dwrite(fs, blocks[j], raw + (size_t)j * BLOCK_SIZE);
+            in->block_ptr[first + j] = blocks[j];
+        }
+    }
+
+    int dropped = 0;
+    for (int j = 0; j < COMPRESS_CLUSTER_BLOCKS; j++) {
+        if (in->pending[first + j]) {
+            free(in->pending[first + j]);
+            in->pending[first + j] = NULL;
+            dropped++;
+        }
+    }
+    delalloc_release(fs->fcache, dropped);
+    return dropped;
+}
+
+int
+file_flush(struct inode *in)
+{
+    struct vvsfs *fs = in->fs;
+    int idx[INODE_PTR_COUNT];
+    int blocks[INODE_PTR_COUNT];
+    unsigned long long fps[INODE_PTR_COUNT];
+    int total = 0, count = 0;
+
+    for (int i = 0; i < INODE_PTR_COUNT; i++)
+        if (in->pending[i])
+            total++;
+    if (total == 0)
+        return 0;
+
+    journal_begin(fs);
+    for (int first = 0; first < INODE_PTR_COUNT;
+         first += COMPRESS_CLUSTER_BLOCKS) {
+        if (!(in->flags & INODE_FLAG_COMPRESS) &&
+            in->block_ptr[first] != COMPRESS_ADDR)
+            continue;
+        int dirty = 0;
+        for (int j = 0; j < COMPRESS_CLUSTER_BLOCKS; j++)
+            dirty |= in->pending[first + j] != NULL;
+        if (dirty && cluster_flush(in, first) < 0) {
+            journal_end(fs);
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < INODE_PTR_COUNT; i++) {
+        if (!in->pending[i])
+            continue;
+        if (in->flags & INODE_FLAG_DEDUP) {
+            fps[i] = dedup_fingerprint(in->pending[i]);
+            int shared = dedup_share(fs, in->pending[i], fps[i]);
+            if (shared >= 0) {
+                if (in->block_ptr[i])
+                    bfree(fs, in->block_ptr[i]);
+                in->block_ptr[i] = shared;
+                free(in->pending[i]);
+                in->pending[i] = NULL;
+                delalloc_release(fs->fcache, 1);
+                continue;
+            }
+        }
+        idx[count++] = i;
+    }
+    if (count > 0 && alloc_batch(fs, count, blocks) < 0) {
+        journal_end(fs);
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (in->block_ptr[idx[i]])
+            bfree(fs, in->block_ptr[idx[i]]);
+        dwrite(fs, blocks[i], in->pending[idx[i]]);
+        in->block_ptr[idx[i]] = blocks[i];
+        if (in->flags & INODE_FLAG_DEDUP)
+            dedup_insert(fs, fps[idx[i]], blocks[i]);
+        free(in->pending[idx[i]]);
+        in->pending[idx[i]] = NULL;
+    }
+    if (count > 0)
+        delalloc_release(fs->fcache, count);
+
+    write_inode(fs, in);
+    journal_end(fs);
+    return total;
+}
+
+void
+file_truncate(struct inode *in)
+{
+    struct vvsfs *fs = in->fs;
+    int dropped = 0;
+
+    journal_begin(fs);
+    for (int i = 0; i < INODE_PTR_COUNT; i++) {
+        if (in->pending[i]) {
+            free(in->pending[i]);
+            in->pending[i] = NULL;
+            dropped++;
+        }
+        if (in->block_ptr[i] == COMPRESS_ADDR)
+            zcache_invalidate(fs->fcache, in->block_ptr[i + 1]);
+        else if (in->block_ptr[i])
+            bfree(fs, in->block_ptr[i]);
+        in->block_ptr[i] = 0;
+    }
+    if (dropped)
+        delalloc_release(fs->fcache, dropped);
+
+    memset(in->inline_data, 0, INODE_INLINE_SIZE);
+    in->flags &= ~INODE_FLAG_INLINE;
+    in->size = 0;
+    write_inode(fs, in);
+    journal_end(fs);
+}
+
+int
+file_clone(struct inode *src, struct inode *dst)
+{
+    struct vvsfs *fs = src->fs;
+
+    if (file_flush(src) < 0)
+        return -1;
+
+    journal_begin(fs);
+    file_truncate(dst);
+    dst->size        = src->size;
+    dst->owner_id    = src->owner_id;
+    dst->permissions = src->permissions;
+    dst->flags       = src->flags;
+    dst->link_count  = src->link_count;
+    memcpy(dst->inline_data, src->inline_data, INODE_INLINE_SIZE);
+
+    for (int first = 0; first < INODE_PTR_COUNT;
+         first += COMPRESS_CLUSTER_BLOCKS) {
+        int j;
+        for (j = 0; j < COMPRESS_CLUSTER_BLOCKS; j++) {
+            unsigned int blk = src->block_ptr[first + j];
+            if (blk && blk != COMPRESS_ADDR && bref(fs, blk) < 0)
+                break;
+        }
+        if (j == COMPRESS_CLUSTER_BLOCKS) {
+            memcpy(&dst->block_ptr[first], &src->block_ptr[first],
+                   COMPRESS_CLUSTER_BLOCKS * sizeof dst->block_ptr[0]);
+            continue;
+        }
+
+        // Reference count saturated: give the clone a private copy.
+        while (j-- > 0) {
+            unsigned int blk = src->block_ptr[first + j];
+            if (blk && blk != COMPRESS_ADDR)
+                bfree(fs, blk);
+        }
+        for (j = 0; j < COMPRESS_CLUSTER_BLOCKS &&
+                    (unsigned int)(first + j) * BLOCK_SIZE < src->size; j++) {
+            unsigned char *p = pending_get(dst, first + j);
+            if (!p) {
+                journal_end(fs);
+                return -1;
+            }
+            file_block_load(src, first + j, p);
+        }
+    }
+
+    write_inode(fs, dst);
+    journal_end(fs);
+    return 0;
+}
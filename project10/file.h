@@ -0,0 +1,23 @@
+#ifndef FILE_H
+#define FILE_H
+
+#include "inode.h"
+
+#define DELALLOC_MAX_BLOCKS 256
+
+#define COMPRESS_CLUSTER_BLOCKS 4
+#define COMPRESS_ADDR           0xFFFF
+#define ZCACHE_SIZE             8
+
+int  file_cache_init(struct vvsfs *fs);
+void file_cache_destroy(struct vvsfs *fs);
+
+int  file_write(struct inode *in, unsigned int offset,
+                const void *buf, unsigned int len);
+int  file_read(struct inode *in, unsigned int offset,
+               void *buf, unsigned int len);
+int  file_flush(struct inode *in);
+void file_truncate(struct inode *in);
+int  file_clone(struct inode *src, struct inode *dst);
+
+#endif
@@ -22,3 +22,19 @@ int find_free(unsigned char *block) {
     }
     return -1;
 }
+
+int find_free_run(unsigned char *block, int count) {
+    int run = 0;
+    for (int num = 0; num < BLOCK_SIZE * 8; num++) {
+        if (num % 8 == 0 && block[num / 8] == 0xFF) {
+            run = 0;
+            num += 7;
+            continue;
+        }
+        if (block[num / 8] & (1 << (num % 8)))
+            run = 0;
+        else if (++run == count)
+            return num - count + 1;
+    }
+    return -1;
+}
@@ -3,5 +3,6 @@
 
 void set_free(unsigned char *block, int num, int set);
 int find_free(unsigned char *block);
+int find_free_run(unsigned char *block, int count);
 
 #endif
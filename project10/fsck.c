@@ -0,0 +1,404 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "dir.h"
+#include "file.h"
+#include "journal.h"
+#include "csum.h"
+#include "pack.h"
+#include "super.h"
+#include "fsck.h"
+
+/*
+ * Offline consistency check. The journal is checkpointed first so the
+ * home locations are current, then:
+ *
+ *  1. workers claim FSCK_CHUNK_BLOCKS-block slices of the inode table,
+ *     read each slice with one pread(), verify its checksums and count
+ *     references to every data block; slices of groups the superblock
+ *     marks uninitialized are skipped without reading;
+ *  2. workers walk the directory tree from inode 0 through a shared
+ *     queue, checking "." and ".." and marking inodes reachable;
+ *  3. the bitmaps and refcount table are compared with what was found.
+ *
+ * Problems are printed to out (if not NULL) and counted in res.
+ */
+struct fsck {
+    struct vvsfs       *fs;
+    FILE               *out;
+    struct fsck_result *res;
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+
+    unsigned char       imap[BLOCK_SIZE];
+    unsigned char      *table;      // the whole inode table
+    unsigned short     *refs;       // references per block
+    unsigned char      *reached;    // inode found in a directory
+    unsigned int        next_chunk;
+
+    unsigned int       *queue;      // directories still to walk
+    unsigned int        queued;
+    unsigned int        busy;
+};
+
+static void
+report(struct fsck *f, unsigned int *counter, const char *fmt, ...)
+{
+    pthread_mutex_lock(&f->lock);
+    (*counter)++;
+    if (f->out) {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(f->out, fmt, ap);
+        va_end(ap);
+        fputc('\n', f->out);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+static int
+inode_used(struct fsck *f, unsigned int ino)
+{
+    return f->imap[ino / 8] & (1 << (ino % 8));
+}
+
+static void
+inode_get(struct fsck *f, unsigned int ino, struct inode *in)
+{
+    inode_unpack(in, f->table + (size_t)ino * INODE_SIZE);
+    in->inode_num = ino;
+}
+
+static void
+check_inode(struct fsck *f, const struct inode *in)
+{
+    unsigned int ino = in->inode_num;
+
+    int type = in->flags & (INODE_FLAG_FILE | INODE_FLAG_DIR);
+    if (type != INODE_FLAG_FILE && type != INODE_FLAG_DIR) {
+        report(f, &f->res->errors, "inode %u: bad type flags 0x%x",
+               ino, in->flags);
+        return;
+    }
+    if (in->flags & INODE_FLAG_INLINE) {
+        unsigned int max = type == INODE_FLAG_DIR
+                           ? DIRECTORY_INLINE_MAX * DIRECTORY_ENTRY_SIZE
+                           : INODE_INLINE_SIZE;
+        if (in->size > max)
+            report(f, &f->res->errors, "inode %u: inline size %u too big",
+                   ino, in->size);
+        return;
+    }
+    if (in->size > INODE_PTR_COUNT * BLOCK_SIZE)
+        report(f, &f->res->errors, "inode %u: size %u too big", ino, in->size);
+
+    for (int i = 0; i < INODE_PTR_COUNT; i++) {
+        unsigned int b = in->block_ptr[i];
+        if (b == 0)
+            continue;
+        if (b == COMPRESS_ADDR) {
+            if (type != INODE_FLAG_FILE || i % COMPRESS_CLUSTER_BLOCKS)
+                report(f, &f->res->errors,
+                       "inode %u: misplaced compressed cluster at %d", ino, i);
+            continue;
+        }
+        if (b < DATA_FIRST_BLOCK || b >= BLOCK_SIZE * 8) {
+            report(f, &f->res->errors, "inode %u: block %u out of range",
+                   ino, b);
+            continue;
+        }
+        __atomic_fetch_add(&f->refs[b], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void
+scan_chunks(struct fsck *f)
+{
+    for (;;) {
+        unsigned int chunk = __atomic_fetch_add(&f->next_chunk, 1,
+                                                __ATOMIC_RELAXED);
+        unsigned int first = chunk * FSCK_CHUNK_BLOCKS;
+        if (first >= INODE_BLOCK_COUNT)
+            return;
+        unsigned int count = INODE_BLOCK_COUNT - first;
+        if (count > FSCK_CHUNK_BLOCKS)
+            count = FSCK_CHUNK_BLOCKS;
+
+        unsigned char *buf = f->table + (size_t)first * BLOCK_SIZE;
+        size_t len = (size_t)count * BLOCK_SIZE;
+        unsigned int group = first / INODE_GROUP_BLOCKS;
+        if (count == INODE_GROUP_BLOCKS && !super_group_ready(f->fs, group)) {
+            // Never initialized: reads as zeros, nothing may live there.
+            memset(buf, 0, len);
+            for (unsigned int ino = group * INODE_GROUP_INODES;
+                 ino < (group + 1) * INODE_GROUP_INODES; ino++)
+                if (inode_used(f, ino))
+                    report(f, &f->res->errors,
+                           "inode %u: allocated in uninitialized group", ino);
+            continue;
+        }
+        off_t off = (off_t)(INODE_FIRST_BLOCK + first) * BLOCK_SIZE;
+        ssize_t n = image_pread(f->fs, buf, len, off);
+        if (n < 0)
+            n = 0;
+        memset(buf + n, 0, len - n);
+
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int blk = INODE_FIRST_BLOCK + first + i;
+            if (csum_verify(f->fs, blk, buf + (size_t)i * BLOCK_SIZE) < 0)
+                report(f, &f->res->errors, "block %u: checksum mismatch", blk);
+        }
+        struct inode ins[INODES_PER_BLOCK];
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int ino = (first + i) * INODES_PER_BLOCK;
+            inode_unpack_block(ins, buf + (size_t)i * BLOCK_SIZE, ino);
+            for (int j = 0; j < INODES_PER_BLOCK; j++)
+                if (inode_used(f, ino + j))
+                    check_inode(f, &ins[j]);
+        }
+    }
+}
+
+// Entry idx of directory in (0 is ".", 1 is ".."); -1 past the end.
+static int
+dir_entry(struct fsck *f, struct inode *in, unsigned int idx,
+          unsigned char *block, int *cached, struct directory_entry *ent)
+{
+    if (idx >= in->size / DIRECTORY_ENTRY_SIZE)
+        return -1;
+    memset(ent->name, 0, sizeof ent->name);
+    if (in->flags & INODE_FLAG_INLINE) {
+        if (idx == 0) {
+            ent->inode_num = in->inode_num;
+            strcpy(ent->name, ".");
+        } else if (idx == 1) {
+            ent->inode_num = read_u16(in->inline_data);
+            strcpy(ent->name, "..");
+        } else {
+            directory_entry_unpack(ent, in->inline_data + 2 +
+                                        (idx - 2) * DIRECTORY_INLINE_ENTRY);
+        }
+        return 0;
+    }
+
+    unsigned int off = idx * DIRECTORY_ENTRY_SIZE;
+    int blk = in->block_ptr[off / BLOCK_SIZE];
+    if (blk != *cached) {
+        if (blk < DATA_FIRST_BLOCK || !bread(f->fs, blk, block)) {
+            report(f, &f->res->errors, "directory %u: unreadable block %d",
+                   in->inode_num, blk);
+            return -1;
+        }
+        *cached = blk;
+    }
+    directory_entry_unpack(ent, block + off % BLOCK_SIZE);
+    return 0;
+}
+
+static void
+walk_dir(struct fsck *f, unsigned int ino)
+{
+    struct inode in;
+    unsigned char block[BLOCK_SIZE];
+    struct directory_entry ent;
+    int cached = -1;
+
+    inode_get(f, ino, &in);
+    for (unsigned int i = 0; dir_entry(f, &in, i, block, &cached, &ent) == 0;
+         i++) {
+        if (i == 0) {
+            if (strcmp(ent.name, ".") || ent.inode_num != ino)
+                report(f, &f->res->errors, "directory %u: bad \".\"", ino);
+            continue;
+        }
+        if (i == 1) {
+            if (strcmp(ent.name, "..") || ent.inode_num >= INODE_COUNT ||
+                !inode_used(f, ent.inode_num))
+                report(f, &f->res->errors, "directory %u: bad \"..\"", ino);
+            continue;
+        }
+
+        unsigned int child = ent.inode_num;
+        if (child >= INODE_COUNT || !inode_used(f, child)) {
+            report(f, &f->res->errors,
+                   "directory %u: entry \"%s\" names free inode %u",
+                   ino, ent.name, child);
+            continue;
+        }
+        struct inode cin;
+        inode_get(f, child, &cin);
+        int first = __atomic_exchange_n(&f->reached[child], 1,
+                                        __ATOMIC_RELAXED) == 0;
+        if (!(cin.flags & INODE_FLAG_DIR))
+            continue;
+        if (!first) {
+            report(f, &f->res->errors,
+                   "directory %u: linked more than once", child);
+            continue;
+        }
+
+        struct directory_entry dotdot;
+        unsigned char cblock[BLOCK_SIZE];
+        int ccached = -1;
+        if (dir_entry(f, &cin, 1, cblock, &ccached, &dotdot) == 0 &&
+            dotdot.inode_num != ino)
+            report(f, &f->res->errors,
+                   "directory %u: \"..\" is %u, expected %u",
+                   child, dotdot.inode_num, ino);
+
+        pthread_mutex_lock(&f->lock);
+        f->queue[f->queued++] = child;
+        pthread_cond_signal(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+    }
+}
+
+static void
+walk_dirs(struct fsck *f)
+{
+    pthread_mutex_lock(&f->lock);
+    for (;;) {
+        while (f->queued == 0 && f->busy > 0)
+            pthread_cond_wait(&f->cond, &f->lock);
+        if (f->queued == 0)
+            break;
+        unsigned int ino = f->queue[--f->queued];
+        f->busy++;
+        pthread_mutex_unlock(&f->lock);
+
+        walk_dir(f, ino);
+
+        pthread_mutex_lock(&f->lock);
+        if (--f->busy == 0 && f->queued == 0)
+            pthread_cond_broadcast(&f->cond);
+    }
+    pthread_mutex_unlock(&f->lock);
+}
+
+static void *
+scan_worker(void *arg)
+{
+    scan_chunks(arg);
+    return NULL;
+}
+
+static void *
+walk_worker(void *arg)
+{
+    walk_dirs(arg);
+    return NULL;
+}
+
+// Runs fn on threads - 1 new threads plus the caller.
+static void
+run_pool(struct fsck *f, int threads, void *(*fn)(void *))
+{
+    pthread_t tids[FSCK_MAX_THREADS];
+    int started = 0;
+
+    for (; started < threads - 1; started++)
+        if (pthread_create(&tids[started], NULL, fn, f) != 0)
+            break;
+    fn(f);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+}
+
+static void
+check_maps(struct fsck *f)
+{
+    unsigned char bmap[BLOCK_SIZE];
+    unsigned char refs[BLOCK_SIZE];
+    struct fsck_result *res = f->res;
+
+    for (unsigned int ino = 0; ino < INODE_COUNT; ino++) {
+        if (!inode_used(f, ino))
+            continue;
+        res->inodes++;
+        struct inode in;
+        inode_get(f, ino, &in);
+        if (in.flags & INODE_FLAG_DIR)
+            res->directories++;
+        if (!f->reached[ino])
+            report(f, &res->leaked_inodes, "inode %u: not in any directory",
+                   ino);
+    }
+
+    if (!bread(f->fs, BLOCK_MAP_BLOCK, bmap)) {
+        report(f, &res->errors, "block map unreadable");
+        return;
+    }
+    for (int b = 0; b < BLOCK_SIZE * 8; b++) {
+        if (b % BLOCK_SIZE == 0 &&
+            !bread(f->fs, REFCOUNT_FIRST_BLOCK + b / BLOCK_SIZE, refs))
+            memset(refs, 0, BLOCK_SIZE);
+        int used = (bmap[b / 8] >> (b % 8)) & 1;
+        if (b < DATA_FIRST_BLOCK) {
+            if (!used)
+                report(f, &res->errors, "block %d: reserved but free", b);
+            continue;
+        }
+        unsigned int found = f->refs[b];
+        unsigned int extra = refs[b % BLOCK_SIZE];
+        if (found)
+            res->blocks++;
+        if (found && !used)
+            report(f, &res->errors, "block %d: in use but marked free", b);
+        else if (!found && used)
+            report(f, &res->leaked_blocks, "block %d: allocated but unused", b);
+        else if (found && extra + 1 != found)
+            report(f, &res->errors, "block %d: refcount %u, found %u",
+                   b, extra + 1, found);
+    }
+}
+
+int
+fsck_image(struct vvsfs *fs, int threads, FILE *out, struct fsck_result *res)
+{
+    struct fsck f = { .fs = fs, .out = out, .res = res };
+
+    if (threads < 1)
+        threads = 1;
+    if (threads > FSCK_MAX_THREADS)
+        threads = FSCK_MAX_THREADS;
+    memset(res, 0, sizeof *res);
+    journal_flush(fs);
+
+    f.table   = malloc((size_t)INODE_BLOCK_COUNT * BLOCK_SIZE);
+    f.refs    = calloc(BLOCK_SIZE * 8, sizeof *f.refs);
+    f.reached = calloc(INODE_COUNT, 1);
+    f.queue   = malloc(INODE_COUNT * sizeof *f.queue);
+    if (!f.table || !f.refs || !f.reached || !f.queue ||
+        !bread(fs, INODE_MAP_BLOCK, f.imap)) {
+        free(f.table);
+        free(f.refs);
+        free(f.reached);
+        free(f.queue);
+        return -1;
+    }
+    pthread_mutex_init(&f.lock, NULL);
+    pthread_cond_init(&f.cond, NULL);
+
+    if (!inode_used(&f, 0))
+        report(&f, &res->errors, "root inode 0 not allocated");
+    f.reached[0] = 1;
+    f.queue[f.queued++] = 0;
+
+    run_pool(&f, threads, scan_worker);
+    run_pool(&f, threads, walk_worker);
+
+    check_maps(&f);
+
+    pthread_cond_destroy(&f.cond);
+    pthread_mutex_destroy(&f.lock);
+    free(f.table);
+    free(f.refs);
+    free(f.reached);
+    free(f.queue);
+    return res->errors + res->leaked_inodes + res->leaked_blocks;
+}
@@ -0,0 +1,24 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+#include <stdio.h>
+#include "super.h"
+
+#define FSCK_CHUNK_BLOCKS INODE_GROUP_BLOCKS
+#define FSCK_MAX_THREADS  64
+
+struct fsck_result {
+    unsigned int inodes;
+    unsigned int directories;
+    unsigned int blocks;
+    unsigned int leaked_inodes;
+    unsigned int leaked_blocks;
+    unsigned int errors;
+};
+
+struct vvsfs;
+
+int fsck_image(struct vvsfs *fs, int threads, FILE *out,
+               struct fsck_result *res);
+
+#endif
@@ -1,17 +1,502 @@
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <pthread.h>
 #include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "journal.h"
+#include "csum.h"
+#include "super.h"
+#include "file.h"
 
-int image_fd = -1;
+/*
+ * An image lives in one or more backing files. Block b belongs to
+ * stripe s = b / stripe_blocks, and stripe s is stored in file
+ * s % nfiles at stripe s / nfiles of that file. A single-file image
+ * maps every offset to itself.
+ *
+ * Single-block I/O never crosses a stripe and goes straight to its
+ * file. A longer request is cut into one segment per contiguous run:
+ * the caller does the runs on its first file itself and queues the
+ * rest on the I/O thread of the file they belong to, so every disk
+ * works through its own share at the same time.
+ *
+ * A tiered image adds a data file. bread()/bwrite() and the journal
+ * only ever use the files above, so lookups and listings never queue
+ * behind file data; dread()/dwrite() use the data file alone, at the
+ * block's own offset. image_sync() covers the data file only when its
+ * caller needs file data on disk and something was written to it since
+ * its last sync.
+ */
+#define IMAGE_IO_READ  0
+#define IMAGE_IO_WRITE 1
+#define IMAGE_IO_SYNC  2
 
-int image_open(char *filename, int truncate) {
+// Segments a request can have before image_rw() allocates.
+#define IMAGE_STACK_SEGS 16
+
+struct image_req {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             pending;
+    int             err;
+};
+
+struct image_seg {
+    struct image_seg *next;
+    struct image_req *req;
+    int               file;
+    int               op;
+    char             *buf;
+    size_t            len;
+    off_t             off;
+};
+
+struct image_io {
+    pthread_t         thread;
+    pthread_mutex_t   lock;
+    pthread_cond_t    cond;
+    struct image_seg *head;
+    struct image_seg *tail;
+    int               fd;
+    int               started;
+    int               stopping;
+};
+
+static int
+image_run(int fd, const struct image_seg *s)
+{
+    ssize_t n;
+    switch (s->op) {
+    case IMAGE_IO_READ:
+        n = pread(fd, s->buf, s->len, s->off);
+        break;
+    case IMAGE_IO_WRITE:
+        n = pwrite(fd, s->buf, s->len, s->off);
+        break;
+    default:
+        return fdatasync(fd);
+    }
+    return n == (ssize_t)s->len ? 0 : -1;
+}
+
+static void *
+image_worker(void *arg)
+{
+    struct image_io *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+    for (;;) {
+        while (!io->head && !io->stopping)
+            pthread_cond_wait(&io->cond, &io->lock);
+        struct image_seg *s = io->head;
+        if (!s)
+            break;
+        io->head = s->next;
+        if (!io->head)
+            io->tail = NULL;
+        pthread_mutex_unlock(&io->lock);
+
+        // The segment and its request belong to the submitter, who may
+        // return as soon as pending drops to zero.
+        int r = image_run(io->fd, s);
+        struct image_req *req = s->req;
+        pthread_mutex_lock(&req->lock);
+        if (r < 0)
+            req->err = -1;
+        if (--req->pending == 0)
+            pthread_cond_signal(&req->cond);
+        pthread_mutex_unlock(&req->lock);
+
+        pthread_mutex_lock(&io->lock);
+    }
+    pthread_mutex_unlock(&io->lock);
+    return NULL;
+}
+
+// Backing files, counting the data file.
+static int
+image_nfds(const struct vvsfs *fs)
+{
+    return fs->nfiles + (fs->data_file >= 0);
+}
+
+static int
+image_io_start(struct vvsfs *fs)
+{
+    if (image_nfds(fs) == 1)
+        return 0;
+    fs->io = calloc(image_nfds(fs), sizeof *fs->io);
+    if (!fs->io)
+        return -1;
+    for (int i = 0; i < image_nfds(fs); i++) {
+        struct image_io *io = &fs->io[i];
+        pthread_mutex_init(&io->lock, NULL);
+        pthread_cond_init(&io->cond, NULL);
+        io->fd = fs->fds[i];
+        if (pthread_create(&io->thread, NULL, image_worker, io) != 0)
+            return -1;
+        io->started = 1;
+    }
+    return 0;
+}
+
+static void
+image_io_stop(struct vvsfs *fs)
+{
+    if (!fs->io)
+        return;
+    for (int i = 0; i < image_nfds(fs); i++) {
+        struct image_io *io = &fs->io[i];
+        pthread_mutex_lock(&io->lock);
+        io->stopping = 1;
+        pthread_cond_signal(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+        if (io->started)
+            pthread_join(io->thread, NULL);
+        pthread_cond_destroy(&io->cond);
+        pthread_mutex_destroy(&io->lock);
+    }
+    free(fs->io);
+    fs->io = NULL;
+}
+
+// Runs every segment and returns 0, or -1 if any of them failed.
+static int
+image_submit(struct vvsfs *fs, struct image_seg *segs, int n)
+{
+    struct image_req req = { .pending = 0, .err = 0 };
+    int self = segs[0].file;
+
+    pthread_mutex_init(&req.lock, NULL);
+    pthread_cond_init(&req.cond, NULL);
+    for (int i = 0; i < n; i++)
+        if (segs[i].file != self)
+            req.pending++;
+    for (int i = 0; i < n; i++) {
+        if (segs[i].file == self)
+            continue;
+        struct image_io *io = &fs->io[segs[i].file];
+        segs[i].req  = &req;
+        segs[i].next = NULL;
+        pthread_mutex_lock(&io->lock);
+        if (io->tail)
+            io->tail->next = &segs[i];
+        else
+            io->head = &segs[i];
+        io->tail = &segs[i];
+        pthread_cond_signal(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+    }
+
+    int err = 0;
+    for (int i = 0; i < n; i++)
+        if (segs[i].file == self && image_run(fs->fds[self], &segs[i]) < 0)
+            err = -1;
+
+    pthread_mutex_lock(&req.lock);
+    while (req.pending > 0)
+        pthread_cond_wait(&req.cond, &req.lock);
+    if (req.err)
+        err = -1;
+    pthread_mutex_unlock(&req.lock);
+    pthread_cond_destroy(&req.cond);
+    pthread_mutex_destroy(&req.lock);
+    return err;
+}
+
+static size_t
+image_map_file(struct vvsfs *fs, off_t off, size_t len, int *file,
+               off_t *file_off)
+{
+    if (fs->nfiles == 1) {
+        *file     = 0;
+        *file_off = off;
+        return len;
+    }
+    off_t unit   = (off_t)fs->stripe_blocks * BLOCK_SIZE;
+    off_t stripe = off / unit;
+    off_t within = off % unit;
+    *file     = stripe % fs->nfiles;
+    *file_off = stripe / fs->nfiles * unit + within;
+    return len < (size_t)(unit - within) ? len : (size_t)(unit - within);
+}
+
+/*
+ * Maps an image offset to the backing file holding it and the offset
+ * there. Returns how many of the len bytes are contiguous in that file.
+ */
+size_t
+image_map(struct vvsfs *fs, off_t off, size_t len, int *fd, off_t *file_off)
+{
+    int file;
+    size_t run = image_map_file(fs, off, len, &file, file_off);
+    *fd = fs->fds[file];
+    return run;
+}
+
+static ssize_t
+image_rw(struct vvsfs *fs, int op, char *buf, size_t len, off_t off)
+{
+    int file;
+    off_t foff;
+    if (image_map_file(fs, off, len, &file, &foff) == len)
+        return op == IMAGE_IO_READ ? pread(fs->fds[file], buf, len, foff)
+                                   : pwrite(fs->fds[file], buf, len, foff);
+
+    int n = 0;
+    for (size_t done = 0; done < len; n++)
+        done += image_map_file(fs, off + done, len - done, &file, &foff);
+    struct image_seg stack[IMAGE_STACK_SEGS];
+    struct image_seg *segs = n <= IMAGE_STACK_SEGS ? stack
+                                                   : malloc(n * sizeof *segs);
+    if (!segs)
+        return -1;
+    size_t done = 0;
+    for (int i = 0; i < n; i++) {
+        segs[i] = (struct image_seg){ .op = op, .buf = buf + done };
+        segs[i].len = image_map_file(fs, off + done, len - done,
+                                     &segs[i].file, &segs[i].off);
+        done += segs[i].len;
+    }
+    int r = image_submit(fs, segs, n);
+    if (segs != stack)
+        free(segs);
+    return r < 0 ? -1 : (ssize_t)len;
+}
+
+// pread() on the image: returns len, or what the one file returned.
+ssize_t
+image_pread(struct vvsfs *fs, void *buf, size_t len, off_t off)
+{
+    return image_rw(fs, IMAGE_IO_READ, buf, len, off);
+}
+
+ssize_t
+image_pwrite(struct vvsfs *fs, const void *buf, size_t len, off_t off)
+{
+    return image_rw(fs, IMAGE_IO_WRITE, (char *)buf, len, off);
+}
+
+// Maps a data-block offset; image_map() unless the image is tiered.
+size_t
+image_data_map(struct vvsfs *fs, off_t off, size_t len, int *fd,
+               off_t *file_off)
+{
+    if (fs->data_file < 0)
+        return image_map(fs, off, len, fd, file_off);
+    *fd       = fs->fds[fs->data_file];
+    *file_off = off;
+    return len;
+}
+
+ssize_t
+image_data_pread(struct vvsfs *fs, void *buf, size_t len, off_t off)
+{
+    if (fs->data_file < 0)
+        return image_pread(fs, buf, len, off);
+    return pread(fs->fds[fs->data_file], buf, len, off);
+}
+
+ssize_t
+image_data_pwrite(struct vvsfs *fs, const void *buf, size_t len, off_t off)
+{
+    if (fs->data_file < 0)
+        return image_pwrite(fs, buf, len, off);
+    ssize_t n = pwrite(fs->fds[fs->data_file], buf, len, off);
+    __atomic_store_n(&fs->data_dirty, 1, __ATOMIC_RELEASE);
+    return n;
+}
+
+// Sizes every backing file so the image is size bytes long.
+int
+image_truncate(struct vvsfs *fs, off_t size)
+{
+    off_t sizes[IMAGE_MAX_FILES] = { 0 };
+    for (off_t off = 0; off < size; ) {
+        int file;
+        off_t foff;
+        size_t run = image_map_file(fs, off, size - off, &file, &foff);
+        sizes[file] = foff + run;
+        off += run;
+    }
+    for (int i = 0; i < fs->nfiles; i++)
+        if (ftruncate(fs->fds[i], sizes[i]) < 0)
+            return -1;
+    if (fs->data_file >= 0 && ftruncate(fs->fds[fs->data_file], size) < 0)
+        return -1;
+    return 0;
+}
+
+static int
+image_close_files(struct vvsfs *fs)
+{
+    int r = 0;
+    for (int i = 0; i < image_nfds(fs); i++)
+        if (close(fs->fds[i]) < 0)
+            r = -1;
+    return r;
+}
+
+static void
+vvsfs_free(struct vvsfs *fs) {
+    image_io_stop(fs);
+    file_cache_destroy(fs);
+    super_destroy(fs);
+    refcount_destroy(fs);
+    csum_destroy(fs);
+    icache_destroy(fs);
+    journal_destroy(fs);
+    pthread_mutex_destroy(&fs->dedup_lock);
+    pthread_rwlock_destroy(&fs->dir_lock);
+    pthread_mutex_destroy(&fs->bitmap_lock);
+    pthread_cond_destroy(&fs->sync_cond);
+    pthread_mutex_destroy(&fs->sync_lock);
+    free(fs);
+}
+
+static struct vvsfs *
+image_open(const char *const *files, int nfiles, unsigned int stripe_blocks,
+           const char *data_file, int truncate) {
+    if (nfiles < 1 || nfiles > IMAGE_MAX_FILES)
+        return NULL;
+    struct vvsfs *fs = calloc(1, sizeof *fs);
+    if (!fs)
+        return NULL;
+
+    fs->nfiles        = nfiles;
+    fs->stripe_blocks = stripe_blocks ? stripe_blocks : IMAGE_STRIPE_BLOCKS;
+    fs->data_file     = data_file ? nfiles : -1;
     int flags = O_RDWR | O_CREAT;
     if (truncate)
         flags |= O_TRUNC;
-    image_fd = open(filename, flags, 0600);
-    return image_fd;
+    for (int i = 0; i < image_nfds(fs); i++) {
+        fs->fds[i] = open(i < nfiles ? files[i] : data_file, flags, 0600);
+        if (fs->fds[i] < 0) {
+            while (i-- > 0)
+                close(fs->fds[i]);
+            free(fs);
+            return NULL;
+        }
+    }
+    pthread_mutex_init(&fs->sync_lock, NULL);
+    pthread_cond_init(&fs->sync_cond, NULL);
+    pthread_mutex_init(&fs->bitmap_lock, NULL);
+    pthread_rwlock_init(&fs->dir_lock, NULL);
+    pthread_mutex_init(&fs->dedup_lock, NULL);
+
+    if (image_io_start(fs) < 0 || journal_init(fs) < 0 ||
+        icache_init(fs) < 0 || csum_init(fs) < 0 || refcount_init(fs) < 0 ||
+        super_init(fs) < 0 ||
+        file_cache_init(fs) < 0 || (!truncate && super_check(fs) < 0)) {
+        image_io_stop(fs);
+        image_close_files(fs);
+        vvsfs_free(fs);
+        return NULL;
+    }
+    if (!truncate)
+        journal_recover(fs);
+    csum_load(fs);
+    refcount_load(fs);
+    super_load(fs);
+    return fs;
+}
+
+/*
+ * Opens (or with truncate, creates) an image and returns its handle, or
+ * NULL. An existing image has its journal replayed first.
+ */
+struct vvsfs *
+vvsfs_open(const char *filename, int truncate) {
+    return image_open(&filename, 1, 0, NULL, truncate);
+}
+
+/*
+ * Opens an image striped over nfiles backing files, stripe_blocks
+ * blocks at a time (0 picks IMAGE_STRIPE_BLOCKS). The files must be
+ * given in the same order every time; an image formatted with another
+ * file count or stripe unit is refused.
+ */
+struct vvsfs *
+vvsfs_open_striped(const char *const *files, int nfiles,
+                   unsigned int stripe_blocks, int truncate) {
+    return image_open(files, nfiles, stripe_blocks, NULL, truncate);
+}
+
+/*
+ * Opens an image whose metadata (superblock, bitmaps, inode table,
+ * journal, directory blocks) lives in meta_file and whose file data
+ * lives in data_file. An image formatted the other way is refused.
+ */
+struct vvsfs *
+vvsfs_open_tiered(const char *meta_file, const char *data_file,
+                  int truncate) {
+    return image_open(&meta_file, 1, 0, data_file, truncate);
+}
+
+// Commits and checkpoints everything, then releases the handle.
+int
+vvsfs_close(struct vvsfs *fs) {
+    if (!fs)
+        return -1;
+    journal_flush(fs);
+    journal_stop(fs);
+    image_io_stop(fs);
+    int r = image_close_files(fs);
+    vvsfs_free(fs);
+    return r;
+}
+
+static int
+image_datasync(struct vvsfs *fs, int data)
+{
+    if (image_nfds(fs) == 1)
+        return fdatasync(fs->fds[0]);
+    struct image_seg segs[IMAGE_MAX_FILES + 1];
+    int n = 0;
+    for (; n < fs->nfiles; n++)
+        segs[n] = (struct image_seg){ .file = n, .op = IMAGE_IO_SYNC };
+    // Writes landing after the exchange set the flag again for the
+    // next sync.
+    if (data && fs->data_file >= 0 &&
+        __atomic_exchange_n(&fs->data_dirty, 0, __ATOMIC_ACQ_REL))
+        segs[n++] = (struct image_seg){ .file = fs->data_file,
+                                        .op = IMAGE_IO_SYNC };
+    return image_submit(fs, segs, n);
 }
 
-int image_close(void) {
-    return close(image_fd);
+/*
+ * fdatasync() with leader/follower coalescing: a caller needs a sync
+ * that starts after it arrived, so everyone who shows up while one is
+ * in flight waits for and shares the next one. A striped image syncs
+ * all of its files at once. The data file of a tiered image is only
+ * synced when data is set, by a caller or by anyone sharing its sync.
+ */
+int
+image_sync(struct vvsfs *fs, int data) {
+    pthread_mutex_lock(&fs->sync_lock);
+    if (data)
+        fs->sync_data = 1;
+    unsigned long target = fs->sync_started + 1;
+    while (fs->sync_done < target) {
+        if (fs->sync_running) {
+            pthread_cond_wait(&fs->sync_cond, &fs->sync_lock);
+            continue;
+        }
+        fs->sync_started++;
+        fs->sync_running = 1;
+        int sync_data = fs->sync_data;
+        fs->sync_data = 0;
+        pthread_mutex_unlock(&fs->sync_lock);
+        int r = image_datasync(fs, sync_data);
+        pthread_mutex_lock(&fs->sync_lock);
+        fs->sync_result  = r;
+        fs->sync_done    = fs->sync_started;
+        fs->sync_running = 0;
+        pthread_cond_broadcast(&fs->sync_cond);
+    }
+    int r = fs->sync_result;
+    pthread_mutex_unlock(&fs->sync_lock);
+    return r;
 }
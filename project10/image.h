@@ -1,9 +1,80 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
-int image_open(char *filename, int truncate);
-int image_close(void);
+#include <pthread.h>
+#include <sys/types.h>
 
-extern int image_fd;
+struct journal;
+struct icache;
+struct csum_table;
+struct super_state;
+struct file_cache;
+struct image_io;
+
+// Backing files one image can be striped across.
+#define IMAGE_MAX_FILES      8
+// Default stripe unit, in blocks.
+#define IMAGE_STRIPE_BLOCKS  16
+
+/*
+ * One open image. Everything that used to be process-wide (the backing
+ * files, the journal, the in-core inode table, the checksum table,
+ * the caches and the locks guarding them) lives here, so any number of
+ * images can be open and used from one process at the same time. Each
+ * module owns the state behind its pointer.
+ */
+struct vvsfs {
+    // Block b lives in stripe b / stripe_blocks, and stripes go round
+    // robin over the backing files; see image_map(). A tiered image
+    // keeps file data in one more file, fds[data_file], that only
+    // dread()/dwrite() touch; data_dirty says it has unsynced writes.
+    int                 nfiles;
+    unsigned int        stripe_blocks;
+    int                 data_file;
+    int                 data_dirty;
+    int                 fds[IMAGE_MAX_FILES + 1];
+    struct image_io    *io;
+
+    // fdatasync() coalescing, see image_sync().
+    pthread_mutex_t     sync_lock;
+    pthread_cond_t      sync_cond;
+    unsigned long       sync_started;
+    unsigned long       sync_done;
+    int                 sync_running;
+    int                 sync_result;
+    int                 sync_data;
+
+    pthread_mutex_t     bitmap_lock;
+    pthread_rwlock_t    dir_lock;
+    pthread_mutex_t     dedup_lock;
+
+    struct journal     *journal;
+    struct icache      *icache;
+    struct csum_table  *csum;
+    unsigned char      *refs;
+    struct super_state *super;
+    struct file_cache  *fcache;
+};
+
+struct vvsfs *vvsfs_open(const char *filename, int truncate);
+struct vvsfs *vvsfs_open_striped(const char *const *files, int nfiles,
+                                 unsigned int stripe_blocks, int truncate);
+struct vvsfs *vvsfs_open_tiered(const char *meta_file, const char *data_file,
+                                int truncate);
+int           vvsfs_close(struct vvsfs *fs);
+
+size_t        image_map(struct vvsfs *fs, off_t off, size_t len,
+                        int *fd, off_t *file_off);
+ssize_t       image_pread(struct vvsfs *fs, void *buf, size_t len, off_t off);
+ssize_t       image_pwrite(struct vvsfs *fs, const void *buf, size_t len,
+                           off_t off);
+size_t        image_data_map(struct vvsfs *fs, off_t off, size_t len,
+                             int *fd, off_t *file_off);
+ssize_t       image_data_pread(struct vvsfs *fs, void *buf, size_t len,
+                               off_t off);
+ssize_t       image_data_pwrite(struct vvsfs *fs, const void *buf, size_t len,
+                                off_t off);
+int           image_truncate(struct vvsfs *fs, off_t size);
+int           image_sync(struct vvsfs *fs, int data);
 
 #endif
@@ -0,0 +1,533 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "dir.h"
+#include "pack.h"
+#include "journal.h"
+#include "import.h"
+
+/*
+ * Bulk load of a host directory tree into the root of a freshly made
+ * image, without going through directory_make()/file_write():
+ *
+ *  1. workers readdir() the host tree in parallel into a node array;
+ *  2. every inode is taken with one ialloc_batch() and every data and
+ *     directory block with one alloc_batch(), so each file's blocks
+ *     come out contiguous;
+ *  3. workers read the host files in parallel and write their data
+ *     straight to its blocks;
+ *  4. inode records and directory blocks are built in memory and each
+ *     inode-table and directory block is written once, in transactions
+ *     of at most IMPORT_TXN_BLOCKS blocks. The root's record goes last,
+ *     so a crash part way leaves an empty root and leaked inodes and
+ *     blocks for fsck rather than a half-linked tree.
+ *
+ * If anything fails after step 2, the inodes and blocks are freed.
+ *
+ * Names longer than 15 bytes, files over INODE_PTR_COUNT blocks,
+ * directories over INODE_PTR_COUNT blocks of entries and anything that
+ * is not a regular file or directory are skipped and counted.
+ */
+#define IMPORT_NAME_MAX   15
+#define IMPORT_FILE_MAX   ((off_t)INODE_PTR_COUNT * BLOCK_SIZE)
+#define IMPORT_DIR_MAX    (INODE_PTR_COUNT * BLOCK_SIZE / DIRECTORY_ENTRY_SIZE)
+#define IMPORT_TXN_BLOCKS VVSFS_TXN_MAX_BLOCKS
+
+struct import_node {
+    char          name[IMPORT_NAME_MAX + 1];
+    char         *path;
+    int           is_dir;
+    off_t         size;
+    unsigned int  parent;
+    unsigned int  nchildren;
+    unsigned int  first_child;  // into import.children
+    int           keep;
+    unsigned int  ino;
+    unsigned int  nblocks;
+    int          *blocks;
+    struct inode  in;
+};
+
+struct import {
+    struct vvsfs       *fs;
+    struct import_node *nodes;
+    unsigned int        count;
+    unsigned int        cap;
+    unsigned int       *children;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    unsigned int       *queue;
+    unsigned int        queued;
+    unsigned int        queue_cap;
+    unsigned int        busy;
+    unsigned int        next;
+    int                 failed;
+    int                 batch;
+    struct import_result *res;
+};
+
+// Appends a node; called with imp->lock held.
+static int
+node_add(struct import *imp, const char *path, const char *name,
+         unsigned int parent, int is_dir, off_t size)
+{
+    if (imp->count == imp->cap) {
+        unsigned int cap = imp->cap ? imp->cap * 2 : 256;
+        struct import_node *n = realloc(imp->nodes, cap * sizeof *n);
+        if (!n)
+            return -1;
+        imp->nodes = n;
+        imp->cap   = cap;
+    }
+    struct import_node *n = &imp->nodes[imp->count];
+    memset(n, 0, sizeof *n);
+    n->path = strdup(path);
+    if (!n->path)
+        return -1;
+    strcpy(n->name, name);
+    n->is_dir = is_dir;
+    n->size   = size;
+    n->parent = parent;
+    return imp->count++;
+}
+
+static int
+queue_push(struct import *imp, unsigned int idx)
+{
+    if (imp->queued == imp->queue_cap) {
+        unsigned int cap = imp->queue_cap ? imp->queue_cap * 2 : 64;
+        unsigned int *q = realloc(imp->queue, cap * sizeof *q);
+        if (!q)
+            return -1;
+        imp->queue     = q;
+        imp->queue_cap = cap;
+    }
+    imp->queue[imp->queued++] = idx;
+    pthread_cond_signal(&imp->cond);
+    return 0;
+}
+
+static void
+scan_dir(struct import *imp, unsigned int idx)
+{
+    pthread_mutex_lock(&imp->lock);
+    char *dir_path = strdup(imp->nodes[idx].path);
+    pthread_mutex_unlock(&imp->lock);
+    DIR *d = dir_path ? opendir(dir_path) : NULL;
+    if (!d) {
+        pthread_mutex_lock(&imp->lock);
+        imp->failed = 1;
+        pthread_mutex_unlock(&imp->lock);
+        free(dir_path);
+        return;
+    }
+
+    struct dirent *de;
+    char path[4096];
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(path, sizeof path, "%s/%s", dir_path, de->d_name);
+        struct stat st;
+        int ok = strlen(de->d_name) <= IMPORT_NAME_MAX &&
+                 lstat(path, &st) == 0 &&
+                 (S_ISDIR(st.st_mode) ||
+                  (S_ISREG(st.st_mode) && st.st_size <= IMPORT_FILE_MAX));
+
+        pthread_mutex_lock(&imp->lock);
+        if (!ok) {
+            imp->res->skipped++;
+        } else {
+            int child = node_add(imp, path, de->d_name, idx,
+                                 S_ISDIR(st.st_mode), st.st_size);
+            if (child < 0 || (S_ISDIR(st.st_mode) && queue_push(imp, child) < 0))
+                imp->failed = 1;
+        }
+        pthread_mutex_unlock(&imp->lock);
+    }
+    closedir(d);
+    free(dir_path);
+}
+
+static void *
+scan_worker(void *arg)
+{
+    struct import *imp = arg;
+
+    pthread_mutex_lock(&imp->lock);
+    for (;;) {
+        while (imp->queued == 0 && imp->busy > 0)
+            pthread_cond_wait(&imp->cond, &imp->lock);
+        if (imp->queued == 0)
+            break;
+        unsigned int idx = imp->queue[--imp->queued];
+        imp->busy++;
+        pthread_mutex_unlock(&imp->lock);
+
+        scan_dir(imp, idx);
+
+        pthread_mutex_lock(&imp->lock);
+        if (--imp->busy == 0 && imp->queued == 0)
+            pthread_cond_broadcast(&imp->cond);
+    }
+    pthread_mutex_unlock(&imp->lock);
+    return NULL;
+}
+
+static void
+load_file(struct import *imp, struct import_node *n)
+{
+    static unsigned char zero[BLOCK_SIZE];
+    unsigned char buf[BLOCK_SIZE];
+
+    int fd = n->size > 0 ? open(n->path, O_RDONLY) : -1;
+    if (n->size > 0 && fd < 0) {
+        pthread_mutex_lock(&imp->lock);
+        imp->failed = 1;
+        pthread_mutex_unlock(&imp->lock);
+        return;
+    }
+    if (n->nblocks == 0 && n->size > 0) {
+        ssize_t got = pread(fd, n->in.inline_data, n->size, 0);
+        if (got < n->size)
+            memset(n->in.inline_data + (got > 0 ? got : 0), 0,
+                   n->size - (got > 0 ? got : 0));
+    }
+    for (unsigned int i = 0; i < n->nblocks; i++) {
+        ssize_t got = pread(fd, buf, BLOCK_SIZE, (off_t)i * BLOCK_SIZE);
+        if (got < BLOCK_SIZE)
+            memcpy(buf + (got > 0 ? got : 0), zero,
+                   BLOCK_SIZE - (got > 0 ? got : 0));
+        dwrite(imp->fs, n->blocks[i], buf);
+    }
+    if (fd >= 0)
+        close(fd);
+}
+
+static void *
+load_worker(void *arg)
+{
+    struct import *imp = arg;
+
+    for (;;) {
+        unsigned int idx = __atomic_fetch_add(&imp->next, 1, __ATOMIC_RELAXED);
+        if (idx >= imp->count)
+            return NULL;
+        if (imp->nodes[idx].keep && !imp->nodes[idx].is_dir)
+            load_file(imp, &imp->nodes[idx]);
+    }
+}
+
+static void
+run_pool(struct import *imp, int threads, void *(*fn)(void *))
+{
+    pthread_t tids[IMPORT_MAX_THREADS];
+    int started = 0;
+
+    for (; started < threads - 1; started++)
+        if (pthread_create(&tids[started], NULL, fn, imp) != 0)
+            break;
+    fn(imp);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+}
+
+static unsigned int
+dir_blocks(struct import_node *n)
+{
+    unsigned int entries = 2 + n->nchildren;
+    if (entries <= DIRECTORY_INLINE_MAX)
+        return 0;
+    return (entries * DIRECTORY_ENTRY_SIZE + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Called inside a handle, which is ended and reopened every
+// IMPORT_TXN_BLOCKS blocks so no transaction outgrows the log.
+static void
+import_bwrite(struct import *imp, int block_num, unsigned char *block)
+{
+    if (imp->batch == IMPORT_TXN_BLOCKS) {
+        journal_end(imp->fs);
+        journal_begin(imp->fs);
+        imp->batch = 0;
+    }
+    bwrite(imp->fs, block_num, block);
+    imp->batch++;
+}
+
+// Gives back what import_build() allocated when it cannot finish.
+static void
+import_release(struct vvsfs *fs, const unsigned int *inos, unsigned int ninos,
+               const int *blocks, unsigned int nblocks)
+{
+    journal_begin(fs);
+    for (unsigned int i = 0; i < ninos; i++)
+        ifree(fs, inos[i]);
+    for (unsigned int i = 0; i < nblocks; i++)
+        bfree(fs, blocks[i]);
+    journal_end(fs);
+}
+
+// Groups children by parent and drops directories that are too big.
+static int
+link_children(struct import *imp)
+{
+    unsigned int *fill = calloc(imp->count, sizeof *fill);
+    imp->children = malloc((imp->count + 1) * sizeof *imp->children);
+    if (!fill || !imp->children) {
+        free(fill);
+        return -1;
+    }
+    for (unsigned int i = 1; i < imp->count; i++)
+        imp->nodes[imp->nodes[i].parent].nchildren++;
+    unsigned int pos = 0;
+    for (unsigned int i = 0; i < imp->count; i++) {
+        imp->nodes[i].first_child = pos;
+        pos += imp->nodes[i].nchildren;
+    }
+    for (unsigned int i = 1; i < imp->count; i++) {
+        struct import_node *p = &imp->nodes[imp->nodes[i].parent];
+        imp->children[p->first_child + fill[imp->nodes[i].parent]++] = i;
+    }
+    free(fill);
+
+    for (unsigned int i = 0; i < imp->count; i++) {
+        if (imp->nodes[i].nchildren + 2 > IMPORT_DIR_MAX) {
+            imp->res->skipped += imp->nodes[i].nchildren + 2 - IMPORT_DIR_MAX;
+            imp->nodes[i].nchildren = IMPORT_DIR_MAX - 2;
+        }
+    }
+    return 0;
+}
+
+// Builds the in-memory inode of every node that made it into the tree.
+static void
+build_dir(struct import *imp, struct import_node *n)
+{
+    struct inode *in = &n->in;
+    unsigned int entries = 2 + n->nchildren;
+    in->size = entries * DIRECTORY_ENTRY_SIZE;
+
+    if (n->nblocks == 0) {
+        in->flags = INODE_FLAG_DIR | INODE_FLAG_INLINE;
+        write_u16(in->inline_data, imp->nodes[n->parent].ino);
+        for (unsigned int c = 0; c < n->nchildren; c++) {
+            struct import_node *child = &imp->nodes[imp->children[n->first_child + c]];
+            struct directory_entry ent = { .inode_num = child->ino };
+            memcpy(ent.name, child->name, sizeof ent.name);
+            directory_entry_pack(&ent, in->inline_data + 2 +
+                                       c * DIRECTORY_INLINE_ENTRY);
+        }
+        return;
+    }
+
+    in->flags = INODE_FLAG_DIR;
+    unsigned char buf[BLOCK_SIZE];
+    for (unsigned int b = 0; b < n->nblocks; b++) {
+        memset(buf, 0, BLOCK_SIZE);
+        for (unsigned int e = 0; e < BLOCK_SIZE / DIRECTORY_ENTRY_SIZE; e++) {
+            unsigned int i = b * (BLOCK_SIZE / DIRECTORY_ENTRY_SIZE) + e;
+            struct directory_entry ent = { 0 };
+            if (i >= entries)
+                break;
+            if (i == 0) {
+                ent.inode_num = n->ino;
+                strcpy(ent.name, ".");
+            } else if (i == 1) {
+                ent.inode_num = imp->nodes[n->parent].ino;
+                strcpy(ent.name, "..");
+            } else {
+                struct import_node *child =
+                    &imp->nodes[imp->children[n->first_child + i - 2]];
+                ent.inode_num = child->ino;
+                memcpy(ent.name, child->name, sizeof ent.name);
+            }
+            directory_entry_pack(&ent, buf + e * DIRECTORY_ENTRY_SIZE);
+        }
+        import_bwrite(imp, n->blocks[b], buf);
+        in->block_ptr[b] = n->blocks[b];
+    }
+}
+
+// Writes every touched inode-table block once.
+static void
+write_inodes(struct import *imp, struct import_node **order,
+             unsigned int norder)
+{
+    unsigned char block[BLOCK_SIZE];
+    int cur = -1;
+
+    for (unsigned int k = 0; k < norder; k++) {
+        struct import_node *n = order[k];
+        if (!n->in.flags)
+            continue;
+        int bnum = INODE_FIRST_BLOCK + n->ino / INODES_PER_BLOCK;
+        if (bnum != cur) {
+            if (cur >= 0)
+                import_bwrite(imp, cur, block);
+            if (!bread(imp->fs, bnum, block))
+                memset(block, 0, BLOCK_SIZE);
+            cur = bnum;
+        }
+        inode_pack(&n->in, block + (n->ino % INODES_PER_BLOCK) * INODE_SIZE);
+    }
+    if (cur >= 0)
+        import_bwrite(imp, cur, block);
+}
+
+static int
+by_ino(const void *a, const void *b)
+{
+    unsigned int x = (*(struct import_node *const *)a)->ino;
+    unsigned int y = (*(struct import_node *const *)b)->ino;
+    return (x > y) - (x < y);
+}
+
+static int
+import_build(struct import *imp, int threads)
+{
+    if (link_children(imp) < 0)
+        return -1;
+
+    struct import_node **order = malloc(imp->count * sizeof *order);
+    if (!order)
+        return -1;
+
+    // Keep the root and children within limits. Children always come
+    // after their parent, so one pass marks the whole tree.
+    imp->nodes[0].keep = 1;
+    unsigned int nkeep = 1, nblocks = 0;
+    for (unsigned int i = 0; i < imp->count; i++) {
+        struct import_node *n = &imp->nodes[i];
+        if (!n->keep)
+            continue;
+        for (unsigned int c = 0; c < n->nchildren; c++) {
+            imp->nodes[imp->children[n->first_child + c]].keep = 1;
+            nkeep++;
+        }
+        n->nblocks = n->is_dir ? dir_blocks(n)
+                   : n->size > INODE_INLINE_SIZE
+                     ? (unsigned int)((n->size + BLOCK_SIZE - 1) / BLOCK_SIZE)
+                     : 0;
+        nblocks += n->nblocks;
+    }
+    imp->res->skipped += imp->count - nkeep;
+
+    unsigned int *inos = malloc(nkeep * sizeof *inos);
+    int *blocks = malloc((nblocks + 1) * sizeof *blocks);
+    unsigned int ninos = 0, nblks = 0;
+    int res = -1;
+    if (!inos || !blocks ||
+        (nkeep > 1 && ialloc_batch(imp->fs, nkeep - 1, inos) < 0))
+        goto out;
+    ninos = nkeep - 1;
+    if (nblocks > 0 && alloc_batch(imp->fs, nblocks, blocks) < 0)
+        goto out;
+    nblks = nblocks;
+
+    unsigned int ni = 0, nb = 0, norder = 0;
+    for (unsigned int i = 0; i < imp->count; i++) {
+        struct import_node *n = &imp->nodes[i];
+        if (!n->keep)
+            continue;
+        n->ino    = i == 0 ? 0 : inos[ni++];
+        n->blocks = blocks + nb;
+        nb += n->nblocks;
+        order[norder++] = n;
+    }
+
+    imp->next = 0;
+    run_pool(imp, threads, load_worker);
+    if (imp->failed)
+        goto out;
+
+    journal_begin(imp->fs);
+    imp->batch = 0;
+    for (unsigned int k = 0; k < norder; k++) {
+        struct import_node *n = order[k];
+        n->in.inode_num = n->ino;
+        if (n->is_dir) {
+            build_dir(imp, n);
+            imp->res->directories += n != &imp->nodes[0];
+            continue;
+        }
+        n->in.flags = INODE_FLAG_FILE;
+        n->in.size  = n->size;
+        if (n->nblocks == 0 && n->size > 0)
+            n->in.flags |= INODE_FLAG_INLINE;
+        for (unsigned int b = 0; b < n->nblocks; b++)
+            n->in.block_ptr[b] = n->blocks[b];
+        imp->res->files++;
+        imp->res->bytes += n->size;
+    }
+    // The root has inode 0, so it sorts first; its record is written
+    // on its own after everything it links to.
+    qsort(order, norder, sizeof *order, by_ino);
+    write_inodes(imp, order + 1, norder - 1);
+    write_inodes(imp, order, 1);
+    journal_end(imp->fs);
+    ninos = nblks = 0;
+
+    // The root is already in the in-core table; keep that copy current.
+    struct inode *root = iget(imp->fs, 0);
+    if (root) {
+        read_inode(imp->fs, root, 0);
+        iput(root);
+    }
+    res = 0;
+out:
+    if (ninos > 0 || nblks > 0)
+        import_release(imp->fs, inos, ninos, blocks, nblks);
+    free(order);
+    free(inos);
+    free(blocks);
+    return res;
+}
+
+int
+import_tree(struct vvsfs *fs, const char *host_dir, int threads,
+            struct import_result *res)
+{
+    struct import imp = { .fs = fs, .res = res };
+
+    memset(res, 0, sizeof *res);
+    if (threads < 1)
+        threads = 1;
+    if (threads > IMPORT_MAX_THREADS)
+        threads = IMPORT_MAX_THREADS;
+
+    struct inode *root = iget(fs, 0);
+    int empty = root && (root->flags & INODE_FLAG_DIR) &&
+                root->size == 2 * DIRECTORY_ENTRY_SIZE;
+    iput(root);
+    if (!empty)
+        return -1;
+
+    pthread_mutex_init(&imp.lock, NULL);
+    pthread_cond_init(&imp.cond, NULL);
+    int r = -1;
+    if (node_add(&imp, host_dir, "/", 0, 1, 0) == 0 &&
+        queue_push(&imp, 0) == 0) {
+        run_pool(&imp, threads, scan_worker);
+        if (!imp.failed)
+            r = import_build(&imp, threads);
+    }
+
+    for (unsigned int i = 0; i < imp.count; i++)
+        free(imp.nodes[i].path);
+    free(imp.nodes);
+    free(imp.children);
+    free(imp.queue);
+    pthread_cond_destroy(&imp.cond);
+    pthread_mutex_destroy(&imp.lock);
+    return r;
+}
@@ -0,0 +1,18 @@
+#ifndef IMPORT_H
+#define IMPORT_H
+
+#define IMPORT_MAX_THREADS 64
+
+struct import_result {
+    unsigned int       files;
+    unsigned int       directories;
+    unsigned long long bytes;
+    unsigned int       skipped;
+};
+
+struct vvsfs;
+
+int import_tree(struct vvsfs *fs, const char *host_dir, int threads,
+                struct import_result *res);
+
+#endif
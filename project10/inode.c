@@ -1,14 +1,68 @@
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include "image.h"
 #include "inode.h"
 #include "block.h"
 #include "free.h"
 #include "pack.h"
+#include "file.h"
+#include "journal.h"
+#include "super.h"
+#include "stats.h"
+#include "probe.h"
 
-static pthread_mutex_t inodemap_lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_mutex_t incore_lock  = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * The in-core table is split in two. hot[i] holds what a lookup needs,
+ * packed to 8 bytes a slot so incore_find() scans a few cache lines;
+ * incore[i], with the block pointers and pending buffers, is touched
+ * only after a hit. Slot i is busy while its inode is read in or
+ * written back with lock dropped. Each image has its own table.
+ */
+struct icache {
+    pthread_mutex_t inodemap_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    // Serializes read-modify-write of inode table blocks, which hold
+    // INODES_PER_BLOCK inodes each.
+    pthread_mutex_t itable_lock;
 
-static struct inode incore[MAX_SYS_OPEN_FILES];
+    struct {
+        unsigned int   inode_num;
+        unsigned short ref_count;
+        unsigned char  busy;
+    } hot[MAX_SYS_OPEN_FILES];
+
+    struct inode    incore[MAX_SYS_OPEN_FILES];
+};
+
+int
+icache_init(struct vvsfs *fs) {
+    struct icache *ic = calloc(1, sizeof *ic);
+    if (!ic)
+        return -1;
+    pthread_mutex_init(&ic->inodemap_lock, NULL);
+    pthread_mutex_init(&ic->lock, NULL);
+    pthread_cond_init(&ic->cond, NULL);
+    pthread_mutex_init(&ic->itable_lock, NULL);
+    for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
+        ic->incore[i].fs = fs;
+    fs->icache = ic;
+    return 0;
+}
+
+void
+icache_destroy(struct vvsfs *fs) {
+    struct icache *ic = fs->icache;
+    if (!ic)
+        return;
+    pthread_mutex_destroy(&ic->itable_lock);
+    pthread_cond_destroy(&ic->cond);
+    pthread_mutex_destroy(&ic->lock);
+    pthread_mutex_destroy(&ic->inodemap_lock);
+    free(ic);
+    fs->icache = NULL;
+}
 
 static void
 inode_loc(unsigned int inode_num,
@@ -19,85 +73,164 @@ inode_loc(unsigned int inode_num,
     *byte_offset    = off * INODE_SIZE;
 }
 
-struct inode *
-incore_find_free(void) {
+static int
+slot_free(struct icache *ic) {
     for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
-        if (incore[i].ref_count == 0)
-            return &incore[i];
-    return NULL;
+        if (ic->hot[i].ref_count == 0 && !ic->hot[i].busy)
+            return i;
+    return -1;
 }
 
-struct inode *
-incore_find(unsigned int inode_num) {
+static int
+slot_find(struct icache *ic, unsigned int inode_num) {
     for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
-        if (incore[i].ref_count > 0 &&
-            incore[i].inode_num == inode_num)
-            return &incore[i];
-    return NULL;
+        if (ic->hot[i].inode_num == inode_num &&
+            (ic->hot[i].ref_count > 0 || ic->hot[i].busy))
+            return i;
+    return -1;
+}
+
+struct inode *
+incore_find_free(struct vvsfs *fs) {
+    int i = slot_free(fs->icache);
+    return i < 0 ? NULL : &fs->icache->incore[i];
+}
+
+struct inode *
+incore_find(struct vvsfs *fs, unsigned int inode_num) {
+    int i = slot_find(fs->icache, inode_num);
+    return i < 0 ? NULL : &fs->icache->incore[i];
 }
 
 void
-incore_free_all(void) {
-    for (int i = 0; i < MAX_SYS_OPEN_FILES; i++)
-        incore[i].ref_count = 0;
+incore_free_all(struct vvsfs *fs) {
+    memset(fs->icache->hot, 0, sizeof fs->icache->hot);
+}
+
+_Static_assert(INODE_PTR_COUNT == 16 &&
+               INODE_INLINE_OFFSET + 2 * INODE_PTR_COUNT <= INODE_SIZE,
+               "INODE_PTR_LAYOUT does not match the record");
+
+// Decodes one INODE_SIZE on-disk record; generated from the layouts.
+static inline void
+inode_decode(struct inode *s, const unsigned char *rec) {
+    INODE_HEADER_LAYOUT(PACK_DECODE)
+    if (s->flags & INODE_FLAG_INLINE) {
+        memcpy(s->inline_data, rec + INODE_INLINE_OFFSET, INODE_INLINE_SIZE);
+        memset(s->block_ptr, 0, sizeof s->block_ptr);
+        return;
+    }
+    INODE_PTR_LAYOUT(PACK_DECODE)
+    memset(s->inline_data, 0, INODE_INLINE_SIZE);
+}
+
+void
+inode_unpack(struct inode *in, const unsigned char *raw) {
+    inode_decode(in, raw);
 }
 
+/*
+ * Decodes all INODES_PER_BLOCK records of an inode table block into
+ * ins[], numbering them from first_inode.
+ */
 void
-read_inode(struct inode *in, unsigned int inode_num) {
+inode_unpack_block(struct inode *ins, const unsigned char *block,
+                   unsigned int first_inode) {
+    for (int i = 0; i < INODES_PER_BLOCK; i++) {
+        inode_decode(&ins[i], block + i * INODE_SIZE);
+        ins[i].inode_num = first_inode + i;
+    }
+}
+
+// Also points in at fs, so it can be handed to directory_init().
+void
+read_inode(struct vvsfs *fs, struct inode *in, unsigned int inode_num) {
     unsigned char block[BLOCK_SIZE];
     int bnum, off;
+    STATS_START(t);
     inode_loc(inode_num, &bnum, &off);
-    bread(bnum, block);
-    in->size        = read_u32(block + off + 0);
-    in->owner_id    = read_u16(block + off + 4);
-    in->permissions = read_u8(block + off + 6);
-    in->flags       = read_u8(block + off + 7);
-    in->link_count  = read_u8(block + off + 8);
-    for (int i = 0; i < INODE_PTR_COUNT; i++) {
-        int ptr = 9 + i * 2;
-        in->block_ptr[i] = read_u16(block + off + ptr);
+    if (!super_group_ready(fs, inode_num / INODE_GROUP_INODES)) {
+        memset(block, 0, INODE_SIZE);
+        off = 0;
+    } else if (!bread(fs, bnum, block)) {
+        memset(block + off, 0, INODE_SIZE);
     }
+    inode_unpack(in, block + off);
+    in->fs = fs;
+    STATS_END(VVSFS_STAT_INODE_READ, t);
 }
 
+// Encodes in into one INODE_SIZE on-disk record.
 void
-write_inode(const struct inode *in) {
-    unsigned char block[BLOCK_SIZE];
+inode_pack(const struct inode *s, unsigned char *rec) {
+    INODE_HEADER_LAYOUT(PACK_ENCODE)
+    if (s->flags & INODE_FLAG_INLINE) {
+        memcpy(rec + INODE_INLINE_OFFSET, s->inline_data, INODE_INLINE_SIZE);
+        return;
+    }
+    INODE_PTR_LAYOUT(PACK_ENCODE)
+}
+
+// A record that is already on disk as in holds it is not logged again,
+// so the write-back of a clean inode costs no commit.
+void
+write_inode(struct vvsfs *fs, const struct inode *in) {
+    unsigned char block[BLOCK_SIZE], rec[INODE_SIZE];
     int bnum, off;
+    STATS_START(t);
     inode_loc(in->inode_num, &bnum, &off);
-    bread(bnum, block);
-    write_u32(block + off + 0, in->size);
-    write_u16(block + off + 4, in->owner_id);
-    write_u8 (block + off + 6, in->permissions);
-    write_u8 (block + off + 7, in->flags);
-    write_u8 (block + off + 8, in->link_count);
-    for (int i = 0; i < INODE_PTR_COUNT; i++) {
-        int ptr = 9 + i * 2;
-        write_u16(block + off + ptr, in->block_ptr[i]);
-    }
-    bwrite(bnum, block);
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->icache->itable_lock);
+    int ok = bread(fs, bnum, block) != NULL;
+    memcpy(rec, block + off, INODE_SIZE);
+    inode_pack(in, block + off);
+    if (!ok || memcmp(rec, block + off, INODE_SIZE) != 0)
+        bwrite(fs, bnum, block);
+    pthread_mutex_unlock(&fs->icache->itable_lock);
+    journal_end(fs);
+    STATS_END(VVSFS_STAT_INODE_WRITE, t);
 }
 
+/*
+ * iget() of an inode whose slot is busy waits it out, so nobody sees a
+ * half-read inode or rereads one whose write-back is still in flight,
+ * and the slot is not handed out again meanwhile.
+ */
 struct inode *
-iget(unsigned int inode_num) {
-    pthread_mutex_lock(&incore_lock);
-
-    struct inode *in = incore_find(inode_num);
-    if (in) {
-        in->ref_count++;
-        pthread_mutex_unlock(&incore_lock);
-        return in;
+iget(struct vvsfs *fs, unsigned int inode_num) {
+    struct icache *ic = fs->icache;
+    VVSFS_PROBE1(iget__entry, inode_num);
+    vvsfs_mutex_lock(&ic->lock);
+
+    int i;
+    while ((i = slot_find(ic, inode_num)) >= 0 && ic->hot[i].busy)
+        pthread_cond_wait(&ic->cond, &ic->lock);
+    if (i >= 0) {
+        ic->hot[i].ref_count++;
+        pthread_mutex_unlock(&ic->lock);
+        VVSFS_PROBE2(iget__return, inode_num, 1);
+        return &ic->incore[i];
     }
 
-    in = incore_find_free();
-    if (!in) {
-        pthread_mutex_unlock(&incore_lock);
+    i = slot_free(ic);
+    if (i < 0) {
+        pthread_mutex_unlock(&ic->lock);
+        VVSFS_PROBE2(iget__return, inode_num, -1);
         return NULL;
     }
-    in->ref_count  = 1;
-    in->inode_num = inode_num;
-    pthread_mutex_unlock(&incore_lock);
+    ic->hot[i].ref_count = 1;
+    ic->hot[i].inode_num = inode_num;
+    ic->hot[i].busy      = 1;
+    pthread_mutex_unlock(&ic->lock);
 
-    read_inode(in, inode_num);
+    struct inode *in = &ic->incore[i];
+    in->inode_num = inode_num;
+    read_inode(fs, in, inode_num);
+    vvsfs_mutex_lock(&ic->lock);
+    ic->hot[i].busy = 0;
+    pthread_cond_broadcast(&ic->cond);
+    pthread_mutex_unlock(&ic->lock);
+    VVSFS_PROBE2(iget__return, inode_num, 0);
     return in;
 }
 
@@ -105,35 +238,99 @@ void
 iput(struct inode *in) {
     if (!in) return;
 
-    pthread_mutex_lock(&incore_lock);
-    if (in->ref_count > 0) {
-        in->ref_count--;
-        if (in->ref_count == 0) {
-            pthread_mutex_unlock(&incore_lock);
-            write_inode(in);
+    struct vvsfs  *fs = in->fs;
+    struct icache *ic = fs->icache;
+    unsigned int inode_num = in->inode_num;
+    int i = in - ic->incore;
+    VVSFS_PROBE1(iput__entry, inode_num);
+    // Only the final put writes back, so only it needs a handle. The
+    // handle comes before the lock (a write-back must not wait on a
+    // commit while iget() callers that hold handles wait on the
+    // write-back), so drop the lock to begin one and look again.
+    int handle = 0;
+    vvsfs_mutex_lock(&ic->lock);
+    while (ic->hot[i].ref_count == 1 && !handle) {
+        pthread_mutex_unlock(&ic->lock);
+        journal_begin(fs);
+        handle = 1;
+        vvsfs_mutex_lock(&ic->lock);
+    }
+    if (ic->hot[i].ref_count > 0) {
+        ic->hot[i].ref_count--;
+        if (ic->hot[i].ref_count == 0) {
+            ic->hot[i].busy = 1;
+            pthread_mutex_unlock(&ic->lock);
+            file_flush(in);
+            write_inode(fs, in);
+            vvsfs_mutex_lock(&ic->lock);
+            ic->hot[i].busy = 0;
+            pthread_cond_broadcast(&ic->cond);
+            pthread_mutex_unlock(&ic->lock);
+            journal_end(fs);
+            VVSFS_PROBE2(iput__return, inode_num, 1);
             return;
         }
     }
-    pthread_mutex_unlock(&incore_lock);
+    pthread_mutex_unlock(&ic->lock);
+    if (handle)
+        journal_end(fs);
+    VVSFS_PROBE2(iput__return, inode_num, 0);
 }
 
-struct inode *
-ialloc(void) {
+/*
+ * Marks count free inodes allocated with one inode map update and
+ * stores their numbers in inodes. The in-core table is not touched;
+ * the caller writes the records itself.
+ */
+int
+ialloc_batch(struct vvsfs *fs, int count, unsigned int *inodes) {
     unsigned char map[BLOCK_SIZE];
 
-    pthread_mutex_lock(&inodemap_lock);
-    bread(INODE_MAP_BLOCK, map);
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->icache->inodemap_lock);
+    bread(fs, INODE_MAP_BLOCK, map);
+    for (int i = 0; i < count; i++) {
+        int idx = find_free(map);
+        if (idx < 0) {
+            pthread_mutex_unlock(&fs->icache->inodemap_lock);
+            journal_end(fs);
+            return -1;
+        }
+        set_free(map, idx, 1);
+        inodes[i] = idx;
+    }
+    bwrite(fs, INODE_MAP_BLOCK, map);
+    pthread_mutex_unlock(&fs->icache->inodemap_lock);
+
+    for (int i = 0; i < count; i++)
+        super_group_init(fs, inodes[i] / INODE_GROUP_INODES);
+    journal_end(fs);
+    return count;
+}
+
+static struct inode *
+ialloc_one(struct vvsfs *fs) {
+    unsigned char map[BLOCK_SIZE];
+
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->icache->inodemap_lock);
+    bread(fs, INODE_MAP_BLOCK, map);
     int idx = find_free(map);
     if (idx < 0) {
-        pthread_mutex_unlock(&inodemap_lock);
+        pthread_mutex_unlock(&fs->icache->inodemap_lock);
+        journal_end(fs);
         return NULL;
     }
     set_free(map, idx, 1);
-    bwrite(INODE_MAP_BLOCK, map);
-    pthread_mutex_unlock(&inodemap_lock);
+    bwrite(fs, INODE_MAP_BLOCK, map);
+    pthread_mutex_unlock(&fs->icache->inodemap_lock);
+    super_group_init(fs, idx / INODE_GROUP_INODES);
 
-    struct inode *in = iget(idx);
-    if (!in) return NULL;
+    struct inode *in = iget(fs, idx);
+    if (!in) {
+        journal_end(fs);
+        return NULL;
+    }
 
     in->size        = 0;
     in->owner_id    = 0;
@@ -142,7 +339,34 @@ ialloc(void) {
     in->link_count  = 0;
     for (int i = 0; i < INODE_PTR_COUNT; i++)
         in->block_ptr[i] = 0;
+    memset(in->inline_data, 0, INODE_INLINE_SIZE);
+
+    write_inode(fs, in);
+    journal_end(fs);
+    return in;
+}
 
-    write_inode(in);
+struct inode *
+ialloc(struct vvsfs *fs) {
+    STATS_START(t);
+    VVSFS_PROBE0(ialloc__entry);
+    struct inode *in = ialloc_one(fs);
+    VVSFS_PROBE1(ialloc__return, in ? (int)in->inode_num : -1);
+    STATS_END(VVSFS_STAT_IALLOC, t);
     return in;
 }
+
+// Clears inode_num in the inode map. The caller has dropped its last
+// reference and left a zeroed record behind.
+void
+ifree(struct vvsfs *fs, unsigned int inode_num) {
+    unsigned char map[BLOCK_SIZE];
+
+    journal_begin(fs);
+    vvsfs_mutex_lock(&fs->icache->inodemap_lock);
+    bread(fs, INODE_MAP_BLOCK, map);
+    set_free(map, inode_num, 0);
+    bwrite(fs, INODE_MAP_BLOCK, map);
+    pthread_mutex_unlock(&fs->icache->inodemap_lock);
+    journal_end(fs);
+}
@@ -9,6 +9,50 @@
 #define INODE_FIRST_BLOCK 3
 #define INODES_PER_BLOCK  (BLOCK_SIZE / INODE_SIZE)
 #define MAX_SYS_OPEN_FILES 64
+#define INODE_COUNT       (BLOCK_SIZE * 8)
+#define INODE_BLOCK_COUNT (INODE_COUNT / INODES_PER_BLOCK)
+#define JOURNAL_FIRST_BLOCK (INODE_FIRST_BLOCK + INODE_BLOCK_COUNT)
+#define JOURNAL_BLOCK_COUNT 256
+#define REFCOUNT_FIRST_BLOCK (JOURNAL_FIRST_BLOCK + JOURNAL_BLOCK_COUNT)
+#define REFCOUNT_BLOCK_COUNT ((BLOCK_SIZE * 8) / BLOCK_SIZE)
+#define DEDUP_FIRST_BLOCK (REFCOUNT_FIRST_BLOCK + REFCOUNT_BLOCK_COUNT)
+#define DEDUP_BLOCK_COUNT 128
+#define CSUM_FIRST_BLOCK  (DEDUP_FIRST_BLOCK + DEDUP_BLOCK_COUNT)
+#define CSUM_BLOCK_COUNT  ((BLOCK_SIZE * 8 * 4) / BLOCK_SIZE)
+#define DATA_FIRST_BLOCK  (CSUM_FIRST_BLOCK + CSUM_BLOCK_COUNT)
+
+#define INODE_FLAG_FILE   1
+#define INODE_FLAG_DIR    2
+#define INODE_FLAG_DEDUP  0x20
+#define INODE_FLAG_COMPRESS 0x40
+#define INODE_FLAG_INLINE 0x80
+
+#define INODE_INLINE_OFFSET 9
+#define INODE_INLINE_SIZE   (INODE_SIZE - INODE_INLINE_OFFSET)
+
+/*
+ * On-disk inode record. The header fields are followed either by
+ * INODE_PTR_COUNT block pointers or, for INODE_FLAG_INLINE, by
+ * INODE_INLINE_SIZE bytes of data in the same place.
+ */
+#define INODE_HEADER_LAYOUT(X) \
+    X(size,        u32, 0) \
+    X(owner_id,    u16, 4) \
+    X(permissions, u8,  6) \
+    X(flags,       u8,  7) \
+    X(link_count,  u8,  8)
+
+#define INODE_PTR_LAYOUT(X) \
+    X(block_ptr[0],  u16,  9) X(block_ptr[1],  u16, 11) \
+    X(block_ptr[2],  u16, 13) X(block_ptr[3],  u16, 15) \
+    X(block_ptr[4],  u16, 17) X(block_ptr[5],  u16, 19) \
+    X(block_ptr[6],  u16, 21) X(block_ptr[7],  u16, 23) \
+    X(block_ptr[8],  u16, 25) X(block_ptr[9],  u16, 27) \
+    X(block_ptr[10], u16, 29) X(block_ptr[11], u16, 31) \
+    X(block_ptr[12], u16, 33) X(block_ptr[13], u16, 35) \
+    X(block_ptr[14], u16, 37) X(block_ptr[15], u16, 39)
+
+struct vvsfs;
 
 struct inode {
     unsigned int     size;
@@ -17,27 +61,39 @@ struct inode {
     unsigned char    flags;
     unsigned char    link_count;
     unsigned short   block_ptr[INODE_PTR_COUNT];
+    unsigned char    inline_data[INODE_INLINE_SIZE];
 
   
-    unsigned int     ref_count;
+    struct vvsfs    *fs;
     unsigned int     inode_num;
+    unsigned char   *pending[INODE_PTR_COUNT];
 };
 
 
-struct inode *incore_find_free(void);
+int           icache_init(struct vvsfs *fs);
+void          icache_destroy(struct vvsfs *fs);
+
+struct inode *incore_find_free(struct vvsfs *fs);
 
-struct inode *incore_find(unsigned int inode_num);
+struct inode *incore_find(struct vvsfs *fs, unsigned int inode_num);
 
-void         incore_free_all(void);
+void         incore_free_all(struct vvsfs *fs);
 
-void         read_inode(struct inode *in, unsigned int inode_num);
-void         write_inode(const struct inode *in);
+void         inode_unpack(struct inode *in, const unsigned char *raw);
+void         inode_unpack_block(struct inode *ins, const unsigned char *block,
+                                unsigned int first_inode);
+void         inode_pack(const struct inode *in, unsigned char *rec);
+void         read_inode(struct vvsfs *fs, struct inode *in,
+                        unsigned int inode_num);
+void         write_inode(struct vvsfs *fs, const struct inode *in);
 
 
-struct inode *iget(unsigned int inode_num);
+struct inode *iget(struct vvsfs *fs, unsigned int inode_num);
 void          iput(struct inode *in);
 
 
-struct inode *ialloc(void);
+struct inode *ialloc(struct vvsfs *fs);
+int           ialloc_batch(struct vvsfs *fs, int count, unsigned int *inodes);
+void          ifree(struct vvsfs *fs, unsigned int inode_num);
 
 #endif 
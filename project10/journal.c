@@ -0,0 +1,925 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+#include "pack.h"
+#include "journal.h"
+#include "stats.h"
+
+// A full transaction's block numbers fit in its descriptor block.
+_Static_assert(12 + JOURNAL_MAX_TXN * 4 <= BLOCK_SIZE,
+               "journal descriptor too small for JOURNAL_MAX_TXN");
+
+/*
+ * Metadata blocks written inside a handle are copied into a jbuf and
+ * tagged with the running transaction. All handles that overlap join
+ * the same running transaction; whoever ends last and finds it
+ * uncommitted becomes the commit leader, writes every block of the
+ * transaction to the log in one pwrite() plus one fdatasync(), and wakes
+ * the followers. A background thread then checkpoints committed jbufs
+ * to their home location and recycles the log once it is empty.
+ *
+ * Only VVSFS_DURABILITY_OPERATION makes journal_end() wait for that
+ * commit. In the other modes the running transaction keeps growing
+ * until vvsfs_sync(), the periodic syncer, half a log's worth of dirty
+ * blocks or vvsfs_close() commits it; VVSFS_DURABILITY_NONE also skips
+ * every fdatasync() except the one vvsfs_sync() asks for.
+ *
+ * On a tiered image the fdatasync() of a commit covers the data file
+ * only if file data was written while that transaction was running
+ * (see journal_data()); checkpoints and other commits leave it alone.
+ *
+ * A transaction must fit in the log to be atomic. A new handle does not
+ * join one that already holds half a log's worth of blocks but commits
+ * it first, so only handles that stay open can fill one. A write that
+ * would take it past JOURNAL_MAX_TXN closes it without waiting for
+ * them (a split) and goes to the next one; journal_end() reports -1 to
+ * a handle whose blocks ended up in more than one transaction.
+ *
+ * While a vvsfs_txn is open, a commit is not started but waits for it:
+ * closing the transaction would stop every journal_begin(), readers
+ * included, until the caller gets round to committing. Handles keep
+ * joining; only writers that need their own commit wait.
+ *
+ * Each open image has its own journal and its own background threads,
+ * which vvsfs_close() stops.
+ *
+ * A block that a closed transaction logged may be written again by the
+ * running one before it is checkpointed. Its last closed version is
+ * then frozen in the jbuf, written home like any other, and the log is
+ * not recycled while a frozen version is still unwritten.
+ */
+struct jbuf {
+    int            block_num;
+    unsigned int   tid;
+    struct jbuf   *next;
+    unsigned char *frozen;
+    unsigned int   frozen_tid;
+    unsigned char  data[BLOCK_SIZE];
+};
+
+// One block on its way home, copied out so the I/O runs unlocked.
+struct ckpt {
+    int            block_num;
+    unsigned int   tid;
+    unsigned char  data[BLOCK_SIZE];
+};
+
+struct journal {
+    struct vvsfs   *fs;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    pthread_cond_t  ckpt_cond;
+    pthread_t       ckpt_thread;
+    int             ckpt_started;
+    int             stopping;
+
+    struct jbuf    *hash[JOURNAL_HASH_SIZE];
+    int             nbufs;
+
+    struct jbuf   **running;
+    int             nrunning;
+    int             running_cap;
+    unsigned int    running_tid;
+    int             handles;
+    int             closing;
+    int             split;
+    int             user_txns;
+
+    int             committing;
+    int             checkpointing;
+    unsigned int    committed_tid;
+    unsigned int    data_tid;
+    int             head;
+    int             header_valid;
+
+    int             durability;
+    unsigned int    period_ms;
+    pthread_cond_t  period_cond;
+    pthread_t       period_thread;
+    int             period_started;
+};
+
+/*
+ * A thread's handle depth and transaction are per image. The images a
+ * thread has handles open on sit in a thread-local table of
+ * JOURNAL_MAX_NESTED slots that moves to the heap, doubling, once a
+ * thread needs more; a slot whose depth is 0 is free. A handle that
+ * logged nothing never waits for a commit; tid and last are the first
+ * and last transactions it logged into.
+ */
+struct handle {
+    struct journal *j;
+    int             depth;
+    unsigned int    tid;
+    unsigned int    last;
+    int             logged;
+    int             user;
+    int             blocks;
+};
+
+static __thread struct handle  handles_inline[JOURNAL_MAX_NESTED];
+static __thread struct handle *handles_heap;
+static __thread int            handles_cap;
+
+static pthread_key_t  handles_key;
+static pthread_once_t handles_once = PTHREAD_ONCE_INIT;
+
+static void
+handles_key_init(void)
+{
+    pthread_key_create(&handles_key, free);
+}
+
+static struct handle *
+handle_table(int *n)
+{
+    if (handles_heap) {
+        *n = handles_cap;
+        return handles_heap;
+    }
+    *n = JOURNAL_MAX_NESTED;
+    return handles_inline;
+}
+
+static struct handle *
+handle_find(struct journal *j)
+{
+    int n;
+    struct handle *t = handle_table(&n);
+    for (int i = 0; i < n; i++)
+        if (t[i].depth > 0 && t[i].j == j)
+            return &t[i];
+    return NULL;
+}
+
+// A free slot, growing the table if every one is in use.
+static struct handle *
+handle_slot(void)
+{
+    int n;
+    struct handle *t = handle_table(&n);
+    for (int i = 0; i < n; i++)
+        if (t[i].depth == 0)
+            return &t[i];
+
+    pthread_once(&handles_once, handles_key_init);
+    struct handle *g = realloc(handles_heap, 2 * n * sizeof *g);
+    if (!g)
+        return NULL;
+    if (!handles_heap)
+        memcpy(g, handles_inline, sizeof handles_inline);
+    memset(g + n, 0, n * sizeof *g);
+    handles_heap = g;
+    handles_cap  = 2 * n;
+    pthread_setspecific(handles_key, g);
+    return &g[n];
+}
+
+static int
+handle_depth(struct journal *j)
+{
+    struct handle *h = handle_find(j);
+    return h ? h->depth : 0;
+}
+
+static void
+journal_sync(struct journal *j, int data)
+{
+    // Also called with j->lock dropped, hence the atomic load.
+    if (__atomic_load_n(&j->durability, __ATOMIC_RELAXED) !=
+        VVSFS_DURABILITY_NONE)
+        image_sync(j->fs, data);
+}
+
+static off_t
+log_offset(int pos)
+{
+    return (off_t)(JOURNAL_FIRST_BLOCK + 1 + pos) * BLOCK_SIZE;
+}
+
+static unsigned int
+log_hash(const unsigned char *buf, size_t len)
+{
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= buf[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static struct jbuf *
+jbuf_find(struct journal *j, int block_num)
+{
+    struct jbuf *b = j->hash[block_num % JOURNAL_HASH_SIZE];
+    while (b && b->block_num != block_num)
+        b = b->next;
+    return b;
+}
+
+static struct jbuf *
+jbuf_get(struct journal *j, int block_num)
+{
+    struct jbuf *b = jbuf_find(j, block_num);
+    if (b)
+        return b;
+
+    b = malloc(sizeof *b);
+    if (!b)
+        return NULL;
+    b->block_num = block_num;
+    b->tid       = 0;
+    b->frozen    = NULL;
+    b->next      = j->hash[block_num % JOURNAL_HASH_SIZE];
+    j->hash[block_num % JOURNAL_HASH_SIZE] = b;
+    __atomic_add_fetch(&j->nbufs, 1, __ATOMIC_RELEASE);
+    return b;
+}
+
+static void
+jbuf_remove(struct journal *j, struct jbuf *b)
+{
+    struct jbuf **pp = &j->hash[b->block_num % JOURNAL_HASH_SIZE];
+    while (*pp != b)
+        pp = &(*pp)->next;
+    *pp = b->next;
+    free(b->frozen);
+    free(b);
+    __atomic_sub_fetch(&j->nbufs, 1, __ATOMIC_RELEASE);
+}
+
+static void
+write_header(unsigned char *buf, unsigned int start_seq)
+{
+    memset(buf, 0, BLOCK_SIZE);
+    write_u32(buf + 0, JOURNAL_HEADER_MAGIC);
+    write_u32(buf + 4, start_seq);
+}
+
+// Points *data at the committed version of b still owed to its home
+// location and returns its tid, or returns 0 if nothing is owed.
+static unsigned int
+jbuf_committed(struct journal *j, struct jbuf *b,
+               const unsigned char **data)
+{
+    if (b->tid && b->tid <= j->committed_tid) {
+        *data = b->data;
+        return b->tid;
+    }
+    if (b->frozen && b->frozen_tid <= j->committed_tid) {
+        *data = b->frozen;
+        return b->frozen_tid;
+    }
+    return 0;
+}
+
+static int
+checkpoint_pending(struct journal *j)
+{
+    const unsigned char *data;
+    for (int i = 0; i < JOURNAL_HASH_SIZE; i++)
+        for (struct jbuf *b = j->hash[i]; b; b = b->next)
+            if (jbuf_committed(j, b, &data))
+                return 1;
+    return 0;
+}
+
+/*
+ * Called with j->lock held; drops it around the I/O. The log is
+ * only recycled when no commit other than our own is in flight, since
+ * that commit's records sit past the current head.
+ */
+static void
+checkpoint_locked(struct journal *j, int own_commit)
+{
+    struct vvsfs *fs = j->fs;
+
+    while (j->checkpointing)
+        pthread_cond_wait(&j->cond, &j->lock);
+    j->checkpointing = 1;
+
+    int                  n    = 0;
+    struct ckpt         *copy = NULL;
+    const unsigned char *data;
+    for (int i = 0; i < JOURNAL_HASH_SIZE; i++)
+        for (struct jbuf *b = j->hash[i]; b; b = b->next)
+            if (jbuf_committed(j, b, &data))
+                n++;
+    if (n > 0)
+        copy = malloc(n * sizeof *copy);
+    if (copy) {
+        n = 0;
+        for (int i = 0; i < JOURNAL_HASH_SIZE; i++) {
+            for (struct jbuf *b = j->hash[i]; b; b = b->next) {
+                unsigned int tid = jbuf_committed(j, b, &data);
+                if (!tid)
+                    continue;
+                copy[n].block_num = b->block_num;
+                copy[n].tid       = tid;
+                memcpy(copy[n++].data, data, BLOCK_SIZE);
+            }
+        }
+    } else {
+        n = 0;
+    }
+
+    pthread_mutex_unlock(&j->lock);
+    for (int i = 0; i < n; i++)
+        image_pwrite(fs, copy[i].data, BLOCK_SIZE,
+                     (off_t)copy[i].block_num * BLOCK_SIZE);
+    if (n > 0)
+        journal_sync(j, 0);
+    vvsfs_mutex_lock(&j->lock);
+
+    for (int i = 0; i < n; i++) {
+        struct jbuf *b = jbuf_find(j, copy[i].block_num);
+        if (!b)
+            continue;
+        if (b->tid == copy[i].tid) {
+            jbuf_remove(j, b);
+        } else if (b->frozen && b->frozen_tid == copy[i].tid) {
+            free(b->frozen);
+            b->frozen = NULL;
+        }
+    }
+    free(copy);
+
+    if (j->head > 0 && !checkpoint_pending(j) &&
+        (own_commit || !j->committing)) {
+        unsigned char hdr[BLOCK_SIZE];
+        write_header(hdr, j->committed_tid + 1);
+        image_pwrite(fs, hdr, BLOCK_SIZE,
+                     (off_t)JOURNAL_FIRST_BLOCK * BLOCK_SIZE);
+        journal_sync(j, 0);
+        j->head         = 0;
+        j->header_valid = 1;
+    }
+
+    j->checkpointing = 0;
+    pthread_cond_broadcast(&j->cond);
+}
+
+static void *
+checkpoint_thread(void *arg)
+{
+    struct journal *j = arg;
+    vvsfs_mutex_lock(&j->lock);
+    for (;;) {
+        while (!j->stopping && !checkpoint_pending(j))
+            pthread_cond_wait(&j->ckpt_cond, &j->lock);
+        if (j->stopping)
+            break;
+        checkpoint_locked(j, 0);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+/*
+ * Closes the running transaction and makes it durable. Called with
+ * j->lock held by the commit leader. The transaction closes once its
+ * handles have ended, or at once when j->split is set.
+ */
+static void
+commit_locked(struct journal *j)
+{
+    struct vvsfs *fs = j->fs;
+
+    j->committing = 1;
+    j->closing    = 1;
+    while (j->handles > 0 && !j->split)
+        pthread_cond_wait(&j->cond, &j->lock);
+    j->split = 0;
+
+    unsigned int  tid   = j->running_tid;
+    int           count = j->nrunning;
+    int           fdata = j->data_tid == tid;
+    int           hdr   = !j->header_valid;
+    size_t        len   = (size_t)(hdr + count + 2) * BLOCK_SIZE;
+    unsigned char *buf  = calloc(1, len);
+
+    unsigned char *desc = buf + (size_t)hdr * BLOCK_SIZE;
+    unsigned char *data = desc + BLOCK_SIZE;
+    unsigned char *cmt  = data + (size_t)count * BLOCK_SIZE;
+    if (buf) {
+        if (hdr)
+            write_header(buf, tid);
+        write_u32(desc + 0, JOURNAL_DESC_MAGIC);
+        write_u32(desc + 4, tid);
+        write_u32(desc + 8, count);
+        for (int i = 0; i < count; i++) {
+            struct jbuf *b = j->running[i];
+            write_u32(desc + 12 + i * 4, b->block_num);
+            memcpy(data + (size_t)i * BLOCK_SIZE, b->data, BLOCK_SIZE);
+        }
+        write_u32(cmt + 0, JOURNAL_COMMIT_MAGIC);
+        write_u32(cmt + 4, tid);
+        write_u32(cmt + 8, count);
+        write_u32(cmt + 12,
+                  log_hash(desc, (size_t)(count + 1) * BLOCK_SIZE));
+    }
+
+    j->nrunning = 0;
+    j->running_tid++;
+    j->closing = 0;
+    pthread_cond_broadcast(&j->cond);
+
+    if (buf) {
+        if (j->head + count + 2 > JOURNAL_LOG_BLOCKS)
+            checkpoint_locked(j, 1);
+        int pos = j->head;
+        j->head += count + 2;
+        if (hdr)
+            j->header_valid = 1;
+
+        pthread_mutex_unlock(&j->lock);
+        off_t off = hdr ? (off_t)JOURNAL_FIRST_BLOCK * BLOCK_SIZE
+                        : log_offset(pos);
+        image_pwrite(fs, buf, len, off);
+        journal_sync(j, fdata);
+        vvsfs_mutex_lock(&j->lock);
+    }
+    free(buf);
+
+    j->committed_tid = tid;
+    j->committing    = 0;
+    pthread_cond_broadcast(&j->cond);
+    if (!j->ckpt_started && !j->stopping &&
+        pthread_create(&j->ckpt_thread, NULL, checkpoint_thread, j) == 0)
+        j->ckpt_started = 1;
+    pthread_cond_signal(&j->ckpt_cond);
+}
+
+/*
+ * Called by a writer inside a handle when the running transaction is
+ * full: closes it without waiting for the handles still open, ours
+ * included. A leader already waiting for them is told to go ahead; a
+ * commit past that stage is waited out first.
+ */
+static void
+split_locked(struct journal *j)
+{
+    unsigned int tid = j->running_tid;
+    while (j->running_tid == tid) {
+        if (j->committing && j->closing) {
+            j->split = 1;
+            pthread_cond_broadcast(&j->cond);
+            pthread_cond_wait(&j->cond, &j->lock);
+        } else if (j->committing) {
+            pthread_cond_wait(&j->cond, &j->lock);
+        } else {
+            j->split = 1;
+            commit_locked(j);
+        }
+    }
+}
+
+static void
+wait_commit_locked(struct journal *j, unsigned int tid)
+{
+    while (j->committed_tid < tid) {
+        if (j->committing) {
+            pthread_cond_wait(&j->cond, &j->lock);
+        } else if (tid == j->running_tid && j->nrunning == 0) {
+            return;
+        } else if (j->user_txns > 0) {
+            pthread_cond_wait(&j->cond, &j->lock);
+        } else {
+            commit_locked(j);
+        }
+    }
+}
+
+void
+journal_begin(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+    struct handle  *h = handle_find(j);
+    if (h) {
+        h->depth++;
+        return;
+    }
+    // Without a slot the writes go in place, as when a jbuf cannot be had.
+    if (!(h = handle_slot()))
+        return;
+    h->j      = j;
+    h->depth  = 1;
+    h->logged = 0;
+    h->user   = 0;
+    h->blocks = 0;
+
+    vvsfs_mutex_lock(&j->lock);
+    while (j->closing || j->nrunning >= JOURNAL_MAX_TXN / 2) {
+        if (j->closing)
+            pthread_cond_wait(&j->cond, &j->lock);
+        else
+            wait_commit_locked(j, j->running_tid);
+    }
+    j->handles++;
+    h->tid = j->running_tid;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Returns -1 if the outermost handle's blocks were split over more than
+ * one transaction, so they are not atomic, 0 otherwise.
+ */
+int
+journal_end(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+    struct handle  *h = handle_find(j);
+    if (!h || --h->depth > 0)
+        return 0;
+
+    vvsfs_mutex_lock(&j->lock);
+    if (--j->handles == 0)
+        pthread_cond_broadcast(&j->cond);
+    if (h->logged && (j->durability == VVSFS_DURABILITY_OPERATION ||
+                      j->nrunning >= JOURNAL_MAX_TXN / 2))
+        wait_commit_locked(j, h->last);
+    int res = h->logged && h->last != h->tid ? -1 : 0;
+    pthread_mutex_unlock(&j->lock);
+    return res;
+}
+
+/*
+ * Public grouping of several operations into one transaction. Everything
+ * the caller does between the two calls joins a single handle, so each
+ * block it touches is logged and checkpointed once, and the whole group
+ * becomes durable with one commit. Calls may nest.
+ *
+ * The group is atomic only if it logs at most VVSFS_TXN_MAX_BLOCKS
+ * blocks. A bigger one is still committed, split over several
+ * transactions if it fills one, and vvsfs_txn_commit() returns
+ * VVSFS_TXN_NOT_ATOMIC for it; -1 means there was no group to commit.
+ * While it is open, other threads keep working, but a writer that
+ * waits for its own commit (VVSFS_DURABILITY_OPERATION) waits for this
+ * one too.
+ */
+void
+vvsfs_txn_begin(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+    int outer = handle_depth(j) == 0;
+    journal_begin(fs);
+    if (outer) {
+        handle_find(j)->user = 1;
+        vvsfs_mutex_lock(&j->lock);
+        j->user_txns++;
+        pthread_mutex_unlock(&j->lock);
+    }
+}
+
+int
+vvsfs_txn_commit(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+    struct handle  *h = handle_find(j);
+    if (!h)
+        return -1;
+    int over = 0;
+    if (h->depth == 1 && h->user) {
+        over = h->blocks > VVSFS_TXN_MAX_BLOCKS;
+        vvsfs_mutex_lock(&j->lock);
+        if (--j->user_txns == 0)
+            pthread_cond_broadcast(&j->cond);
+        pthread_mutex_unlock(&j->lock);
+    }
+    return journal_end(fs) < 0 || over ? VVSFS_TXN_NOT_ATOMIC : 0;
+}
+
+static void *
+periodic_thread(void *arg)
+{
+    struct journal *j = arg;
+    vvsfs_mutex_lock(&j->lock);
+    while (!j->stopping) {
+        if (j->durability != VVSFS_DURABILITY_PERIODIC) {
+            pthread_cond_wait(&j->period_cond, &j->lock);
+            continue;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec  += j->period_ms / 1000;
+        ts.tv_nsec += (long)(j->period_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        if (pthread_cond_timedwait(&j->period_cond, &j->lock,
+                                   &ts) == 0)
+            continue;
+        pthread_mutex_unlock(&j->lock);
+        vvsfs_sync(j->fs);
+        vvsfs_mutex_lock(&j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+void
+vvsfs_set_durability(struct vvsfs *fs, int mode, unsigned int period_ms)
+{
+    struct journal *j = fs->journal;
+
+    vvsfs_mutex_lock(&j->lock);
+    __atomic_store_n(&j->durability, mode, __ATOMIC_RELAXED);
+    j->period_ms  = period_ms ? period_ms : 1;
+    pthread_cond_broadcast(&j->period_cond);
+    if (mode == VVSFS_DURABILITY_PERIODIC && !j->period_started &&
+        !j->stopping &&
+        pthread_create(&j->period_thread, NULL, periodic_thread, j) == 0)
+        j->period_started = 1;
+    pthread_mutex_unlock(&j->lock);
+
+    if (mode == VVSFS_DURABILITY_OPERATION)
+        vvsfs_sync(fs);
+}
+
+/*
+ * Commits everything written so far and waits for it to reach stable
+ * storage, sharing the commit and the fdatasync() with any concurrent
+ * callers. In VVSFS_DURABILITY_NONE this is the only flush that happens.
+ */
+int
+vvsfs_sync(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+    if (handle_depth(j) > 0)
+        return -1;
+
+    vvsfs_mutex_lock(&j->lock);
+    wait_commit_locked(j, j->running_tid);
+    while (j->committing)
+        pthread_cond_wait(&j->cond, &j->lock);
+    pthread_mutex_unlock(&j->lock);
+    return image_sync(fs, 1);
+}
+
+// Blocks the calling thread's handle on fs has added to the running
+// transaction since its outermost journal_begin(), or 0 without one.
+int
+journal_blocks(struct vvsfs *fs)
+{
+    struct handle *h = handle_find(fs->journal);
+    return h ? h->blocks : 0;
+}
+
+/*
+ * Called after file data is written to a tiered image's data file. The
+ * metadata that points at it is logged no earlier than the running
+ * transaction, so that commit syncs the data file first.
+ */
+void
+journal_data(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+
+    vvsfs_mutex_lock(&j->lock);
+    j->data_tid = j->running_tid;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Inside a handle the block is captured by the running transaction and
+ * 1 is returned. Outside one, an existing jbuf is kept coherent with the
+ * caller's direct write and 0 is returned.
+ */
+int
+journal_write(struct vvsfs *fs, int block_num, const unsigned char *block)
+{
+    struct journal *j = fs->journal;
+    struct handle  *h = handle_find(j);
+    int depth = h ? h->depth : 0;
+    if (depth == 0 &&
+        __atomic_load_n(&j->nbufs, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    vvsfs_mutex_lock(&j->lock);
+    if (depth) {
+        // A block new to a full transaction goes to the next one.
+        struct jbuf *f;
+        while (j->nrunning >= JOURNAL_MAX_TXN &&
+               (!(f = jbuf_find(j, block_num)) || f->tid != j->running_tid))
+            split_locked(j);
+    }
+    struct jbuf *b = depth ? jbuf_get(j, block_num)
+                           : jbuf_find(j, block_num);
+    if (!b) {
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+    if (!depth) {
+        // The caller's direct write supersedes any frozen version.
+        memcpy(b->data, block, BLOCK_SIZE);
+        free(b->frozen);
+        b->frozen = NULL;
+        pthread_mutex_unlock(&j->lock);
+        return 0;
+    }
+
+    if (b->tid && b->tid != j->running_tid) {
+        // Logged by a closed transaction and not yet checkpointed.
+        if (!b->frozen)
+            b->frozen = malloc(BLOCK_SIZE);
+        if (!b->frozen) {
+            memcpy(b->data, block, BLOCK_SIZE);
+            pthread_mutex_unlock(&j->lock);
+            return 0;
+        }
+        memcpy(b->frozen, b->data, BLOCK_SIZE);
+        b->frozen_tid = b->tid;
+    }
+    memcpy(b->data, block, BLOCK_SIZE);
+
+    if (b->tid != j->running_tid) {
+        if (j->nrunning == j->running_cap) {
+            int cap = j->running_cap ? j->running_cap * 2 : 64;
+            struct jbuf **r = realloc(j->running, cap * sizeof *r);
+            if (!r) {
+                pthread_mutex_unlock(&j->lock);
+                return 0;
+            }
+            j->running     = r;
+            j->running_cap = cap;
+        }
+        j->running[j->nrunning++] = b;
+        b->tid = j->running_tid;
+        h->blocks++;
+    }
+    if (!h->logged)
+        h->tid = j->running_tid;
+    h->last   = j->running_tid;
+    h->logged = 1;
+    pthread_mutex_unlock(&j->lock);
+    return 1;
+}
+
+int
+journal_read(struct vvsfs *fs, int block_num, unsigned char *block)
+{
+    struct journal *j = fs->journal;
+
+    if (__atomic_load_n(&j->nbufs, __ATOMIC_ACQUIRE) == 0)
+        return 0;
+
+    vvsfs_mutex_lock(&j->lock);
+    struct jbuf *b = jbuf_find(j, block_num);
+    if (b)
+        memcpy(block, b->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&j->lock);
+    return b != NULL;
+}
+
+void
+journal_flush(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+
+    vvsfs_mutex_lock(&j->lock);
+    while (j->nrunning > 0 || j->committing)
+        wait_commit_locked(j, j->running_tid);
+    while (checkpoint_pending(j) || j->checkpointing)
+        checkpoint_locked(j, 0);
+    pthread_mutex_unlock(&j->lock);
+}
+
+void
+journal_reset(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+
+    vvsfs_mutex_lock(&j->lock);
+    for (int i = 0; i < JOURNAL_HASH_SIZE; i++)
+        while (j->hash[i])
+            jbuf_remove(j, j->hash[i]);
+    j->nrunning      = 0;
+    j->committed_tid = j->running_tid - 1;
+    j->head          = 0;
+    j->header_valid  = 0;
+    pthread_mutex_unlock(&j->lock);
+}
+
+/*
+ * Replays every complete transaction in the log, in sequence order,
+ * starting from the header's start_seq. Returns the number replayed.
+ */
+int
+journal_recover(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+    unsigned char hdr[BLOCK_SIZE];
+    off_t hdr_off = (off_t)JOURNAL_FIRST_BLOCK * BLOCK_SIZE;
+    if (image_pread(fs, hdr, BLOCK_SIZE, hdr_off) != BLOCK_SIZE ||
+        read_u32(hdr) != JOURNAL_HEADER_MAGIC)
+        return 0;
+
+    unsigned int   seq   = read_u32(hdr + 4);
+    int            pos   = 0;
+    int            done  = 0;
+    unsigned char *buf   = malloc((size_t)JOURNAL_LOG_BLOCKS * BLOCK_SIZE);
+    if (!buf)
+        return -1;
+
+    for (;;) {
+        unsigned char *desc = buf;
+        if (pos + 2 > JOURNAL_LOG_BLOCKS ||
+            image_pread(fs, desc, BLOCK_SIZE, log_offset(pos))
+                != BLOCK_SIZE ||
+            read_u32(desc) != JOURNAL_DESC_MAGIC ||
+            read_u32(desc + 4) != seq)
+            break;
+        int count = read_u32(desc + 8);
+        if (count < 0 || pos + count + 2 > JOURNAL_LOG_BLOCKS)
+            break;
+        size_t len = (size_t)(count + 1) * BLOCK_SIZE;
+        if (image_pread(fs, buf + BLOCK_SIZE, len, log_offset(pos + 1))
+            != (ssize_t)len)
+            break;
+        unsigned char *cmt = buf + len;
+        if (read_u32(cmt) != JOURNAL_COMMIT_MAGIC ||
+            read_u32(cmt + 4) != seq ||
+            read_u32(cmt + 12) != log_hash(desc, len))
+            break;
+
+        for (int i = 0; i < count; i++)
+            image_pwrite(fs, buf + (size_t)(i + 1) * BLOCK_SIZE, BLOCK_SIZE,
+                         (off_t)read_u32(desc + 12 + i * 4) * BLOCK_SIZE);
+        pos += count + 2;
+        seq++;
+        done++;
+    }
+    free(buf);
+
+    image_sync(fs, 1);
+    vvsfs_mutex_lock(&j->lock);
+    if (j->running_tid < seq)
+        j->running_tid = seq;
+    j->committed_tid = j->running_tid - 1;
+    write_header(hdr, j->running_tid);
+    image_pwrite(fs, hdr, BLOCK_SIZE, hdr_off);
+    image_sync(fs, 0);
+    j->head         = 0;
+    j->header_valid = 1;
+    pthread_mutex_unlock(&j->lock);
+    return done;
+}
+
+int
+journal_init(struct vvsfs *fs)
+{
+    struct journal *j = calloc(1, sizeof *j);
+    if (!j)
+        return -1;
+    j->fs          = fs;
+    j->running_tid = 1;
+    j->durability  = VVSFS_DURABILITY_OPERATION;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->cond, NULL);
+    pthread_cond_init(&j->ckpt_cond, NULL);
+    pthread_cond_init(&j->period_cond, NULL);
+    fs->journal = j;
+    return 0;
+}
+
+// Stops and joins this image's checkpoint and periodic threads.
+void
+journal_stop(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+
+    vvsfs_mutex_lock(&j->lock);
+    j->stopping = 1;
+    pthread_cond_broadcast(&j->ckpt_cond);
+    pthread_cond_broadcast(&j->period_cond);
+    pthread_mutex_unlock(&j->lock);
+    if (j->ckpt_started)
+        pthread_join(j->ckpt_thread, NULL);
+    if (j->period_started)
+        pthread_join(j->period_thread, NULL);
+    j->ckpt_started = j->period_started = 0;
+}
+
+void
+journal_destroy(struct vvsfs *fs)
+{
+    struct journal *j = fs->journal;
+    if (!j)
+        return;
+    for (int i = 0; i < JOURNAL_HASH_SIZE; i++)
+        while (j->hash[i])
+            jbuf_remove(j, j->hash[i]);
+    free(j->running);
+    pthread_cond_destroy(&j->period_cond);
+    pthread_cond_destroy(&j->ckpt_cond);
+    pthread_cond_destroy(&j->cond);
+    pthread_mutex_destroy(&j->lock);
+    free(j);
+    fs->journal = NULL;
+}
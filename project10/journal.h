@@ -0,0 +1,54 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "image.h"
+#include "block.h"
+#include "inode.h"
+
+#define JOURNAL_LOG_BLOCKS   (JOURNAL_BLOCK_COUNT - 1)
+#define JOURNAL_MAX_TXN      (JOURNAL_LOG_BLOCKS - 2)
+#define JOURNAL_HASH_SIZE    1024
+
+// Blocks one vvsfs_txn may log and still commit atomically; the rest of
+// the log is left to the handles that join it meanwhile.
+#define VVSFS_TXN_MAX_BLOCKS (JOURNAL_MAX_TXN / 4)
+
+// vvsfs_txn_commit() result for a group that is committed, but without
+// the guarantee that it is atomic.
+#define VVSFS_TXN_NOT_ATOMIC 1
+
+// Handle slots a thread starts with; past that its table grows.
+#define JOURNAL_MAX_NESTED   16
+
+#define JOURNAL_HEADER_MAGIC 0x56564A48
+#define JOURNAL_DESC_MAGIC   0x56564A44
+#define JOURNAL_COMMIT_MAGIC 0x56564A43
+
+#define VVSFS_DURABILITY_NONE      0
+#define VVSFS_DURABILITY_PERIODIC  1
+#define VVSFS_DURABILITY_EXPLICIT  2
+#define VVSFS_DURABILITY_OPERATION 3
+
+int  journal_init(struct vvsfs *fs);
+void journal_stop(struct vvsfs *fs);
+void journal_destroy(struct vvsfs *fs);
+
+void journal_begin(struct vvsfs *fs);
+int  journal_end(struct vvsfs *fs);
+
+int  journal_write(struct vvsfs *fs, int block_num, const unsigned char *block);
+int  journal_read(struct vvsfs *fs, int block_num, unsigned char *block);
+void journal_data(struct vvsfs *fs);
+int  journal_blocks(struct vvsfs *fs);
+
+void vvsfs_txn_begin(struct vvsfs *fs);
+int  vvsfs_txn_commit(struct vvsfs *fs);
+
+void vvsfs_set_durability(struct vvsfs *fs, int mode, unsigned int period_ms);
+int  vvsfs_sync(struct vvsfs *fs);
+
+void journal_flush(struct vvsfs *fs);
+void journal_reset(struct vvsfs *fs);
+int  journal_recover(struct vvsfs *fs);
+
+#endif
@@ -2,7 +2,10 @@
 #include "dir.h"
 
 int main(void) {
-    mkfs("img");   
-    ls();         
+    struct vvsfs *fs = mkfs("img");
+    if (!fs)
+        return 1;
+    ls(fs);
+    vvsfs_close(fs);
     return 0;
 }
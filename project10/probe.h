@@ -0,0 +1,28 @@
+#ifndef PROBE_H
+#define PROBE_H
+
+/*
+ * USDT probes in the "vvsfs" provider, e.g. for bpftrace:
+ *
+ *     bpftrace -e 'usdt:./testfs:vvsfs:bread__entry { @[arg0] = count(); }'
+ *
+ * An unattached probe is a single nop. Without <sys/sdt.h> (from
+ * systemtap-sdt-dev) or with -DVVSFS_NO_PROBES they compile to nothing.
+ */
+
+#if !defined(VVSFS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define VVSFS_PROBE0(name)       DTRACE_PROBE(vvsfs, name)
+#define VVSFS_PROBE1(name, a)    DTRACE_PROBE1(vvsfs, name, a)
+#define VVSFS_PROBE2(name, a, b) DTRACE_PROBE2(vvsfs, name, a, b)
+#endif
+#endif
+
+#ifndef VVSFS_PROBE1
+#define VVSFS_PROBE0(name)       do { } while (0)
+#define VVSFS_PROBE1(name, a)    do { (void)(a); } while (0)
+#define VVSFS_PROBE2(name, a, b) do { (void)(a); (void)(b); } while (0)
+#endif
+
+#endif
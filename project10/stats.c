@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "stats.h"
+
+static const char *stat_names[VVSFS_STAT_OPS] = {
+    "bread", "bwrite", "inode_read", "inode_write", "alloc", "ialloc",
+    "lookup", "mkdir", "lock_wait",
+};
+
+/*
+ * Every thread that records gets a slots struct on a global list. Only
+ * its owner writes the counters, with relaxed atomics so readers can
+ * sum them without a lock on the hot path. When a thread exits, its
+ * counts are folded into retired and the slots are freed.
+ */
+struct stats_slots {
+    struct vvsfs_stat   op[VVSFS_STAT_OPS];
+    struct stats_slots *next, *prev;
+};
+
+static pthread_mutex_t     stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct stats_slots *stats_threads;
+static struct vvsfs_stat   retired[VVSFS_STAT_OPS];
+
+#define LOAD(p)     __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+
+static void
+stat_add(struct vvsfs_stat *dst, const struct vvsfs_stat *src)
+{
+    dst->count    += LOAD(&src->count);
+    dst->timed    += LOAD(&src->timed);
+    dst->total_ns += LOAD(&src->total_ns);
+    unsigned long max = LOAD(&src->max_ns);
+    if (max > dst->max_ns)
+        dst->max_ns = max;
+    for (int b = 0; b < VVSFS_STAT_BUCKETS; b++)
+        dst->buckets[b] += LOAD(&src->buckets[b]);
+}
+
+static void
+stat_clear(struct vvsfs_stat *s)
+{
+    STORE(&s->count, 0);
+    STORE(&s->timed, 0);
+    STORE(&s->total_ns, 0);
+    STORE(&s->max_ns, 0);
+    for (int b = 0; b < VVSFS_STAT_BUCKETS; b++)
+        STORE(&s->buckets[b], 0);
+}
+
+#ifndef VVSFS_NO_STATS
+
+unsigned int          vvsfs_stats_mask = VVSFS_STAT_SAMPLE - 1;
+__thread unsigned int vvsfs_stats_rng  = 2463534242u;
+
+static pthread_key_t   stats_key;
+static pthread_once_t  stats_once = PTHREAD_ONCE_INIT;
+static __thread struct stats_slots *my_slots;
+
+static void
+stats_thread_exit(void *arg)
+{
+    struct stats_slots *s = arg;
+
+    pthread_mutex_lock(&stats_lock);
+    for (int op = 0; op < VVSFS_STAT_OPS; op++)
+        stat_add(&retired[op], &s->op[op]);
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        stats_threads = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    pthread_mutex_unlock(&stats_lock);
+    free(s);
+}
+
+static void
+stats_key_init(void)
+{
+    pthread_key_create(&stats_key, stats_thread_exit);
+}
+
+static struct stats_slots *
+stats_slots_get(void)
+{
+    if (my_slots)
+        return my_slots;
+
+    struct stats_slots *s = calloc(1, sizeof *s);
+    if (!s)
+        return NULL;
+    pthread_once(&stats_once, stats_key_init);
+    pthread_setspecific(stats_key, s);
+
+    pthread_mutex_lock(&stats_lock);
+    s->next = stats_threads;
+    if (stats_threads)
+        stats_threads->prev = s;
+    stats_threads = s;
+    pthread_mutex_unlock(&stats_lock);
+    my_slots = s;
+    return s;
+}
+
+unsigned long
+vvsfs_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+void
+vvsfs_stats_record(int op, unsigned long ns)
+{
+    struct stats_slots *slots = stats_slots_get();
+    if (!slots)
+        return;
+    struct vvsfs_stat *s = &slots->op[op];
+
+    int b = 63 - __builtin_clzl(ns | 1);
+    if (b >= VVSFS_STAT_BUCKETS)
+        b = VVSFS_STAT_BUCKETS - 1;
+    STORE(&s->count, LOAD(&s->count) + 1);
+    STORE(&s->timed, LOAD(&s->timed) + 1);
+    STORE(&s->total_ns, LOAD(&s->total_ns) + ns);
+    STORE(&s->buckets[b], LOAD(&s->buckets[b]) + 1);
+    if (ns > LOAD(&s->max_ns))
+        STORE(&s->max_ns, ns);
+}
+
+void
+vvsfs_stats_count(int op)
+{
+    struct stats_slots *slots = stats_slots_get();
+    if (!slots)
+        return;
+    STORE(&slots->op[op].count, LOAD(&slots->op[op].count) + 1);
+}
+
+void
+vvsfs_stats_sample(unsigned int every)
+{
+    unsigned int mask = ~0u;    // xorshift never yields 0: nothing timed
+    if (every) {
+        mask = 1;
+        while (mask <= every / 2)
+            mask <<= 1;
+        mask--;
+    }
+    __atomic_store_n(&vvsfs_stats_mask, mask, __ATOMIC_RELAXED);
+}
+
+#else
+
+void
+vvsfs_stats_sample(unsigned int every)
+{
+    (void)every;
+}
+
+#endif
+
+void
+vvsfs_stats_read(struct vvsfs_stat stats[VVSFS_STAT_OPS])
+{
+    memset(stats, 0, VVSFS_STAT_OPS * sizeof *stats);
+
+    pthread_mutex_lock(&stats_lock);
+    for (int op = 0; op < VVSFS_STAT_OPS; op++)
+        stat_add(&stats[op], &retired[op]);
+    for (struct stats_slots *s = stats_threads; s; s = s->next)
+        for (int op = 0; op < VVSFS_STAT_OPS; op++)
+            stat_add(&stats[op], &s->op[op]);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// Counts recorded while this runs may survive it.
+void
+vvsfs_stats_reset(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    for (int op = 0; op < VVSFS_STAT_OPS; op++)
+        stat_clear(&retired[op]);
+    for (struct stats_slots *s = stats_threads; s; s = s->next)
+        for (int op = 0; op < VVSFS_STAT_OPS; op++)
+            stat_clear(&s->op[op]);
+    pthread_mutex_unlock(&stats_lock);
+}
+
+const char *
+vvsfs_stat_name(int op)
+{
+    return (op >= 0 && op < VVSFS_STAT_OPS) ? stat_names[op] : NULL;
+}
+
+/*
+ * Upper bound of the bucket holding the p-th percentile (0 < p <= 1),
+ * capped at the largest latency seen.
+ */
+unsigned long
+vvsfs_stat_percentile(const struct vvsfs_stat *s, double p)
+{
+    if (s->timed == 0)
+        return 0;
+    unsigned long want = (unsigned long)(p * s->timed);
+    if (want == 0)
+        want = 1;
+    unsigned long seen = 0;
+    for (int b = 0; b < VVSFS_STAT_BUCKETS; b++) {
+        seen += s->buckets[b];
+        if (seen >= want) {
+            unsigned long top = (2ul << b) - 1;
+            return top < s->max_ns ? top : s->max_ns;
+        }
+    }
+    return s->max_ns;
+}
+
+void
+vvsfs_stats_dump(FILE *out, int json)
+{
+    struct vvsfs_stat stats[VVSFS_STAT_OPS];
+    vvsfs_stats_read(stats);
+
+    if (!json)
+        fprintf(out, "%-12s %10s %10s %10s %10s %10s\n", "op", "count",
+                "mean_ns", "p50_ns", "p99_ns", "max_ns");
+    else
+        fprintf(out, "{");
+
+    for (int op = 0; op < VVSFS_STAT_OPS; op++) {
+        const struct vvsfs_stat *s = &stats[op];
+        unsigned long mean = s->timed ? s->total_ns / s->timed : 0;
+        unsigned long p50  = vvsfs_stat_percentile(s, 0.50);
+        unsigned long p99  = vvsfs_stat_percentile(s, 0.99);
+
+        if (!json) {
+            fprintf(out, "%-12s %10lu %10lu %10lu %10lu %10lu\n",
+                    stat_names[op], s->count, mean, p50, p99, s->max_ns);
+            continue;
+        }
+        fprintf(out, "%s\"%s\":{\"count\":%lu,\"timed\":%lu,"
+                "\"total_ns\":%lu,\"max_ns\":%lu,\"p50_ns\":%lu,"
+                "\"p99_ns\":%lu,\"buckets\":[",
+                op ? "," : "", stat_names[op], s->count, s->timed,
+                s->total_ns, s->max_ns, p50, p99);
+        int last = VVSFS_STAT_BUCKETS - 1;
+        while (last > 0 && s->buckets[last] == 0)
+            last--;
+        for (int b = 0; b <= last; b++)
+            fprintf(out, "%s%lu", b ? "," : "", s->buckets[b]);
+        fprintf(out, "]}");
+    }
+    if (json)
+        fprintf(out, "}\n");
+}
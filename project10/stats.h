@@ -0,0 +1,141 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/*
+ * Operation counters and latency histograms. Each thread records into
+ * its own slots; vvsfs_stats_read() merges them. Every operation is
+ * counted, but only a sample of them is timed (one in
+ * VVSFS_STAT_SAMPLE by default, see vvsfs_stats_sample()), since two
+ * clock reads cost more than a cached bread. Building with
+ * -DVVSFS_NO_STATS turns every recording site into nothing.
+ */
+
+#define VVSFS_STAT_BREAD       0
+#define VVSFS_STAT_BWRITE      1
+#define VVSFS_STAT_INODE_READ  2
+#define VVSFS_STAT_INODE_WRITE 3
+#define VVSFS_STAT_ALLOC       4
+#define VVSFS_STAT_IALLOC      5
+#define VVSFS_STAT_LOOKUP      6
+#define VVSFS_STAT_MKDIR       7
+#define VVSFS_STAT_LOCK_WAIT   8
+#define VVSFS_STAT_OPS         9
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) ns; the last is open.
+#define VVSFS_STAT_BUCKETS 32
+
+// Default timing rate: one operation in this many (a power of two).
+#define VVSFS_STAT_SAMPLE 64
+
+// total_ns, max_ns and the buckets cover the timed operations only.
+struct vvsfs_stat {
+    unsigned long count;
+    unsigned long timed;
+    unsigned long total_ns;
+    unsigned long max_ns;
+    unsigned long buckets[VVSFS_STAT_BUCKETS];
+};
+
+void vvsfs_stats_read(struct vvsfs_stat stats[VVSFS_STAT_OPS]);
+void vvsfs_stats_reset(void);
+void vvsfs_stats_dump(FILE *out, int json);
+
+// Time one operation in every (rounded down to a power of two); 1 times
+// them all and 0 keeps counters only.
+void vvsfs_stats_sample(unsigned int every);
+
+const char   *vvsfs_stat_name(int op);
+unsigned long vvsfs_stat_percentile(const struct vvsfs_stat *s, double p);
+
+#ifndef VVSFS_NO_STATS
+
+unsigned long vvsfs_stats_now(void);
+void          vvsfs_stats_record(int op, unsigned long ns);
+void          vvsfs_stats_count(int op);
+
+extern unsigned int             vvsfs_stats_mask;
+extern __thread unsigned int    vvsfs_stats_rng;
+
+/*
+ * Start time of a sampled operation, or 0 when it is only counted. The
+ * choice is a per-thread xorshift rather than a counter so that nested
+ * operations (a lookup's breads) cannot fall into step with it.
+ */
+static inline unsigned long
+vvsfs_stats_start(void)
+{
+    unsigned int x = vvsfs_stats_rng;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    vvsfs_stats_rng = x;
+    if (x & __atomic_load_n(&vvsfs_stats_mask, __ATOMIC_RELAXED))
+        return 0;
+    return vvsfs_stats_now();
+}
+
+#define STATS_START(t)   unsigned long t = vvsfs_stats_start()
+#define STATS_END(op, t) \
+    ((t) ? vvsfs_stats_record((op), vvsfs_stats_now() - (t)) \
+         : vvsfs_stats_count(op))
+
+// Only contended acquisitions are timed and counted.
+static inline void
+vvsfs_mutex_lock(pthread_mutex_t *m)
+{
+    if (pthread_mutex_trylock(m) == 0)
+        return;
+    unsigned long t = vvsfs_stats_now();
+    pthread_mutex_lock(m);
+    vvsfs_stats_record(VVSFS_STAT_LOCK_WAIT, vvsfs_stats_now() - t);
+}
+
+static inline void
+vvsfs_rwlock_rdlock(pthread_rwlock_t *l)
+{
+    if (pthread_rwlock_tryrdlock(l) == 0)
+        return;
+    unsigned long t = vvsfs_stats_now();
+    pthread_rwlock_rdlock(l);
+    vvsfs_stats_record(VVSFS_STAT_LOCK_WAIT, vvsfs_stats_now() - t);
+}
+
+static inline void
+vvsfs_rwlock_wrlock(pthread_rwlock_t *l)
+{
+    if (pthread_rwlock_trywrlock(l) == 0)
+        return;
+    unsigned long t = vvsfs_stats_now();
+    pthread_rwlock_wrlock(l);
+    vvsfs_stats_record(VVSFS_STAT_LOCK_WAIT, vvsfs_stats_now() - t);
+}
+
+#else
+
+#define STATS_START(t)   do { } while (0)
+#define STATS_END(op, t) do { } while (0)
+
+static inline void
+vvsfs_mutex_lock(pthread_mutex_t *m)
+{
+    pthread_mutex_lock(m);
+}
+
+static inline void
+vvsfs_rwlock_rdlock(pthread_rwlock_t *l)
+{
+    pthread_rwlock_rdlock(l);
+}
+
+static inline void
+vvsfs_rwlock_wrlock(pthread_rwlock_t *l)
+{
+    pthread_rwlock_wrlock(l);
+}
+
+#endif
+
+#endif
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include "block.h"
+#include "inode.h"
+#include "dir.h"
+#include "journal.h"
+#include "fsck.h"
+#include "stress.h"
+
+/*
+ * Multi-threaded stress run against the open image, which should be
+ * freshly made. STRESS_PARENTS directories /s0, /s1, ... are created
+ * first; then every thread runs cfg->ops operations drawn from the mix,
+ * all on names /sP/dN with N < STRESS_NAMES, so threads keep racing to
+ * create the same names and scanning directories others are adding to.
+ *
+ * Afterwards the tree is checked single-threaded: every directory's
+ * ".." names its parent, no directory holds a name twice, the number
+ * of directories matches the successful mkdirs, and fsck_image() finds
+ * the bitmaps consistent.
+ */
+struct stress {
+    struct vvsfs               *fs;
+    const struct stress_config *cfg;
+    FILE                       *out;
+    struct stress_result       *res;
+    pthread_mutex_t             lock;
+    int                         next_id;
+    int                         parents[STRESS_PARENTS];
+};
+
+struct stress_count {
+    unsigned long mkdirs, exists, lookups, scans, allocs, failed;
+};
+
+static void
+report(struct stress *s, const char *fmt, ...)
+{
+    s->res->problems++;
+    if (!s->out)
+        return;
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(s->out, "stress: ");
+    vfprintf(s->out, fmt, ap);
+    fputc('\n', s->out);
+    va_end(ap);
+}
+
+static void
+stress_op(struct stress *s, unsigned int *seed, struct stress_count *c)
+{
+    const struct stress_config *cfg = s->cfg;
+    struct vvsfs *fs = s->fs;
+    int  pick   = rand_r(seed) % 100;
+    int  parent = rand_r(seed) % STRESS_PARENTS;
+    char path[32];
+    sprintf(path, "/s%d/d%d", parent, rand_r(seed) % STRESS_NAMES);
+
+    if (pick < cfg->mkdir_pct) {
+        if (directory_make(fs, path) == 0)
+            c->mkdirs++;
+        else if (path_lookup(fs, path) >= 0)
+            c->exists++;
+        else
+            c->failed++;
+    } else if ((pick -= cfg->mkdir_pct) < cfg->scan_pct) {
+        struct directory *d = directory_open(fs, s->parents[parent]);
+        if (!d) {
+            c->failed++;
+            return;
+        }
+        struct directory_entry ent;
+        while (directory_get(d, &ent) == 0)
+            if (ent.inode_num >= INODE_COUNT || ent.name[0] == '\0')
+                c->failed++;
+        directory_close(d);
+        c->scans++;
+    } else if ((pick -= cfg->scan_pct) < cfg->alloc_pct) {
+        int blk = alloc(fs);
+        if (blk < 0) {
+            c->failed++;
+            return;
+        }
+        bfree(fs, blk);
+        c->allocs++;
+    } else {
+        int ino = path_lookup(fs, path);
+        struct inode *in = ino < 0 ? NULL : iget(fs, ino);
+        if (ino >= 0 && (!in || !(in->flags & INODE_FLAG_DIR)))
+            c->failed++;
+        iput(in);
+        c->lookups++;
+    }
+}
+
+static void *
+stress_worker(void *arg)
+{
+    struct stress *s = arg;
+    struct stress_count c = { 0 };
+
+    pthread_mutex_lock(&s->lock);
+    unsigned int seed = s->cfg->seed + 7919 * s->next_id++;
+    pthread_mutex_unlock(&s->lock);
+
+    for (int i = 0; i < s->cfg->ops; i++)
+        stress_op(s, &seed, &c);
+
+    pthread_mutex_lock(&s->lock);
+    s->res->mkdirs  += c.mkdirs;
+    s->res->exists  += c.exists;
+    s->res->lookups += c.lookups;
+    s->res->scans   += c.scans;
+    s->res->allocs  += c.allocs;
+    s->res->failed  += c.failed;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static int
+cmp_name(const void *a, const void *b)
+{
+    return strcmp(((const struct directory_entry *)a)->name,
+                  ((const struct directory_entry *)b)->name);
+}
+
+// Checks the directory ino and everything under it; returns the number
+// of directories seen.
+static unsigned int
+check_dir(struct stress *s, unsigned int ino, unsigned int parent)
+{
+    struct directory *d = directory_open(s->fs, ino);
+    if (!d) {
+        report(s, "directory %u: cannot open", ino);
+        return 0;
+    }
+    unsigned int cap = d->inode->size / DIRECTORY_ENTRY_SIZE + 1;
+    struct directory_entry *ents = calloc(cap, sizeof *ents);
+    unsigned int n = 0;
+    while (ents && n < cap && directory_get(d, &ents[n]) == 0)
+        n++;
+    directory_close(d);
+    if (!ents)
+        return 0;
+
+    if (n < 2 || ents[1].inode_num != parent)
+        report(s, "directory %u: \"..\" is %u, not %u", ino,
+               n < 2 ? 0 : ents[1].inode_num, parent);
+
+    unsigned int dirs = 1;
+    for (unsigned int i = 2; i < n; i++) {
+        struct inode *in = iget(s->fs, ents[i].inode_num);
+        if (in && (in->flags & INODE_FLAG_DIR))
+            dirs += check_dir(s, ents[i].inode_num, ino);
+        iput(in);
+    }
+
+    qsort(ents, n, sizeof *ents, cmp_name);
+    for (unsigned int i = 1; i < n; i++)
+        if (strcmp(ents[i].name, ents[i - 1].name) == 0)
+            report(s, "directory %u: name \"%s\" appears twice", ino,
+                   ents[i].name);
+    free(ents);
+    return dirs;
+}
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Runs the mix and checks the result. Returns the number of problems
+ * (invariant violations plus failed operations), or -1 if the run
+ * could not be set up.
+ */
+int
+stress_run(struct vvsfs *fs, const struct stress_config *cfg, FILE *out,
+           struct stress_result *res)
+{
+    struct stress s = { .fs = fs, .cfg = cfg, .out = out, .res = res };
+    int threads = cfg->threads;
+    if (threads < 1)
+        threads = 1;
+    if (threads > STRESS_MAX_THREADS)
+        threads = STRESS_MAX_THREADS;
+    memset(res, 0, sizeof *res);
+
+    for (int i = 0; i < STRESS_PARENTS; i++) {
+        char path[16];
+        sprintf(path, "/s%d", i);
+        if (directory_make(fs, path) < 0 ||
+            (s.parents[i] = path_lookup(fs, path)) < 0)
+            return -1;
+    }
+    pthread_mutex_init(&s.lock, NULL);
+
+    pthread_t tids[STRESS_MAX_THREADS];
+    int started = 0;
+    double start = now_sec();
+    for (; started < threads - 1; started++)
+        if (pthread_create(&tids[started], NULL, stress_worker, &s) != 0)
+            break;
+    stress_worker(&s);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+    res->seconds = now_sec() - start;
+    pthread_mutex_destroy(&s.lock);
+
+    if (res->failed)
+        report(&s, "%lu operations failed", res->failed);
+
+    unsigned int dirs = check_dir(&s, 0, 0);
+    if (dirs != 1 + STRESS_PARENTS + res->mkdirs)
+        report(&s, "%u directories, but %lu were made", dirs,
+               1 + STRESS_PARENTS + res->mkdirs);
+
+    struct fsck_result fr;
+    journal_flush(fs);
+    if (fsck_image(fs, threads, out, &fr) > 0)
+        report(&s, "fsck found %u errors, %u leaked inodes, %u leaked blocks",
+               fr.errors, fr.leaked_inodes, fr.leaked_blocks);
+    return res->problems;
+}
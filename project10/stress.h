@@ -0,0 +1,40 @@
+#ifndef STRESS_H
+#define STRESS_H
+
+#include <stdio.h>
+
+#define STRESS_MAX_THREADS 64
+#define STRESS_PARENTS     8
+#define STRESS_NAMES       64
+
+/*
+ * Operation mix, in percent: directory_make, path_lookup, a full scan
+ * of one directory, and an alloc()/bfree() pair. Whatever is left of
+ * 100 goes to lookups.
+ */
+struct stress_config {
+    int          threads;
+    int          ops;           // per thread
+    int          mkdir_pct;
+    int          scan_pct;
+    int          alloc_pct;
+    unsigned int seed;
+};
+
+struct stress_result {
+    unsigned long mkdirs;       // succeeded
+    unsigned long exists;       // mkdir of a name already taken
+    unsigned long lookups;
+    unsigned long scans;
+    unsigned long allocs;
+    unsigned long failed;       // operations that should have worked
+    double        seconds;
+    unsigned int  problems;     // failures and broken invariants
+};
+
+struct vvsfs;
+
+int stress_run(struct vvsfs *fs, const struct stress_config *cfg, FILE *out,
+               struct stress_result *res);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "image.h"
+#include "block.h"
+#include "pack.h"
+#include "journal.h"
+#include "super.h"
+
+/*
+ * Block 0 holds the superblock: magic, version, block and inode counts,
+ * the first data block, the number of inode-table groups and one byte
+ * per group that is nonzero once the group has been initialized.
+ *
+ * mkfs() sizes the image with ftruncate(), so an uninitialized group
+ * is known to read as zeros and nobody has to touch it: read_inode()
+ * returns an empty inode without I/O and fsck skips it. ialloc() marks
+ * a group initialized the first time it hands out an inode from it.
+ * Images without a superblock treat every group as initialized.
+ *
+ * After the group bytes come the number of backing files, the stripe
+ * unit and whether file data lives in a separate data file, as the
+ * image was formatted, so that opening it another way fails instead
+ * of reading blocks from the wrong places.
+ */
+struct super_state {
+    pthread_mutex_t lock;
+    unsigned char   ready[INODE_GROUP_COUNT];
+};
+
+int
+super_init(struct vvsfs *fs)
+{
+    struct super_state *sb = calloc(1, sizeof *sb);
+    if (!sb)
+        return -1;
+    pthread_mutex_init(&sb->lock, NULL);
+    fs->super = sb;
+    return 0;
+}
+
+void
+super_destroy(struct vvsfs *fs)
+{
+    if (!fs->super)
+        return;
+    pthread_mutex_destroy(&fs->super->lock);
+    free(fs->super);
+    fs->super = NULL;
+}
+
+static void
+super_write(struct vvsfs *fs)
+{
+    unsigned char block[BLOCK_SIZE];
+
+    memset(block, 0, BLOCK_SIZE);
+    write_u32(block + 0, SUPER_MAGIC);
+    write_u32(block + 4, SUPER_VERSION);
+    write_u32(block + 8, IMAGE_BLOCK_COUNT);
+    write_u32(block + 12, INODE_COUNT);
+    write_u32(block + 16, DATA_FIRST_BLOCK);
+    write_u32(block + 20, INODE_GROUP_COUNT);
+    memcpy(block + SUPER_GROUP_OFFSET, fs->super->ready, INODE_GROUP_COUNT);
+    write_u32(block + SUPER_LAYOUT_OFFSET, fs->nfiles);
+    write_u32(block + SUPER_LAYOUT_OFFSET + 4, fs->stripe_blocks);
+    write_u32(block + SUPER_LAYOUT_OFFSET + 8, fs->data_file >= 0);
+    bwrite(fs, SUPERBLOCK_BLOCK, block);
+}
+
+void
+super_format(struct vvsfs *fs)
+{
+    journal_begin(fs);
+    pthread_mutex_lock(&fs->super->lock);
+    memset(fs->super->ready, 0, INODE_GROUP_COUNT);
+    super_write(fs);
+    pthread_mutex_unlock(&fs->super->lock);
+    journal_end(fs);
+}
+
+/*
+ * Checks the stripe layout recorded at format time against the one the
+ * image was opened with. Block 0 always sits at the start of the first
+ * file, so it can be read before the journal is replayed. Images
+ * without a recorded layout pass.
+ */
+int
+super_check(struct vvsfs *fs)
+{
+    unsigned char block[BLOCK_SIZE];
+
+    if (image_pread(fs, block, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+        read_u32(block) != SUPER_MAGIC)
+        return 0;
+    unsigned int nfiles = read_u32(block + SUPER_LAYOUT_OFFSET);
+    unsigned int stripe = read_u32(block + SUPER_LAYOUT_OFFSET + 4);
+    unsigned int tiered = read_u32(block + SUPER_LAYOUT_OFFSET + 8);
+    if (nfiles == 0)
+        return 0;
+    if (nfiles != (unsigned int)fs->nfiles ||
+        (nfiles > 1 && stripe != fs->stripe_blocks) ||
+        tiered != (fs->data_file >= 0))
+        return -1;
+    return 0;
+}
+
+void
+super_load(struct vvsfs *fs)
+{
+    unsigned char block[BLOCK_SIZE];
+
+    pthread_mutex_lock(&fs->super->lock);
+    if (bread(fs, SUPERBLOCK_BLOCK, block) &&
+        read_u32(block) == SUPER_MAGIC &&
+        read_u32(block + 20) == INODE_GROUP_COUNT)
+        memcpy(fs->super->ready, block + SUPER_GROUP_OFFSET, INODE_GROUP_COUNT);
+    else
+        memset(fs->super->ready, 1, INODE_GROUP_COUNT);
+    pthread_mutex_unlock(&fs->super->lock);
+}
+
+int
+super_group_ready(struct vvsfs *fs, unsigned int group)
+{
+    pthread_mutex_lock(&fs->super->lock);
+    int ready = group >= INODE_GROUP_COUNT || fs->super->ready[group];
+    pthread_mutex_unlock(&fs->super->lock);
+    return ready;
+}
+
+void
+super_group_init(struct vvsfs *fs, unsigned int group)
+{
+    if (super_group_ready(fs, group))
+        return;
+    journal_begin(fs);
+    pthread_mutex_lock(&fs->super->lock);
+    if (!fs->super->ready[group]) {
+        fs->super->ready[group] = 1;
+        super_write(fs);
+    }
+    pthread_mutex_unlock(&fs->super->lock);
+    journal_end(fs);
+}
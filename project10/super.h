@@ -0,0 +1,27 @@
+#ifndef SUPER_H
+#define SUPER_H
+
+#include "inode.h"
+
+#define SUPERBLOCK_BLOCK   0
+#define SUPER_MAGIC        0x56565342
+#define SUPER_VERSION      1
+
+#define IMAGE_BLOCK_COUNT  (BLOCK_SIZE * 8)
+#define INODE_GROUP_BLOCKS 32
+#define INODE_GROUP_COUNT  (INODE_BLOCK_COUNT / INODE_GROUP_BLOCKS)
+#define INODE_GROUP_INODES (INODE_GROUP_BLOCKS * INODES_PER_BLOCK)
+#define SUPER_GROUP_OFFSET 24
+#define SUPER_LAYOUT_OFFSET (SUPER_GROUP_OFFSET + INODE_GROUP_COUNT)
+
+struct vvsfs;
+
+int  super_init(struct vvsfs *fs);
+void super_destroy(struct vvsfs *fs);
+void super_format(struct vvsfs *fs);
+int  super_check(struct vvsfs *fs);
+void super_load(struct vvsfs *fs);
+int  super_group_ready(struct vvsfs *fs, unsigned int group);
+void super_group_init(struct vvsfs *fs, unsigned int group);
+
+#endif
@@ -1,11 +1,33 @@
 #include <string.h> 
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
 #include "ctest.h"
 #include "image.h"
 #include "block.h"
 #include "free.h"
 #include "inode.h"
 #include "dir.h"      
+#include "file.h"
+#include "journal.h"
+#include "pack.h"
+#include "compress.h"
+#include "dedup.h"
+#include "csum.h"
+#include "fsck.h"
+#include "super.h"
+#include "import.h"
+#include "export.h"
+#include "walk.h"
+#include "stats.h"
+#include "stress.h"
 
+// The image the running test works on.
+static struct vvsfs *fs;
 
 CTEST(test_free, find_and_set) {
     unsigned char m[BLOCK_SIZE] = {0};
@@ -15,16 +37,22 @@ CTEST(test_free, find_and_set) {
 }
 
 CTEST(inode_incore, find_and_free) {
-    incore_free_all();
-    struct inode *f = incore_find_free();
+    fs = vvsfs_open("img", 1);
+    CTEST_ASSERT(fs != NULL, "open image");
+    incore_free_all(fs);
+    struct inode *f = incore_find_free(fs);
     CTEST_ASSERT(f != NULL, "got a free slot");
-    f->ref_count = 1;
-    struct inode *g = incore_find_free();
+    // Reference counts live in the hot index now; iget() takes the slot.
+    CTEST_ASSERT(iget(fs, 3) == f && incore_find(fs, 3) == f, "iget takes it");
+    struct inode *g = incore_find_free(fs);
     CTEST_ASSERT(g != f, "next free is different");
+    incore_free_all(fs);
+    CTEST_ASSERT(incore_find(fs, 3) == NULL, "free_all drops it");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 CTEST(inode_readwrite, round_trip) {
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
+    CTEST_ASSERT((fs = vvsfs_open("img", 1)) != NULL, "open image");
     struct inode in = {
         .size        = 1234,
         .owner_id    = 42,
@@ -35,54 +63,98 @@ CTEST(inode_readwrite, round_trip) {
     };
     for (int i = 0; i < INODE_PTR_COUNT; i++)
         in.block_ptr[i] = i;
-    write_inode(&in);
+    write_inode(fs, &in);
 
-    incore_free_all();
-    struct inode *out = iget(5);
+    incore_free_all(fs);
+    struct inode *out = iget(fs, 5);
     CTEST_ASSERT(out != NULL, "iget succeeded");
     CTEST_ASSERT(out->size == 1234, "size matches");
     CTEST_ASSERT(out->owner_id == 42, "owner matches");
     CTEST_ASSERT(out->block_ptr[7] == 7, "block ptr ok");
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(inode_codec, big_endian_layout_and_block_decode) {
+    unsigned char rec[INODE_SIZE] = { 0 };
+    struct inode in = { .size = 0x01020304, .owner_id = 0x0506,
+                        .permissions = 7, .flags = INODE_FLAG_FILE,
+                        .link_count = 1 };
+    for (int i = 0; i < INODE_PTR_COUNT; i++)
+        in.block_ptr[i] = 0x1000 + i;
+    inode_pack(&in, rec);
+    CTEST_ASSERT(rec[0] == 1 && rec[3] == 4 && rec[4] == 5 && rec[5] == 6,
+                 "integers are big-endian");
+    CTEST_ASSERT(rec[9] == 0x10 && rec[10] == 0 && rec[39] == 0x10 &&
+                 rec[40] == 0x0f, "pointers at 9 + 2i");
+
+    unsigned char block[BLOCK_SIZE] = { 0 };
+    for (int i = 0; i < INODES_PER_BLOCK; i++) {
+        in.size = i;
+        in.flags = (i % 2) ? INODE_FLAG_DIR | INODE_FLAG_INLINE
+                           : INODE_FLAG_FILE;
+        memset(in.inline_data, i, INODE_INLINE_SIZE);
+        inode_pack(&in, block + i * INODE_SIZE);
+    }
+    struct inode ins[INODES_PER_BLOCK];
+    inode_unpack_block(ins, block, 128);
+    int ok = 1;
+    for (int i = 0; i < INODES_PER_BLOCK; i++) {
+        struct inode one;
+        inode_unpack(&one, block + i * INODE_SIZE);
+        ok &= ins[i].inode_num == 128u + i && ins[i].size == (unsigned)i &&
+              ins[i].block_ptr[15] == one.block_ptr[15] &&
+              ins[i].inline_data[54] == one.inline_data[54];
+        ok &= (i % 2) ? ins[i].inline_data[0] == i && ins[i].block_ptr[0] == 0
+                      : ins[i].block_ptr[3] == 0x1003;
+    }
+    CTEST_ASSERT(ok, "whole-block decode matches per-record decode");
+
+    struct directory_entry ent = { .inode_num = 0x0203 }, back;
+    strcpy(ent.name, "fifteen_chars_x");
+    unsigned char drec[DIRECTORY_ENTRY_SIZE] = { 0 };
+    directory_entry_pack(&ent, drec);
+    directory_entry_unpack(&back, drec);
+    CTEST_ASSERT(drec[0] == 2 && drec[1] == 3 && back.inode_num == 0x0203 &&
+                 strcmp(back.name, "fifteen_chars_x") == 0, "entry round trip");
 }
 
 CTEST(inode_alloc, simple_ialloc) {
     unsigned char m[BLOCK_SIZE] = {0};
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
-    bwrite(INODE_MAP_BLOCK, m);
-    struct inode *n1 = ialloc();
+    CTEST_ASSERT((fs = vvsfs_open("img", 1)) != NULL, "open image");
+    bwrite(fs, INODE_MAP_BLOCK, m);
+    struct inode *n1 = ialloc(fs);
     CTEST_ASSERT(n1 != NULL, "ialloc returned inode");
     CTEST_ASSERT(n1->inode_num == 0, "first inode num is 0");
-    struct inode *n2 = ialloc();
+    struct inode *n2 = ialloc(fs);
     CTEST_ASSERT(n2 != NULL, "ialloc returned second inode");
     CTEST_ASSERT(n2->inode_num == 1, "second inode num is 1");
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 CTEST(inode_iput, write_on_zero) {
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
-    incore_free_all();
+    CTEST_ASSERT((fs = vvsfs_open("img", 1)) != NULL, "open image");
+    incore_free_all(fs);
     unsigned char map[BLOCK_SIZE] = {0};
-    bwrite(INODE_MAP_BLOCK, map);
+    bwrite(fs, INODE_MAP_BLOCK, map);
 
-    struct inode *in = ialloc();
+    struct inode *in = ialloc(fs);
     CTEST_ASSERT(in != NULL, "ialloc returned inode");
     unsigned int orig = in->inode_num;
     in->size = 9999;
     iput(in);
 
-    incore_free_all();
-    struct inode *re = iget(orig);
+    incore_free_all(fs);
+    struct inode *re = iget(fs, orig);
     CTEST_ASSERT(re != NULL, "iget succeeded after iput");
     CTEST_ASSERT(re->size == 9999, "written size matches");
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 CTEST(test_directory, root_has_dot_and_dotdot) {
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
-    mkfs("img");
+    fs = mkfs("img");
+    CTEST_ASSERT(fs != NULL, "open image");
 
-    struct directory *d = directory_open(0);
+    struct directory *d = directory_open(fs, 0);
     CTEST_ASSERT(d != NULL, "directory_open(0) succeeds");
 
     struct directory_entry ent;
@@ -102,61 +174,61 @@ CTEST(test_directory, root_has_dot_and_dotdot) {
     CTEST_ASSERT(r == -1, "no more entries");
 
     directory_close(d);
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 CTEST(test_path, lookup_root) {
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
-    mkfs("img");
-    CTEST_ASSERT(path_lookup("/")  == 0, "“/” → inode 0");
-    CTEST_ASSERT(path_lookup("")   == 0, "empty → inode 0");
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    fs = mkfs("img");
+    CTEST_ASSERT(fs != NULL, "open image");
+    CTEST_ASSERT(path_lookup(fs, "/")  == 0, "“/” → inode 0");
+    CTEST_ASSERT(path_lookup(fs, "")   == 0, "empty → inode 0");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 CTEST(test_path, not_found) {
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
-    mkfs("img");
-    CTEST_ASSERT(path_lookup("/nope") == -1, "missing → -1");
-    CTEST_ASSERT(path_lookup("/a/b")  == -1, "nested missing → -1");
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    fs = mkfs("img");
+    CTEST_ASSERT(fs != NULL, "open image");
+    CTEST_ASSERT(path_lookup(fs, "/nope") == -1, "missing → -1");
+    CTEST_ASSERT(path_lookup(fs, "/a/b")  == -1, "nested missing → -1");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 CTEST(test_namei, root_and_missing) {
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
-    mkfs("img");
+    fs = mkfs("img");
+    CTEST_ASSERT(fs != NULL, "open image");
 
-    struct inode *root_in = namei("/");
+    struct inode *root_in = namei(fs, "/");
     CTEST_ASSERT(root_in != NULL, "namei(\"/\") returned non-NULL");
     CTEST_ASSERT(root_in->inode_num == 0, "root inode number == 0");
     iput(root_in);
 
-    struct inode *empty_in = namei("");
+    struct inode *empty_in = namei(fs, "");
     CTEST_ASSERT(empty_in != NULL, "namei(\"\") returned non-NULL");
     CTEST_ASSERT(empty_in->inode_num == 0, "empty path inode number == 0");
     iput(empty_in);
 
-    struct inode *bad = namei("/doesnotexist");
+    struct inode *bad = namei(fs, "/doesnotexist");
     CTEST_ASSERT(bad == NULL, "namei(\"/doesnotexist\") returned NULL");
 
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 CTEST(test_directory_make, create_and_lookup) {
-    CTEST_ASSERT(image_open("img", 1) >= 0, "open image");
-    mkfs("img");
+    fs = mkfs("img");
+    CTEST_ASSERT(fs != NULL, "open image");
 
-    int res = directory_make("/foo");
+    int res = directory_make(fs, "/foo");
     CTEST_ASSERT(res == 0, "directory_make(\"/foo\") succeeded");
 
-    int foo_ino = path_lookup("/foo");
+    int foo_ino = path_lookup(fs, "/foo");
     CTEST_ASSERT(foo_ino > 0, "path_lookup(\"/foo\") > 0");
 
-    struct inode *foo_in = namei("/foo");
+    struct inode *foo_in = namei(fs, "/foo");
     CTEST_ASSERT(foo_in != NULL, "namei(\"/foo\") returned non-NULL");
     CTEST_ASSERT(foo_in->inode_num == (unsigned)foo_ino, "namei inode_num matches path_lookup");
     iput(foo_in);
 
-    struct directory *d = directory_open((unsigned)foo_ino);
+    struct directory *d = directory_open(fs, (unsigned)foo_ino);
     CTEST_ASSERT(d != NULL, "directory_open(foo_ino) succeeded");
 
     struct directory_entry ent;
@@ -176,7 +248,1492 @@ CTEST(test_directory_make, create_and_lookup) {
     CTEST_ASSERT(r == -1, "no more entries in /foo");
 
     directory_close(d);
-    CTEST_ASSERT(image_close() >= 0, "close image");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_directory_make, full_directory_frees_inode) {
+    fs = mkfs("img");
+    vvsfs_set_durability(fs, VVSFS_DURABILITY_NONE, 0);
+    CTEST_ASSERT(directory_make(fs, "/d") == 0, "directory_make(\"/d\")");
+
+    char path[32];
+    int made = 0;
+    int slots = INODE_PTR_COUNT * (BLOCK_SIZE / DIRECTORY_ENTRY_SIZE) - 2;
+    for (int i = 0; i < slots; i++) {
+        snprintf(path, sizeof path, "/d/f%d", i);
+        made += file_make(fs, path) == 0;
+    }
+    CTEST_ASSERT(made == slots, "filled every entry slot");
+    CTEST_ASSERT(file_make(fs, "/d/extra") == -1, "full directory refuses a create");
+
+    struct fsck_result res;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &res) == 0 && res.leaked_inodes == 0,
+                 "failed create leaked no inode");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_file, delayed_allocation) {
+    fs = mkfs("img");
+
+    struct inode *f = ialloc(fs);
+    CTEST_ASSERT(f != NULL, "ialloc returned inode");
+    f->flags = INODE_FLAG_FILE;
+
+    unsigned char buf[3 * BLOCK_SIZE], out[3 * BLOCK_SIZE];
+    for (int i = 0; i < (int)sizeof buf; i++)
+        buf[i] = i * 7;
+    CTEST_ASSERT(file_write(f, 0, buf, sizeof buf) == (int)sizeof buf, "write 3 blocks");
+    CTEST_ASSERT(f->block_ptr[0] == 0 && f->block_ptr[2] == 0, "no blocks allocated before flush");
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof out, "read from pending buffers");
+    CTEST_ASSERT(memcmp(buf, out, sizeof buf) == 0, "pending data matches");
+
+    CTEST_ASSERT(file_flush(f) == 3, "flush allocated 3 blocks");
+    CTEST_ASSERT(f->block_ptr[0] >= DATA_FIRST_BLOCK, "data lands after metadata");
+    CTEST_ASSERT(f->block_ptr[1] == f->block_ptr[0] + 1 &&
+                 f->block_ptr[2] == f->block_ptr[0] + 2, "batch is contiguous");
+
+    unsigned int num = f->inode_num;
+    iput(f);
+    f = iget(fs, num);
+    memset(out, 0, sizeof out);
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof out, "read back from disk");
+    CTEST_ASSERT(memcmp(buf, out, sizeof buf) == 0, "on-disk data matches");
+    iput(f);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_file, truncate_before_flush) {
+    fs = mkfs("img");
+
+    int before = alloc(fs);
+    bfree(fs, before);
+
+    struct inode *f = ialloc(fs);
+    f->flags = INODE_FLAG_FILE;
+    unsigned char buf[BLOCK_SIZE] = {1};
+    file_write(f, 0, buf, sizeof buf);
+    file_truncate(f);
+    CTEST_ASSERT(f->size == 0, "truncated to zero");
+    CTEST_ASSERT(f->pending[0] == NULL, "pending buffer dropped");
+    iput(f);
+
+    int after = alloc(fs);
+    CTEST_ASSERT(after == before, "temp file never consumed a block");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_file, budget_held_by_other_files) {
+    fs = mkfs("img");
+
+    enum { HOLDERS = DELALLOC_MAX_BLOCKS / INODE_PTR_COUNT };
+    struct inode *held[HOLDERS];
+    unsigned char buf[INODE_PTR_COUNT * BLOCK_SIZE], out[sizeof buf];
+    memset(buf, 'h', sizeof buf);
+    int ok = 1;
+    for (int i = 0; i < HOLDERS; i++) {
+        held[i] = ialloc(fs);
+        held[i]->flags = INODE_FLAG_FILE;
+        ok &= file_write(held[i], 0, buf, sizeof buf) == (int)sizeof buf;
+    }
+    CTEST_ASSERT(ok, "other files take the whole delalloc budget");
+
+    struct inode *f = ialloc(fs);
+    f->flags = INODE_FLAG_FILE;
+    for (int i = 0; i < (int)sizeof buf; i++)
+        buf[i] = i * 11;
+    CTEST_ASSERT(file_write(f, 0, buf, sizeof buf) == (int)sizeof buf, "write is not refused");
+    CTEST_ASSERT(f->size == sizeof buf, "size covers the write");
+    CTEST_ASSERT(f->block_ptr[0] != 0 && f->pending[0] == NULL, "block written through");
+
+    unsigned int num = f->inode_num;
+    iput(f);
+    for (int i = 0; i < HOLDERS; i++)
+        iput(held[i]);
+    f = iget(fs, num);
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof out &&
+                 memcmp(buf, out, sizeof buf) == 0, "data reads back");
+    iput(f);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_inline, tiny_file_and_spill) {
+    fs = mkfs("img");
+    int first = alloc(fs);
+    bfree(fs, first);
+    CTEST_ASSERT(first == DATA_FIRST_BLOCK, "mkfs used no data block");
+
+    struct inode *f = ialloc(fs);
+    f->flags = INODE_FLAG_FILE;
+    unsigned int num = f->inode_num;
+    CTEST_ASSERT(file_write(f, 0, "hello, inline", 14) == 14, "small write");
+    CTEST_ASSERT(f->flags & INODE_FLAG_INLINE, "file is inline");
+    iput(f);
+
+    incore_free_all(fs);
+    f = iget(fs, num);
+    char out[BLOCK_SIZE];
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == 14, "read inline size");
+    CTEST_ASSERT(strcmp(out, "hello, inline") == 0, "inline data round trips");
+    CTEST_ASSERT(f->block_ptr[0] == 0, "no data block");
+
+    char big[100];
+    memset(big, 'x', sizeof big);
+    CTEST_ASSERT(file_write(f, 14, big, sizeof big) == 100, "grow past inline");
+    CTEST_ASSERT(!(f->flags & INODE_FLAG_INLINE), "spilled out of inode");
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == 114, "read spilled size");
+    CTEST_ASSERT(memcmp(out, "hello, inline", 14) == 0 && out[113] == 'x',
+                 "spilled data intact");
+    iput(f);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_inline, directory_spills_to_block) {
+    fs = mkfs("img");
+    char path[16];
+    for (int i = 0; i < DIRECTORY_INLINE_MAX; i++) {
+        snprintf(path, sizeof path, "/d%d", i);
+        CTEST_ASSERT(directory_make(fs, path) == 0, "directory_make");
+    }
+    struct inode *root = iget(fs, 0);
+    CTEST_ASSERT(!(root->flags & INODE_FLAG_INLINE), "root spilled");
+    CTEST_ASSERT(root->block_ptr[0] >= DATA_FIRST_BLOCK, "root got a block");
+    iput(root);
+
+    struct inode *d0 = namei(fs, "/d0");
+    CTEST_ASSERT(d0 != NULL && (d0->flags & INODE_FLAG_INLINE), "child stays inline");
+    iput(d0);
+    for (int i = 0; i < DIRECTORY_INLINE_MAX; i++) {
+        snprintf(path, sizeof path, "/d%d", i);
+        CTEST_ASSERT(path_lookup(fs, path) > 0, "lookup after spill");
+    }
+    CTEST_ASSERT(directory_make(fs, "/d0/sub") == 0, "mkdir inside inline dir");
+    CTEST_ASSERT(path_lookup(fs, "/d0/sub") > 0, "lookup nested inline");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_journal, replay_after_lost_checkpoint) {
+    fs = mkfs("img");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen image");
+
+    unsigned char imap[BLOCK_SIZE], itab[BLOCK_SIZE];
+    bread(fs, INODE_MAP_BLOCK, imap);
+    bread(fs, INODE_FIRST_BLOCK, itab);
+
+    CTEST_ASSERT(directory_make(fs, "/a") == 0, "directory_make(\"/a\")");
+    journal_flush(fs);
+
+    unsigned char desc[BLOCK_SIZE], hdr[BLOCK_SIZE] = {0};
+    bread(fs, JOURNAL_FIRST_BLOCK + 1, desc);
+    CTEST_ASSERT(read_u32(desc) == JOURNAL_DESC_MAGIC, "log holds the transaction");
+
+    // Pretend we crashed after the commit but before the checkpoint.
+    dwrite(fs, INODE_MAP_BLOCK, imap);
+    dwrite(fs, INODE_FIRST_BLOCK, itab);
+    write_u32(hdr + 0, JOURNAL_HEADER_MAGIC);
+    write_u32(hdr + 4, read_u32(desc + 4));
+    dwrite(fs, JOURNAL_FIRST_BLOCK, hdr);
+    bread(fs, INODE_MAP_BLOCK, imap);
+    CTEST_ASSERT(!(imap[0] & 2), "home blocks lost the update");
+
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen replays the log");
+    incore_free_all(fs);
+    CTEST_ASSERT(path_lookup(fs, "/a") > 0, "replayed directory is back");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_journal, rewrite_keeps_committed_version) {
+    fs = mkfs("img");
+    int blk = DATA_FIRST_BLOCK + 100;
+    unsigned char a[BLOCK_SIZE], b[BLOCK_SIZE], home[BLOCK_SIZE];
+    memset(a, 'a', sizeof a);
+    memset(b, 'b', sizeof b);
+
+    journal_begin(fs);
+    bwrite(fs, blk, a);
+    journal_end(fs);
+
+    // Rewrite it before the checkpoint: the committed 'a' must still
+    // reach its home block before the log is recycled.
+    journal_begin(fs);
+    bwrite(fs, blk, b);
+    int ok = 0;
+    for (int i = 0; i < 200 && !ok; i++) {
+        image_pread(fs, home, BLOCK_SIZE, (off_t)blk * BLOCK_SIZE);
+        ok = memcmp(home, a, BLOCK_SIZE) == 0;
+        if (!ok)
+            usleep(5000);
+    }
+    CTEST_ASSERT(ok, "committed version checkpointed under a newer write");
+    bread(fs, blk, home);
+    CTEST_ASSERT(memcmp(home, b, BLOCK_SIZE) == 0, "reads see the newer write");
+    journal_end(fs);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+static void *
+journal_mkdir_worker(void *arg)
+{
+    char path[16];
+    for (int i = 0; i < 8; i++) {
+        snprintf(path, sizeof path, "/t%ld_%d", (long)arg, i);
+        directory_make(fs, path);
+    }
+    return NULL;
+}
+
+CTEST(test_journal, concurrent_group_commit) {
+    fs = mkfs("img");
+    pthread_t t[4];
+    for (long i = 0; i < 4; i++)
+        pthread_create(&t[i], NULL, journal_mkdir_worker, (void *)i);
+    for (int i = 0; i < 4; i++)
+        pthread_join(t[i], NULL);
+
+    int found = 0;
+    char path[16];
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 8; j++) {
+            snprintf(path, sizeof path, "/t%d_%d", i, j);
+            found += path_lookup(fs, path) > 0;
+        }
+    CTEST_ASSERT(found == 32, "every concurrent mkdir is visible");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_txn, many_mkdirs_one_commit) {
+    fs = mkfs("img");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen with an empty log");
+
+    char path[16];
+    vvsfs_txn_begin(fs);
+    for (int i = 0; i < 100; i++) {
+        snprintf(path, sizeof path, "/d%d", i);
+        directory_make(fs, path);
+    }
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == 0, "commit succeeded");
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == -1, "commit without begin fails");
+
+    unsigned char desc[BLOCK_SIZE];
+    bread(fs, JOURNAL_FIRST_BLOCK + 1, desc);
+    unsigned int seq   = read_u32(desc + 4);
+    unsigned int count = read_u32(desc + 8);
+    CTEST_ASSERT(read_u32(desc) == JOURNAL_DESC_MAGIC, "one transaction logged");
+    CTEST_ASSERT(count < 10, "bitmap, inode and directory blocks deduplicated");
+    bread(fs, JOURNAL_FIRST_BLOCK + 1 + count + 2, desc);
+    CTEST_ASSERT(read_u32(desc) != JOURNAL_DESC_MAGIC || read_u32(desc + 4) != seq + 1,
+                 "no second transaction");
+
+    int found = 0;
+    for (int i = 0; i < 100; i++) {
+        snprintf(path, sizeof path, "/d%d", i);
+        found += path_lookup(fs, path) > 0;
+    }
+    CTEST_ASSERT(found == 100, "all directories exist");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_txn, oversized_reports_error) {
+    fs = mkfs("img");
+    unsigned char blk[BLOCK_SIZE];
+    memset(blk, 'x', sizeof blk);
+
+    vvsfs_txn_begin(fs);
+    for (int i = 0; i <= JOURNAL_MAX_TXN; i++)
+        bwrite(fs, DATA_FIRST_BLOCK + i, blk);
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == VVSFS_TXN_NOT_ATOMIC,
+                 "commit past the log size is not atomic");
+
+    vvsfs_txn_begin(fs);
+    bwrite(fs, DATA_FIRST_BLOCK, blk);
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == 0, "next transaction commits");
+    CTEST_ASSERT(directory_make(fs, "/after") == 0 &&
+                 path_lookup(fs, "/after") > 0, "image still usable");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_txn, split_keeps_every_block) {
+    fs = mkfs("img");
+    // No background checkpointer, so the image is left as a crash
+    // right after the commit would leave it.
+    journal_stop(fs);
+    unsigned char blk[BLOCK_SIZE], out[BLOCK_SIZE];
+    int n = 1100;
+
+    // More blocks than one descriptor can list, let alone the log.
+    vvsfs_txn_begin(fs);
+    for (int i = 0; i < n; i++) {
+        memset(blk, i & 0xff, sizeof blk);
+        write_u32(blk, i);
+        bwrite(fs, DATA_FIRST_BLOCK + i, blk);
+    }
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == VVSFS_TXN_NOT_ATOMIC,
+                 "split group reports it");
+
+    struct vvsfs *crashed = vvsfs_open("img", 0);
+    CTEST_ASSERT(crashed != NULL, "open the image again, replaying the log");
+    int good = 1;
+    for (int i = 0; crashed && i < n; i++) {
+        good &= bread(crashed, DATA_FIRST_BLOCK + i, out) != NULL &&
+                read_u32(out) == (unsigned)i && out[4] == (i & 0xff);
+    }
+    CTEST_ASSERT(good, "every block is in the log or home");
+    unsigned char table[BLOCK_SIZE];
+    for (int b = CSUM_FIRST_BLOCK; crashed && b < DATA_FIRST_BLOCK; b++) {
+        good &= bread(fs, b, table) != NULL &&
+                bread(crashed, b, out) != NULL &&
+                memcmp(table, out, BLOCK_SIZE) == 0;
+    }
+    CTEST_ASSERT(good, "checksum table matches");
+    CTEST_ASSERT(vvsfs_close(crashed) >= 0, "close the second open");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+static void *
+txn_mkdir_worker(void *arg)
+{
+    *(int *)arg = directory_make(fs, "/outside") == 0 ? 1 : -1;
+    return NULL;
+}
+
+static void *
+txn_lookup_worker(void *arg)
+{
+    int r = path_lookup(fs, "/x") > 0 ? 1 : -1;
+    __atomic_store_n((int *)arg, r, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+CTEST(test_txn, open_txn_does_not_stall_readers) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/x") == 0, "directory_make");
+
+    vvsfs_txn_begin(fs);
+    CTEST_ASSERT(directory_make(fs, "/inside") == 0, "mkdir inside the txn");
+
+    // This writer needs a commit, which has to wait for the txn.
+    pthread_t w, r;
+    int wrote = 0, looked = 0;
+    pthread_create(&w, NULL, txn_mkdir_worker, &wrote);
+    usleep(20000);
+    pthread_create(&r, NULL, txn_lookup_worker, &looked);
+    for (int i = 0; i < 200 && !__atomic_load_n(&looked, __ATOMIC_ACQUIRE); i++)
+        usleep(5000);
+    CTEST_ASSERT(__atomic_load_n(&looked, __ATOMIC_ACQUIRE) == 1,
+                 "lookup finishes while the txn is open");
+
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == 0, "txn commits");
+    pthread_join(w, NULL);
+    pthread_join(r, NULL);
+    CTEST_ASSERT(wrote == 1, "waiting writer finished after the commit");
+    CTEST_ASSERT(path_lookup(fs, "/inside") > 0 && path_lookup(fs, "/outside") > 0,
+                 "both updates visible");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_txn, capped_at_max_blocks) {
+    fs = mkfs("img");
+    unsigned char blk[BLOCK_SIZE];
+    memset(blk, 'y', sizeof blk);
+
+    vvsfs_txn_begin(fs);
+    // The checksum table block is logged as well, so stay inside.
+    for (int i = 0; i < VVSFS_TXN_MAX_BLOCKS / 2; i++)
+        bwrite(fs, DATA_FIRST_BLOCK + i, blk);
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == 0, "txn within the cap commits");
+
+    vvsfs_txn_begin(fs);
+    memset(blk, 'z', sizeof blk);
+    for (int i = 0; i <= VVSFS_TXN_MAX_BLOCKS; i++)
+        bwrite(fs, DATA_FIRST_BLOCK + i, blk);
+    CTEST_ASSERT(vvsfs_txn_commit(fs) == VVSFS_TXN_NOT_ATOMIC,
+                 "txn past the cap commits without the atomicity guarantee");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen image");
+    unsigned char out[BLOCK_SIZE];
+    int kept = 1;
+    for (int i = 0; i <= VVSFS_TXN_MAX_BLOCKS; i++)
+        kept &= bread(fs, DATA_FIRST_BLOCK + i, out) != NULL && out[0] == 'z';
+    CTEST_ASSERT(kept, "its writes are on disk");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+static unsigned int
+log_start_seq(void)
+{
+    unsigned char hdr[BLOCK_SIZE];
+    bread(fs, JOURNAL_FIRST_BLOCK, hdr);
+    return read_u32(hdr + 4);
+}
+
+static int
+log_has_commit(unsigned int seq)
+{
+    unsigned char desc[BLOCK_SIZE];
+    bread(fs, JOURNAL_FIRST_BLOCK + 1, desc);
+    return read_u32(desc) == JOURNAL_DESC_MAGIC && read_u32(desc + 4) == seq;
+}
+
+static void *
+sync_worker(void *arg)
+{
+    *(int *)arg = vvsfs_sync(fs);
+    return NULL;
+}
+
+CTEST(test_durability, explicit_and_periodic) {
+    fs = mkfs("img");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen with an empty log");
+
+    unsigned int seq = log_start_seq();
+    vvsfs_set_durability(fs, VVSFS_DURABILITY_EXPLICIT, 0);
+    CTEST_ASSERT(directory_make(fs, "/lazy") == 0, "directory_make");
+    CTEST_ASSERT(!log_has_commit(seq), "nothing committed before sync");
+    CTEST_ASSERT(path_lookup(fs, "/lazy") > 0, "update visible before sync");
+
+    pthread_t t[4];
+    int res[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&t[i], NULL, sync_worker, &res[i]);
+    for (int i = 0; i < 4; i++)
+        pthread_join(t[i], NULL);
+    CTEST_ASSERT(res[0] == 0 && res[1] == 0 && res[2] == 0 && res[3] == 0,
+                 "concurrent vvsfs_sync() calls succeed");
+    CTEST_ASSERT(log_has_commit(seq), "sync committed the transaction");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen with an empty log");
+    seq = log_start_seq();
+    vvsfs_set_durability(fs, VVSFS_DURABILITY_PERIODIC, 5);
+    CTEST_ASSERT(directory_make(fs, "/timed") == 0, "directory_make");
+    for (int i = 0; i < 100 && !log_has_commit(seq); i++)
+        usleep(5000);
+    CTEST_ASSERT(log_has_commit(seq), "periodic syncer committed");
+
+    vvsfs_set_durability(fs, VVSFS_DURABILITY_OPERATION, 0);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_durability, lookups_do_not_commit) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/a") == 0, "directory_make");
+    CTEST_ASSERT(directory_make(fs, "/a/b") == 0, "directory_make");
+    journal_flush(fs);
+
+    unsigned int seq = log_start_seq();
+    int found = 0;
+    for (int i = 0; i < 10; i++)
+        found += path_lookup(fs, "/a/b") > 0;
+    CTEST_ASSERT(found == 10, "lookups succeed");
+    CTEST_ASSERT(!log_has_commit(seq), "read-only lookups committed nothing");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_clone, shared_blocks_and_cow) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/src") == 0, "mkdir /src");
+    CTEST_ASSERT(directory_make(fs, "/src/sub") == 0, "mkdir /src/sub");
+    CTEST_ASSERT(file_make(fs, "/src/f") == 0, "create /src/f");
+    CTEST_ASSERT(file_make(fs, "/src/sub/g") == 0, "create /src/sub/g");
+
+    unsigned char buf[2 * BLOCK_SIZE], out[2 * BLOCK_SIZE];
+    memset(buf, 'a', sizeof buf);
+    struct inode *f = namei(fs, "/src/f");
+    file_write(f, 0, buf, sizeof buf);
+    iput(f);
+    struct inode *g = namei(fs, "/src/sub/g");
+    file_write(g, 0, "tiny", 5);
+    iput(g);
+
+    CTEST_ASSERT(directory_clone(fs, "/src", "/dst") == 0, "clone /src to /dst");
+    f = namei(fs, "/src/f");
+    struct inode *c = namei(fs, "/dst/f");
+    CTEST_ASSERT(c != NULL && c != f, "clone has its own inode");
+    CTEST_ASSERT(c->block_ptr[0] == f->block_ptr[0] &&
+                 c->block_ptr[1] == f->block_ptr[1], "data blocks are shared");
+    CTEST_ASSERT(brefcount(fs, f->block_ptr[0]) == 2, "shared block has two refs");
+
+    unsigned int shared = f->block_ptr[0];
+    file_write(c, 10, "B", 1);
+    file_flush(c);
+    CTEST_ASSERT(c->block_ptr[0] != shared, "write copied the block");
+    CTEST_ASSERT(c->block_ptr[1] == f->block_ptr[1], "untouched block stays shared");
+    CTEST_ASSERT(brefcount(fs, shared) == 1, "original block back to one ref");
+    file_read(f, 0, out, sizeof out);
+    CTEST_ASSERT(memcmp(out, buf, sizeof buf) == 0, "source unchanged");
+    file_read(c, 0, out, sizeof out);
+    CTEST_ASSERT(out[10] == 'B' && out[11] == 'a', "clone sees its write");
+    iput(c);
+    iput(f);
+
+    g = namei(fs, "/dst/sub/g");
+    char small[8] = {0};
+    CTEST_ASSERT(g != NULL && file_read(g, 0, small, sizeof small) == 5,
+                 "nested inline file cloned");
+    CTEST_ASSERT(strcmp(small, "tiny") == 0, "inline data copied");
+    iput(g);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+
+    // Reference counts are kept in core; they must come back on open.
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen image");
+    f = namei(fs, "/src/f");
+    CTEST_ASSERT(brefcount(fs, f->block_ptr[1]) == 2, "shared block still has two refs");
+    file_write(f, BLOCK_SIZE, "C", 1);
+    file_flush(f);
+    c = namei(fs, "/dst/f");
+    file_read(c, 0, out, sizeof out);
+    CTEST_ASSERT(out[BLOCK_SIZE] == 'a', "write after reopen did not reach the clone");
+    iput(c);
+    iput(f);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_clone, snapshot_root) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/a") == 0, "mkdir /a");
+    CTEST_ASSERT(directory_clone(fs, "/", "/snap") == 0, "snapshot /");
+    CTEST_ASSERT(path_lookup(fs, "/snap/a") > 0, "snapshot holds /a");
+    CTEST_ASSERT(path_lookup(fs, "/snap/snap") == -1, "snapshot skips itself");
+    CTEST_ASSERT(directory_clone(fs, "/missing", "/x") == -1, "missing source fails");
+    CTEST_ASSERT(directory_clone(fs, "/", "/a") == -1, "taken name fails");
+    struct fsck_result res;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &res) == 0 && res.leaked_inodes == 0 &&
+                 res.leaked_blocks == 0, "failed clones leak nothing");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_clone, large_tree_in_bounded_transactions) {
+    fs = mkfs("img");
+    char path[64];
+    directory_make(fs, "/src");
+    // Four entries each are too many to keep inline, so every one of
+    // these directories takes a block of its own.
+    for (int i = 0; i < 120; i++) {
+        snprintf(path, sizeof path, "/src/d%d", i);
+        directory_make(fs, path);
+        for (int k = 0; k < 4; k++) {
+            snprintf(path, sizeof path, "/src/d%d/e%d", i, k);
+            directory_make(fs, path);
+        }
+    }
+    // Start from an empty log, and leave the clone's commits in it.
+    journal_flush(fs);
+    journal_stop(fs);
+    unsigned int seq = log_start_seq();
+    CTEST_ASSERT(directory_clone(fs, "/src", "/dst") == 0, "clone 601 directories");
+
+    unsigned char desc[BLOCK_SIZE];
+    int pos = 0, commits = 0, biggest = 0;
+    while (pos + 2 <= JOURNAL_LOG_BLOCKS &&
+           image_pread(fs, desc, BLOCK_SIZE,
+                       (off_t)(JOURNAL_FIRST_BLOCK + 1 + pos) * BLOCK_SIZE)
+               == BLOCK_SIZE &&
+           read_u32(desc) == JOURNAL_DESC_MAGIC &&
+           read_u32(desc + 4) == seq + commits) {
+        int count = read_u32(desc + 8);
+        if (count > biggest)
+            biggest = count;
+        commits++;
+        pos += count + 2;
+    }
+    CTEST_ASSERT(commits > 1 && biggest <= VVSFS_TXN_MAX_BLOCKS + 8,
+                 "clone commits in batches of about VVSFS_TXN_MAX_BLOCKS");
+    CTEST_ASSERT(path_lookup(fs, "/dst/d119/e3") > 0, "whole tree cloned");
+    struct fsck_result res;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &res) == 0 && res.errors == 0 &&
+                 res.leaked_inodes == 0, "cloned image is consistent");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_compress, lz_round_trip) {
+    static unsigned char src[4 * BLOCK_SIZE], packed[5 * BLOCK_SIZE],
+                         out[4 * BLOCK_SIZE];
+    unsigned int seed = 1;
+    for (int i = 0; i < (int)sizeof src; i++) {
+        seed = seed * 1103515245 + 12345;
+        src[i] = (i % 512 < 256) ? (unsigned char)"payload-"[i % 8]
+                                 : (unsigned char)(seed >> 16);
+    }
+    int clen = lz_compress(src, sizeof src, packed, sizeof packed);
+    CTEST_ASSERT(clen > 0 && clen < (int)sizeof src, "mixed data compresses");
+    CTEST_ASSERT(lz_decompress(packed, clen, out, sizeof out) == (int)sizeof src,
+                 "decompressed length");
+    CTEST_ASSERT(memcmp(src, out, sizeof src) == 0, "round trip matches");
+    CTEST_ASSERT(lz_compress(src + 512 + 256, 200, packed, 100) == -1,
+                 "incompressible input overflows small buffer");
+    CTEST_ASSERT(lz_compress((unsigned char *)"abc", 3, packed, 16) == 4 &&
+                 lz_decompress(packed, 4, out, 16) == 3, "tiny input");
+    CTEST_ASSERT(lz_decompress(packed, 4, out, 2) == -1, "output bound checked");
+}
+
+CTEST(test_compress, compressed_cluster) {
+    fs = mkfs("img");
+    CTEST_ASSERT(file_make(fs, "/z") == 0, "create /z");
+    struct inode *f = namei(fs, "/z");
+    f->flags |= INODE_FLAG_COMPRESS;
+
+    static unsigned char buf[4 * BLOCK_SIZE + 100], out[sizeof buf];
+    for (int i = 0; i < (int)sizeof buf; i++)
+        buf[i] = "vvsfs payload "[i % 14];
+    CTEST_ASSERT(file_write(f, 0, buf, sizeof buf) == (int)sizeof buf, "write");
+    CTEST_ASSERT(file_flush(f) == 5, "flushed 5 delayed blocks");
+    CTEST_ASSERT(f->block_ptr[0] == COMPRESS_ADDR, "cluster compressed");
+    CTEST_ASSERT(f->block_ptr[1] >= DATA_FIRST_BLOCK && f->block_ptr[2] == 0,
+                 "cluster fits one block");
+    CTEST_ASSERT(f->block_ptr[4] != 0 && f->block_ptr[4] != COMPRESS_ADDR,
+                 "single-block tail stays raw");
+    unsigned int num = f->inode_num;
+    iput(f);
+
+    incore_free_all(fs);
+    f = iget(fs, num);
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof out, "read back");
+    CTEST_ASSERT(memcmp(buf, out, sizeof buf) == 0, "data matches");
+
+    file_write(f, BLOCK_SIZE + 7, "XYZ", 3);
+    file_flush(f);
+    memcpy(buf + BLOCK_SIZE + 7, "XYZ", 3);
+    CTEST_ASSERT(f->block_ptr[0] == COMPRESS_ADDR, "rewritten cluster compressed");
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof out &&
+                 memcmp(buf, out, sizeof buf) == 0, "rewrite visible");
+
+    f->flags &= ~INODE_FLAG_COMPRESS;
+    file_write(f, 0, "q", 1);
+    file_flush(f);
+    buf[0] = 'q';
+    CTEST_ASSERT(f->block_ptr[0] != COMPRESS_ADDR && f->block_ptr[3] != 0,
+                 "cluster expanded once compression is off");
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof out &&
+                 memcmp(buf, out, sizeof buf) == 0, "expanded data matches");
+    iput(f);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_compress, remade_image_reads_own_clusters) {
+    static unsigned char a[4 * BLOCK_SIZE], b[sizeof a], out[sizeof a];
+    memset(a, 'a', sizeof a);
+    memset(b, 'b', sizeof b);
+    for (int round = 0; round < 2; round++) {
+        fs = mkfs("img");
+        file_make(fs, "/z");
+        struct inode *f = namei(fs, "/z");
+        f->flags |= INODE_FLAG_COMPRESS;
+        file_write(f, 0, round ? b : a, sizeof a);
+        file_flush(f);
+        CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof out &&
+                     memcmp(out, round ? b : a, sizeof out) == 0,
+                     "cluster read from this image, not the cache");
+        iput(f);
+        CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    }
+}
+
+CTEST(test_dedup, write_time_sharing) {
+    fs = mkfs("img");
+    CTEST_ASSERT(file_make(fs, "/a") == 0 && file_make(fs, "/b") == 0, "create /a /b");
+
+    static unsigned char buf[2 * BLOCK_SIZE], out[sizeof buf];
+    memset(buf, 'd', BLOCK_SIZE);
+    memset(buf + BLOCK_SIZE, 'e', BLOCK_SIZE);
+    struct inode *a = namei(fs, "/a");
+    struct inode *b = namei(fs, "/b");
+    a->flags |= INODE_FLAG_DEDUP;
+    b->flags |= INODE_FLAG_DEDUP;
+    file_write(a, 0, buf, sizeof buf);
+    file_flush(a);
+    file_write(b, 0, buf, sizeof buf);
+    file_flush(b);
+    CTEST_ASSERT(b->block_ptr[0] == a->block_ptr[0] &&
+                 b->block_ptr[1] == a->block_ptr[1], "identical blocks shared");
+    CTEST_ASSERT(brefcount(fs, a->block_ptr[0]) == 2, "shared block has two refs");
+
+    unsigned int shared = a->block_ptr[1];
+    file_write(b, BLOCK_SIZE, "f", 1);
+    file_flush(b);
+    CTEST_ASSERT(b->block_ptr[1] != shared, "changed block copied");
+    CTEST_ASSERT(brefcount(fs, shared) == 1, "original block back to one ref");
+    file_read(a, 0, out, sizeof out);
+    CTEST_ASSERT(memcmp(out, buf, sizeof buf) == 0, "other file unchanged");
+    iput(b);
+    iput(a);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_dedup, offline_pass) {
+    fs = mkfs("img");
+    CTEST_ASSERT(file_make(fs, "/a") == 0 && file_make(fs, "/b") == 0, "create /a /b");
+
+    static unsigned char buf[3 * BLOCK_SIZE], out[sizeof buf];
+    memset(buf, 'x', BLOCK_SIZE);
+    memset(buf + BLOCK_SIZE, 'y', BLOCK_SIZE);
+    memset(buf + 2 * BLOCK_SIZE, 'x', BLOCK_SIZE);
+    struct inode *a = namei(fs, "/a");
+    file_write(a, 0, buf, sizeof buf);
+    iput(a);
+    struct inode *b = namei(fs, "/b");
+    file_write(b, 0, buf, 2 * BLOCK_SIZE);
+    iput(b);
+
+    CTEST_ASSERT(dedup_image(fs) == 3, "three duplicate blocks remapped");
+    CTEST_ASSERT(dedup_image(fs) == 0, "second pass finds nothing");
+    a = namei(fs, "/a");
+    b = namei(fs, "/b");
+    CTEST_ASSERT(a->block_ptr[2] == a->block_ptr[0] &&
+                 b->block_ptr[0] == a->block_ptr[0] &&
+                 b->block_ptr[1] == a->block_ptr[1], "pointers remapped");
+    CTEST_ASSERT(brefcount(fs, a->block_ptr[0]) == 3, "first copy has three refs");
+    CTEST_ASSERT(file_read(a, 0, out, sizeof out) == (int)sizeof out &&
+                 memcmp(out, buf, sizeof buf) == 0, "data intact");
+
+    // The index built by the pass lets a new dedup write share too.
+    CTEST_ASSERT(file_make(fs, "/c") == 0, "create /c");
+    struct inode *c = namei(fs, "/c");
+    c->flags |= INODE_FLAG_DEDUP;
+    file_write(c, 0, buf + BLOCK_SIZE, BLOCK_SIZE);
+    file_flush(c);
+    CTEST_ASSERT(c->block_ptr[0] == a->block_ptr[1], "write shares indexed block");
+    iput(c);
+    iput(b);
+    iput(a);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_csum, crc32c_vectors) {
+    const char *v = "123456789";
+    CTEST_ASSERT(crc32c(0, v, 9) == 0xE3069283, "hardware-or-dispatch check value");
+    CTEST_ASSERT(crc32c_sw(0, v, 9) == 0xE3069283, "slicing-by-8 check value");
+
+    static unsigned char buf[BLOCK_SIZE + 3];
+    for (int i = 0; i < (int)sizeof buf; i++)
+        buf[i] = (unsigned char)(i * 7 + 1);
+    CTEST_ASSERT(crc32c(0, buf + 3, BLOCK_SIZE) == crc32c_sw(0, buf + 3, BLOCK_SIZE),
+                 "both paths agree on an unaligned block");
+    CTEST_ASSERT(crc32c(crc32c(0, buf, 100), buf + 100, 200) == crc32c(0, buf, 300),
+                 "crc can be continued");
+}
+
+CTEST(test_csum, corrupt_metadata_detected) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/d") == 0, "mkdir /d");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen image");
+
+    unsigned char block[BLOCK_SIZE];
+    CTEST_ASSERT(bread(fs, INODE_FIRST_BLOCK, block) != NULL, "clean inode block reads");
+    CTEST_ASSERT(csum_errors(fs) == 0, "no errors yet");
+    block[100] ^= 0x10;
+    image_pwrite(fs, block, BLOCK_SIZE, (off_t)INODE_FIRST_BLOCK * BLOCK_SIZE);
+    CTEST_ASSERT(bread(fs, INODE_FIRST_BLOCK, block) == NULL, "corruption caught");
+    CTEST_ASSERT(csum_errors(fs) == 1, "error counted");
+    CTEST_ASSERT(bread(fs, BLOCK_MAP_BLOCK, block) != NULL, "other blocks unaffected");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_fsck, clean_then_leaks) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/d") == 0, "mkdir /d");
+    for (int i = 0; i < 8; i++) {
+        char name[16];
+        sprintf(name, "/d/s%d", i);
+        CTEST_ASSERT(directory_make(fs, name) == 0, "mkdir /d/sN");
+    }
+    CTEST_ASSERT(file_make(fs, "/d/s3/f") == 0, "create /d/s3/f");
+    static unsigned char buf[3 * BLOCK_SIZE];
+    memset(buf, 'k', sizeof buf);
+    struct inode *f = namei(fs, "/d/s3/f");
+    file_write(f, 0, buf, sizeof buf);
+    iput(f);
+    CTEST_ASSERT(directory_clone(fs, "/d", "/c") == 0, "clone /d");
+
+    struct fsck_result res;
+    CTEST_ASSERT(fsck_image(fs, 4, NULL, &res) == 0, "clean image passes");
+    CTEST_ASSERT(res.inodes == 21 && res.directories == 19, "counted inodes");
+    CTEST_ASSERT(res.blocks == 5, "shared file blocks counted once");
+
+    struct inode *lost = ialloc(fs);
+    lost->flags = INODE_FLAG_FILE;
+    iput(lost);
+    CTEST_ASSERT(alloc(fs) >= DATA_FIRST_BLOCK, "allocate an orphan block");
+    CTEST_ASSERT(fsck_image(fs, 1, NULL, &res) == 2, "two problems found");
+    CTEST_ASSERT(res.leaked_inodes == 1 && res.leaked_blocks == 1 &&
+                 res.errors == 0, "one leaked inode and one leaked block");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_mkfs, sparse_image_and_lazy_groups) {
+    fs = mkfs("img");
+    struct stat st;
+    CTEST_ASSERT(fstat(fs->fds[0], &st) == 0, "stat image");
+    CTEST_ASSERT(st.st_size == (off_t)IMAGE_BLOCK_COUNT * BLOCK_SIZE,
+                 "image sized in one step");
+    CTEST_ASSERT(st.st_blocks * 512 < st.st_size / 16, "image is sparse");
+    CTEST_ASSERT(super_group_ready(fs, 0), "root group initialized");
+    CTEST_ASSERT(!super_group_ready(fs, 1) &&
+                 !super_group_ready(fs, INODE_GROUP_COUNT - 1),
+                 "other groups left uninitialized");
+
+    struct inode in;
+    in.inode_num = INODE_COUNT - 1;
+    read_inode(fs, &in, INODE_COUNT - 1);
+    CTEST_ASSERT(in.flags == 0 && in.size == 0, "uninitialized group reads empty");
+
+    super_group_init(fs, 3);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    CTEST_ASSERT((fs = vvsfs_open("img", 0)) != NULL, "reopen image");
+    CTEST_ASSERT(super_group_ready(fs, 3) && !super_group_ready(fs, 4),
+                 "group flags persist");
+    struct fsck_result res;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &res) == 0, "fresh image is consistent");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+static void
+host_write(const char *dir, const char *name, const void *data, size_t len)
+{
+    char path[256];
+    if (snprintf(path, sizeof path, "%s/%s", dir, name) >= (int)sizeof path)
+        return;
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        fwrite(data, 1, len, fp);
+        fclose(fp);
+    }
+}
+
+static void
+host_remove(const char *path)
+{
+    DIR *d = opendir(path);
+    struct dirent *de;
+    while (d && (de = readdir(d)) != NULL) {
+        char child[512];
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+            continue;
+        snprintf(child, sizeof child, "%s/%s", path, de->d_name);
+        host_remove(child);
+    }
+    if (d)
+        closedir(d);
+    remove(path);
+}
+
+CTEST(test_import, host_tree) {
+    char host[] = "/tmp/vvsfs-import-XXXXXX";
+    CTEST_ASSERT(mkdtemp(host) != NULL, "make host dir");
+    char path[256];
+    snprintf(path, sizeof path, "%s/sub", host);
+    mkdir(path, 0700);
+    snprintf(path, sizeof path, "%s/sub/deep", host);
+    mkdir(path, 0700);
+    snprintf(path, sizeof path, "%s/wide", host);
+    mkdir(path, 0700);
+
+    static unsigned char big[2 * BLOCK_SIZE + 10], out[sizeof big];
+    for (int i = 0; i < (int)sizeof big; i++)
+        big[i] = (unsigned char)(i * 31);
+    host_write(host, "tiny", "hello", 5);
+    host_write(host, "sub/big", big, sizeof big);
+    host_write(host, "sub/deep/empty", "", 0);
+    host_write(host, "a_name_that_is_too_long", "x", 1);
+    for (int i = 0; i < 40; i++) {
+        char name[32];
+        sprintf(name, "wide/f%d", i);
+        host_write(host, name, name, strlen(name));
+    }
+
+    fs = mkfs("img");
+    struct import_result res;
+    CTEST_ASSERT(import_tree(fs, host, 4, &res) == 0, "import host tree");
+    CTEST_ASSERT(res.files == 43 && res.directories == 3, "counted files and dirs");
+    CTEST_ASSERT(res.skipped == 1, "long name skipped");
+    CTEST_ASSERT(import_tree(fs, host, 1, &res) == -1, "non-empty root refused");
+
+    char small[8] = {0};
+    struct inode *f = namei(fs, "/tiny");
+    CTEST_ASSERT(f && (f->flags & INODE_FLAG_INLINE) &&
+                 file_read(f, 0, small, sizeof small) == 5 &&
+                 strcmp(small, "hello") == 0, "inline file imported");
+    iput(f);
+    f = namei(fs, "/sub/big");
+    CTEST_ASSERT(f && f->block_ptr[1] == f->block_ptr[0] + 1 &&
+                 f->block_ptr[2] == f->block_ptr[0] + 2, "file blocks contiguous");
+    CTEST_ASSERT(file_read(f, 0, out, sizeof out) == (int)sizeof big &&
+                 memcmp(out, big, sizeof big) == 0, "block file imported");
+    iput(f);
+    f = namei(fs, "/wide/f39");
+    CTEST_ASSERT(f && file_read(f, 0, small, 7) == 7 &&
+                 memcmp(small, "wide/f3", 7) == 0, "entry in spilled directory");
+    iput(f);
+    CTEST_ASSERT(path_lookup(fs, "/sub/deep/empty") > 0, "nested empty file");
+
+    CTEST_ASSERT(file_make(fs, "/sub/deep/later") == 0, "normal create afterwards");
+    struct fsck_result fres;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &fres) == 0, "imported image is consistent");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    host_remove(host);
+}
+
+CTEST(test_import, large_tree_and_failure) {
+    char host[] = "/tmp/vvsfs-import-XXXXXX";
+    CTEST_ASSERT(mkdtemp(host) != NULL, "make host dir");
+    char path[256];
+
+    // 300 spilled directories: more metadata blocks than one log holds.
+    for (int d = 0; d < 300; d++) {
+        snprintf(path, sizeof path, "%s/d%d", host, d);
+        mkdir(path, 0700);
+        for (int f = 0; f < 4; f++) {
+            snprintf(path, sizeof path, "d%d/f%d", d, f);
+            host_write(host, path, "", 0);
+        }
+    }
+    fs = mkfs("img");
+    struct import_result res;
+    CTEST_ASSERT(import_tree(fs, host, 4, &res) == 0, "import large tree");
+    CTEST_ASSERT(res.directories == 300 && res.files == 1200, "counted files and dirs");
+    CTEST_ASSERT(path_lookup(fs, "/d299/f3") > 0, "last entry linked");
+    struct fsck_result fres;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &fres) == 0, "imported image is consistent");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+
+    // Sparse host files that need more blocks than the image has.
+    snprintf(path, sizeof path, "%s/huge", host);
+    mkdir(path, 0700);
+    for (int i = 0; i < IMAGE_BLOCK_COUNT / INODE_PTR_COUNT; i++) {
+        snprintf(path, sizeof path, "%s/huge/h%d", host, i);
+        int fd = open(path, O_CREAT | O_WRONLY, 0600);
+        if (fd >= 0) {
+            ftruncate(fd, (off_t)INODE_PTR_COUNT * BLOCK_SIZE);
+            close(fd);
+        }
+    }
+    fs = mkfs("img");
+    CTEST_ASSERT(import_tree(fs, host, 4, &res) == -1, "import too big for the image fails");
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &fres) == 0 && fres.leaked_inodes == 0 &&
+                 fres.leaked_blocks == 0, "failed import leaked nothing");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    host_remove(host);
+}
+
+CTEST(test_export, dir_and_tar) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/d") == 0 && file_make(fs, "/d/big") == 0 &&
+                 file_make(fs, "/d/z") == 0 && file_make(fs, "/t") == 0, "make tree");
+    static unsigned char big[3 * BLOCK_SIZE + 5], out[sizeof big];
+    for (int i = 0; i < (int)sizeof big; i++)
+        big[i] = (unsigned char)(i * 13 + 7);
+    struct inode *f = namei(fs, "/d/big");
+    file_write(f, 0, big, sizeof big);
+    iput(f);
+    f = namei(fs, "/d/z");
+    f->flags |= INODE_FLAG_COMPRESS;
+    memset(out, 'z', sizeof out);
+    file_write(f, 0, out, 2 * BLOCK_SIZE);
+    iput(f);
+    f = namei(fs, "/t");
+    file_write(f, 0, "tiny", 4);
+    iput(f);
+
+    char host[] = "/tmp/vvsfs-export-XXXXXX";
+    CTEST_ASSERT(mkdtemp(host) != NULL, "make host dir");
+    char path[256];
+    snprintf(path, sizeof path, "%s/tree", host);
+    struct export_result res;
+    CTEST_ASSERT(export_dir(fs, path, &res) == 0, "export to directory");
+    CTEST_ASSERT(res.files == 3 && res.directories == 1 &&
+                 res.bytes == sizeof big + 2 * BLOCK_SIZE + 4, "counted");
+    CTEST_ASSERT(res.zero_copy_bytes == sizeof big, "block file moved by the kernel");
+
+    snprintf(path, sizeof path, "%s/tree/d/big", host);
+    FILE *fp = fopen(path, "r");
+    CTEST_ASSERT(fp && fread(out, 1, sizeof out, fp) == sizeof big &&
+                 memcmp(out, big, sizeof big) == 0, "file data exported");
+    if (fp) fclose(fp);
+    snprintf(path, sizeof path, "%s/tree/d/z", host);
+    fp = fopen(path, "r");
+    CTEST_ASSERT(fp && fread(out, 1, sizeof out, fp) == 2 * BLOCK_SIZE &&
+                 out[0] == 'z' && out[2 * BLOCK_SIZE - 1] == 'z',
+                 "compressed file expanded");
+    if (fp) fclose(fp);
+
+    snprintf(path, sizeof path, "%s/out.tar", host);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    CTEST_ASSERT(fd >= 0 && export_tar(fs, fd, &res) == 0, "export tar");
+    struct stat st;
+    fstat(fd, &st);
+    // four headers, data for d/big (25), d/z (16) and t (1), two end blocks
+    CTEST_ASSERT(st.st_size == 512 * (4 + 25 + 16 + 1 + 2), "archive size");
+    char hdr[512];
+    CTEST_ASSERT(pread(fd, hdr, 512, 0) == 512 && strcmp(hdr, "d/") == 0 &&
+                 memcmp(hdr + 257, "ustar", 6) == 0, "directory header first");
+    close(fd);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+    host_remove(host);
+}
+
+struct walk_log {
+    unsigned int seq;
+    unsigned int pre[64], post[64], parent[64];
+    int          pre_count, post_count;
+};
+
+static int
+walk_record(const struct vvsfs_walk_entry *ent, int order, void *arg)
+{
+    struct walk_log *log = arg;
+    unsigned int seq = __atomic_add_fetch(&log->seq, 1, __ATOMIC_SEQ_CST);
+    if (order == VVSFS_WALK_PRE) {
+        log->pre[ent->inode_num]    = seq;
+        log->parent[ent->inode_num] = ent->parent;
+        __atomic_add_fetch(&log->pre_count, 1, __ATOMIC_SEQ_CST);
+        return strcmp(ent->name, "skip") == 0;
+    }
+    log->post[ent->inode_num] = seq;
+    __atomic_add_fetch(&log->post_count, 1, __ATOMIC_SEQ_CST);
+    return 0;
+}
+
+CTEST(test_walk, parallel_pre_and_post) {
+    fs = mkfs("img");
+    char path[64];
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "/d%d", i);
+        directory_make(fs, path);
+        for (int j = 0; j < 6; j++) {
+            sprintf(path, "/d%d/s%d", i, j);
+            directory_make(fs, path);
+            sprintf(path, "/d%d/s%d/f", i, j);
+            file_make(fs, path);
+        }
+    }
+    directory_make(fs, "/skip");
+    file_make(fs, "/skip/hidden");
+
+    static struct walk_log log;
+    memset(&log, 0, sizeof log);
+    CTEST_ASSERT(vvsfs_walk(fs, "/", walk_record, &log,
+                            VVSFS_WALK_PRE | VVSFS_WALK_POST, 4) == 0, "walk /");
+    // root + 4 + 24 dirs + 24 files + skip
+    CTEST_ASSERT(log.pre_count == 54, "pre for every entry");
+    CTEST_ASSERT(log.post_count == 29, "post for every visited directory");
+    int ordered = 1;
+    for (unsigned int ino = 1; ino < 64; ino++) {
+        if (!log.pre[ino])
+            continue;
+        unsigned int p = log.parent[ino];
+        ordered &= log.post[p] > log.pre[ino];
+        if (log.post[ino])
+            ordered &= log.post[p] > log.post[ino] && log.post[ino] > log.pre[ino];
+    }
+    CTEST_ASSERT(ordered, "parents finish after their children");
+    CTEST_ASSERT(log.pre[path_lookup(fs, "/skip/hidden")] == 0, "pruned subtree");
+
+    memset(&log, 0, sizeof log);
+    CTEST_ASSERT(vvsfs_walk(fs, "/d2", walk_record, &log, VVSFS_WALK_PRE, 1) == 0 &&
+                 log.pre_count == 13 && log.post_count == 0, "subtree, pre only");
+    CTEST_ASSERT(vvsfs_walk(fs, "/nope", walk_record, &log, VVSFS_WALK_PRE, 2) == -1,
+                 "missing root");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_path, lookup_batch_matches_single) {
+    fs = mkfs("img");
+    directory_make(fs, "/a");
+    directory_make(fs, "/a/b");
+    directory_make(fs, "/c");
+    char path[32];
+    for (int i = 0; i < 12; i++) {
+        sprintf(path, "/a/b/f%d", i);
+        file_make(fs, path);
+    }
+    file_make(fs, "/c/x");
+
+    const char *paths[] = {
+        "/a/b/f3", "/", "/c/x", "/a/b/f11", "/a/missing", "/a/b",
+        "/a/b/f3", "//a//b/f0", "/c/x/under_file", "/a/b/../../c",
+        "/a/b/f9", "/a/b/a_name_longer_than_15", NULL, "/a",
+    };
+    int n = sizeof paths / sizeof paths[0];
+    int out[sizeof paths / sizeof paths[0]];
+    int found = path_lookup_batch(fs, paths, n, out);
+    int same = 1, expect = 0;
+    for (int i = 0; i < n; i++) {
+        int single = paths[i] ? path_lookup(fs, paths[i]) : -1;
+        same &= out[i] == single;
+        expect += single >= 0;
+    }
+    CTEST_ASSERT(same, "batch agrees with path_lookup");
+    CTEST_ASSERT(found == expect && found == 10, "found count");
+    CTEST_ASSERT(path_lookup_batch(fs, paths, 0, out) == 0, "empty batch");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+static void *
+stats_lookups(void *arg)
+{
+    for (int i = 0; i < 5; i++)
+        path_lookup(fs, arg);
+    return NULL;
+}
+
+CTEST(test_stats, counters_merge_and_dump) {
+    fs = mkfs("img");
+    vvsfs_stats_reset();
+    directory_make(fs, "/a");
+    struct vvsfs_stat st[VVSFS_STAT_OPS];
+    vvsfs_stats_read(st);
+#ifndef VVSFS_NO_STATS
+    CTEST_ASSERT(st[VVSFS_STAT_MKDIR].count == 1, "one mkdir");
+    CTEST_ASSERT(st[VVSFS_STAT_IALLOC].count == 1 &&
+                 st[VVSFS_STAT_INODE_WRITE].count >= 1 &&
+                 st[VVSFS_STAT_BWRITE].count >= 1, "mkdir's inner operations");
+#endif
+
+    vvsfs_stats_reset();
+    vvsfs_stats_sample(1);
+    pthread_t th;
+    pthread_create(&th, NULL, stats_lookups, "/a");
+    pthread_join(th, NULL);
+    for (int i = 0; i < 3; i++)
+        path_lookup(fs, "/a");
+    vvsfs_stats_read(st);
+    struct vvsfs_stat *lk = &st[VVSFS_STAT_LOOKUP];
+    unsigned long in_buckets = 0;
+    for (int b = 0; b < VVSFS_STAT_BUCKETS; b++)
+        in_buckets += lk->buckets[b];
+#ifndef VVSFS_NO_STATS
+    CTEST_ASSERT(lk->count == 8, "exited thread's counts are kept");
+    CTEST_ASSERT(lk->timed == 8, "sampling every operation times them all");
+    CTEST_ASSERT(st[VVSFS_STAT_MKDIR].count == 0, "reset clears");
+    CTEST_ASSERT(lk->max_ns > 0 && lk->total_ns >= lk->max_ns, "latencies");
+    CTEST_ASSERT(vvsfs_stat_percentile(lk, 0.5) <= lk->max_ns, "p50 capped");
+#else
+    CTEST_ASSERT(lk->count == 0, "compiled out");
+#endif
+    CTEST_ASSERT(in_buckets == lk->timed, "every sample in a bucket");
+
+    char buf[4096] = "";
+    FILE *fp = tmpfile();
+    vvsfs_stats_dump(fp, 1);
+    rewind(fp);
+    size_t n = fread(buf, 1, sizeof buf - 1, fp);
+    buf[n] = '\0';
+    fclose(fp);
+    CTEST_ASSERT(buf[0] == '{' && buf[n - 2] == '}', "json object");
+    CTEST_ASSERT(strstr(buf, "\"lock_wait\":{\"count\":") != NULL, "all ops listed");
+#ifndef VVSFS_NO_STATS
+    CTEST_ASSERT(strstr(buf, "\"lookup\":{\"count\":8,") != NULL, "lookup count");
+#endif
+
+    vvsfs_stats_reset();
+    vvsfs_stats_sample(0);
+    for (int i = 0; i < 4; i++)
+        path_lookup(fs, "/a");
+    vvsfs_stats_read(st);
+#ifndef VVSFS_NO_STATS
+    CTEST_ASSERT(lk->count == 4 && lk->timed == 0 && lk->total_ns == 0,
+                 "counters only: counted, not timed");
+#endif
+    vvsfs_stats_sample(VVSFS_STAT_SAMPLE);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_stress, mixed_ops_keep_invariants) {
+    fs = mkfs("img");
+    CTEST_ASSERT(directory_make(fs, "/x") == 0, "first mkdir");
+    CTEST_ASSERT(directory_make(fs, "/x") == -1, "same name again is refused");
+    CTEST_ASSERT(directory_make(fs, "/x_long_name_one_a") == 0 &&
+                 directory_make(fs, "/x_long_name_one_b") == -1,
+                 "names equal in their first 15 bytes collide");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+
+    fs = mkfs("img");
+    vvsfs_set_durability(fs, VVSFS_DURABILITY_NONE, 0);
+    struct stress_config cfg = {
+        .threads = 4, .ops = 400, .mkdir_pct = 30, .scan_pct = 20,
+        .alloc_pct = 10, .seed = 7,
+    };
+    struct stress_result res;
+    CTEST_ASSERT(stress_run(fs, &cfg, stdout, &res) == 0, "no problems found");
+    CTEST_ASSERT(res.mkdirs > 0 && res.exists > 0, "threads raced on names");
+    CTEST_ASSERT(res.lookups + res.scans + res.allocs + res.mkdirs +
+                 res.exists == 4 * 400, "every operation counted");
+    vvsfs_set_durability(fs, VVSFS_DURABILITY_OPERATION, 0);
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_handle, two_images_at_once) {
+    fs = mkfs("img");
+    struct vvsfs *other = mkfs("img2");
+    CTEST_ASSERT(fs != NULL && other != NULL, "both images open");
+
+    CTEST_ASSERT(directory_make(fs, "/mine") == 0, "mkdir in the first");
+    CTEST_ASSERT(directory_make(other, "/theirs") == 0, "mkdir in the second");
+    CTEST_ASSERT(path_lookup(fs, "/theirs") == -1 &&
+                 path_lookup(other, "/mine") == -1, "names stay apart");
+
+    // Same inode number in each, each with its own cached copy.
+    struct inode *a = namei(fs, "/mine"), *b = namei(other, "/theirs");
+    CTEST_ASSERT(a && b && a->inode_num == b->inode_num && a != b,
+                 "separate inode caches");
+    iput(a);
+    iput(b);
+
+    CTEST_ASSERT(vvsfs_close(other) >= 0, "close second image");
+    CTEST_ASSERT(path_lookup(fs, "/mine") > 0, "first survives the close");
+    other = vvsfs_open("img2", 0);
+    CTEST_ASSERT(other && path_lookup(other, "/theirs") > 0,
+                 "second reopens on its own");
+    CTEST_ASSERT(vvsfs_close(other) >= 0, "close second image");
+    unlink("img2");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST(test_handle, more_images_than_nested_slots) {
+    enum { N = JOURNAL_MAX_NESTED + 4 };
+    struct vvsfs *imgs[N];
+    char name[16];
+    int ok = 1;
+
+    for (int i = 0; i < N; i++) {
+        snprintf(name, sizeof name, "img.h%d", i);
+        ok &= (imgs[i] = mkfs(name)) != NULL;
+    }
+    CTEST_ASSERT(ok, "all images open");
+
+    // One thread holds a handle on every image at once.
+    for (int i = 0; i < N; i++) {
+        vvsfs_txn_begin(imgs[i]);
+        ok &= directory_make(imgs[i], "/held") == 0;
+    }
+    CTEST_ASSERT(ok, "mkdir under a handle on each image");
+    for (int i = N - 1; i >= 0; i--)
+        ok &= vvsfs_txn_commit(imgs[i]) == 0;
+    CTEST_ASSERT(ok, "every group commits");
+    CTEST_ASSERT(journal_blocks(imgs[0]) == 0, "no handle left open");
+
+    for (int i = 0; i < N; i++) {
+        ok &= vvsfs_close(imgs[i]) >= 0;
+        snprintf(name, sizeof name, "img.h%d", i);
+        struct vvsfs *again = vvsfs_open(name, 0);
+        ok &= again && path_lookup(again, "/held") > 0;
+        ok &= again && vvsfs_close(again) >= 0;
+        unlink(name);
+    }
+    CTEST_ASSERT(ok, "each image kept its directory");
+}
+
+CTEST(test_stripe, three_files_round_robin) {
+    const char *files[] = { "img", "img.1", "img.2" };
+    fs = mkfs_striped(files, 3, 4);
+    CTEST_ASSERT(fs != NULL, "create stripe set");
+
+    off_t total = 0;
+    for (int i = 0; i < 3; i++) {
+        struct stat st;
+        fstat(fs->fds[i], &st);
+        total += st.st_size;
+    }
+    CTEST_ASSERT(total == (off_t)IMAGE_BLOCK_COUNT * BLOCK_SIZE,
+                 "files add up to the image");
+    int fd;
+    off_t off;
+    CTEST_ASSERT(image_map(fs, 5 * BLOCK_SIZE, 8 * BLOCK_SIZE, &fd, &off)
+                 == 3 * BLOCK_SIZE && fd == fs->fds[1] && off == BLOCK_SIZE,
+                 "block 5 is second block of file 1, run ends at stripe");
+    CTEST_ASSERT(image_map(fs, 13 * BLOCK_SIZE, BLOCK_SIZE, &fd, &off)
+                 == BLOCK_SIZE && fd == fs->fds[0] && off == 5 * BLOCK_SIZE,
+                 "stripe 3 wraps to file 0");
+
+    CTEST_ASSERT(directory_make(fs, "/d") == 0 && file_make(fs, "/d/f") == 0,
+                 "make tree");
+    struct inode *f = namei(fs, "/d/f");
+    unsigned char buf[10 * BLOCK_SIZE], out[10 * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof buf; i++)
+        buf[i] = i * 13 + i / BLOCK_SIZE;
+    CTEST_ASSERT(file_write(f, 0, buf, sizeof buf) == (int)sizeof buf &&
+                 file_flush(f) == 10, "write across stripes");
+    int first = f->block_ptr[0];
+    iput(f);
+
+    CTEST_ASSERT(image_pread(fs, out, sizeof out, (off_t)first * BLOCK_SIZE)
+                 == (ssize_t)sizeof out && memcmp(buf, out, sizeof buf) == 0,
+                 "one read spanning three files");
+    image_map(fs, (off_t)(first + 9) * BLOCK_SIZE, BLOCK_SIZE, &fd, &off);
+    CTEST_ASSERT(pread(fd, out, BLOCK_SIZE, off) == BLOCK_SIZE &&
+                 memcmp(buf + 9 * BLOCK_SIZE, out, BLOCK_SIZE) == 0,
+                 "block is where image_map() says");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close stripe set");
+
+    CTEST_ASSERT(vvsfs_open_striped(files, 2, 4, 0) == NULL &&
+                 vvsfs_open_striped(files, 3, 8, 0) == NULL,
+                 "other stripe layouts refused");
+    fs = vvsfs_open_striped(files, 3, 4, 0);
+    CTEST_ASSERT(fs != NULL, "reopen stripe set");
+    f = namei(fs, "/d/f");
+    memset(out, 0, sizeof out);
+    CTEST_ASSERT(f && file_read(f, 0, out, sizeof out) == (int)sizeof out &&
+                 memcmp(buf, out, sizeof buf) == 0, "data survives reopen");
+    iput(f);
+    struct fsck_result res;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &res) == 0, "stripe set is consistent");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close stripe set");
+    unlink("img.1");
+    unlink("img.2");
+}
+
+CTEST(test_tier, metadata_and_data_apart) {
+    fs = mkfs_tiered("img", "img.data");
+    CTEST_ASSERT(fs != NULL, "create tiered image");
+    char path[16];
+    for (int i = 0; i < DIRECTORY_INLINE_MAX; i++) {
+        snprintf(path, sizeof path, "/d%d", i);
+        directory_make(fs, path);
+    }
+    CTEST_ASSERT(file_make(fs, "/f") == 0, "create /f");
+    struct inode *f = namei(fs, "/f");
+    unsigned char buf[2 * BLOCK_SIZE], out[2 * BLOCK_SIZE];
+    memset(buf, 0xa5, sizeof buf);
+    CTEST_ASSERT(file_write(f, 0, buf, sizeof buf) == (int)sizeof buf &&
+                 file_flush(f) == 2, "write two data blocks");
+    off_t data = (off_t)f->block_ptr[0] * BLOCK_SIZE;
+    iput(f);
+    struct inode *root = iget(fs, 0);
+    off_t dir = (off_t)root->block_ptr[0] * BLOCK_SIZE;
+    iput(root);
+    journal_flush(fs);
+
+    static const unsigned char zero[BLOCK_SIZE];
+    int meta_fd = fs->fds[0], data_fd = fs->fds[fs->data_file];
+    CTEST_ASSERT(pread(data_fd, out, BLOCK_SIZE, data) == BLOCK_SIZE &&
+                 memcmp(out, buf, BLOCK_SIZE) == 0 &&
+                 pread(meta_fd, out, BLOCK_SIZE, data) == BLOCK_SIZE &&
+                 memcmp(out, zero, BLOCK_SIZE) == 0, "file data in data file");
+    CTEST_ASSERT(pread(meta_fd, out, BLOCK_SIZE, dir) == BLOCK_SIZE &&
+                 memcmp(out, zero, BLOCK_SIZE) != 0 &&
+                 pread(data_fd, out, BLOCK_SIZE, dir) == BLOCK_SIZE &&
+                 memcmp(out, zero, BLOCK_SIZE) == 0,
+                 "directory block in metadata file");
+
+    // With the data file gone, lookups and listings still work.
+    fs->fds[fs->data_file] = -1;
+    CTEST_ASSERT(path_lookup(fs, "/d3") > 0, "lookup without data file");
+    struct directory *d = directory_open(fs, 0);
+    struct directory_entry ent;
+    int entries = 0;
+    while (d && directory_get(d, &ent) == 0)
+        entries++;
+    if (d)
+        directory_close(d);
+    CTEST_ASSERT(entries == DIRECTORY_INLINE_MAX + 3, "listing without data file");
+    CTEST_ASSERT(dread(fs, data / BLOCK_SIZE, out) == NULL, "data reads need it");
+    fs->fds[fs->data_file] = data_fd;
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close tiered image");
+
+    CTEST_ASSERT(vvsfs_open("img", 0) == NULL, "metadata file alone refused");
+    fs = vvsfs_open_tiered("img", "img.data", 0);
+    CTEST_ASSERT(fs != NULL, "reopen tiered image");
+    f = namei(fs, "/f");
+    memset(out, 0, sizeof out);
+    CTEST_ASSERT(f && file_read(f, 0, out, sizeof out) == (int)sizeof out &&
+                 memcmp(buf, out, sizeof buf) == 0, "data survives reopen");
+    iput(f);
+    struct fsck_result res;
+    CTEST_ASSERT(fsck_image(fs, 2, NULL, &res) == 0, "tiered image is consistent");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close tiered image");
+    unlink("img.data");
+}
+
+CTEST(test_tier, lookups_leave_data_unsynced) {
+    fs = mkfs_tiered("img", "img.data");
+    // No background checkpointer: journal_flush() below runs them.
+    journal_stop(fs);
+    CTEST_ASSERT(file_make(fs, "/f") == 0, "create /f");
+    struct inode *f = namei(fs, "/f");
+    unsigned char buf[BLOCK_SIZE];
+    memset(buf, 0x5a, sizeof buf);
+    CTEST_ASSERT(file_write(f, 0, buf, sizeof buf) == (int)sizeof buf &&
+                 file_flush(f) == 1, "write a data block");
+    int blk = f->block_ptr[0];
+    iput(f);
+    CTEST_ASSERT(fs->data_dirty == 0, "data synced with the commit using it");
+
+    // Data whose metadata is not committed yet.
+    dwrite(fs, blk, buf);
+    CTEST_ASSERT(fs->data_dirty == 1, "unsynced data");
+    int found = 1;
+    for (int i = 0; i < 100; i++)
+        found &= path_lookup(fs, "/f") > 0;
+    struct directory *d = directory_open(fs, 0);
+    struct directory_entry ent;
+    while (d && directory_get(d, &ent) == 0)
+        ;
+    if (d)
+        directory_close(d);
+    journal_flush(fs);
+    CTEST_ASSERT(found && fs->data_dirty == 1,
+                 "lookups, listings and checkpoints leave the data file alone");
+    CTEST_ASSERT(vvsfs_sync(fs) == 0 && fs->data_dirty == 0,
+                 "vvsfs_sync() syncs it");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close tiered image");
+    unlink("img.data");
+}
+
+CTEST_BENCH(test_bench, path_lookup_depth8) {
+    fs = mkfs("img");
+    char path[64] = "";
+    for (int i = 0; i < 8; i++) {
+        strcat(path, "/d");
+        directory_make(fs, path);
+    }
+    path_lookup(fs, path);
+
+    int ok = 1;
+    CTEST_BENCH_LOOP(2000, 200) {
+        ok &= path_lookup(fs, path) > 0;
+    }
+    CTEST_ASSERT(ok, "every lookup resolves");
+    CTEST_BENCH_EXPECT(20000000, "warm depth-8 lookup under 20ms");
+    CTEST_BENCH_CHECK_BASELINE("within baseline tolerance");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST_BENCH(test_bench, bread_cached) {
+    fs = mkfs("img");
+    // Keep the block logged in an open handle so every read hits the
+    // journal cache, whatever the checkpointer has written home.
+    unsigned char block[BLOCK_SIZE];
+    journal_begin(fs);
+    bread(fs, INODE_MAP_BLOCK, block);
+    bwrite(fs, INODE_MAP_BLOCK, block);
+    int ok = 1;
+    CTEST_BENCH_LOOP(5000, 500) {
+        ok &= bread(fs, INODE_MAP_BLOCK, block) != NULL;
+    }
+    journal_end(fs);
+    CTEST_ASSERT(ok, "every read succeeds");
+    CTEST_BENCH_EXPECT(1000000, "bread under 1ms");
+    CTEST_BENCH_CHECK_BASELINE("within baseline tolerance");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
+}
+
+CTEST_BENCH(test_bench, bread_home) {
+    fs = mkfs("img");
+    // Checkpoint first so every read goes to the image and is verified.
+    journal_flush(fs);
+    unsigned char block[BLOCK_SIZE];
+    int ok = 1;
+    CTEST_BENCH_LOOP(5000, 500) {
+        ok &= bread(fs, INODE_MAP_BLOCK, block) != NULL;
+    }
+    CTEST_ASSERT(ok, "every read succeeds");
+    CTEST_BENCH_EXPECT(1000000, "bread under 1ms");
+    CTEST_BENCH_CHECK_BASELINE("within baseline tolerance");
+    CTEST_ASSERT(vvsfs_close(fs) >= 0, "close image");
 }
 
 int main(void) {
@@ -185,6 +1742,7 @@ int main(void) {
     test_test_free_find_and_set();
     test_inode_incore_find_and_free();
     test_inode_readwrite_round_trip();
+    test_inode_codec_big_endian_layout_and_block_decode();
     test_inode_alloc_simple_ialloc();
     test_inode_iput_write_on_zero();
     test_test_directory_root_has_dot_and_dotdot();
@@ -192,6 +1750,53 @@ int main(void) {
     test_test_path_not_found();
     test_test_namei_root_and_missing();
     test_test_directory_make_create_and_lookup();
+    test_test_directory_make_full_directory_frees_inode();
+    test_test_file_delayed_allocation();
+    test_test_file_truncate_before_flush();
+    test_test_file_budget_held_by_other_files();
+    test_test_inline_tiny_file_and_spill();
+    test_test_inline_directory_spills_to_block();
+    test_test_journal_replay_after_lost_checkpoint();
+    test_test_journal_rewrite_keeps_committed_version();
+    test_test_journal_concurrent_group_commit();
+    test_test_txn_many_mkdirs_one_commit();
+    test_test_txn_oversized_reports_error();
+    test_test_txn_split_keeps_every_block();
+    test_test_txn_open_txn_does_not_stall_readers();
+    test_test_txn_capped_at_max_blocks();
+    test_test_durability_explicit_and_periodic();
+    test_test_durability_lookups_do_not_commit();
+    test_test_clone_shared_blocks_and_cow();
+    test_test_clone_snapshot_root();
+    test_test_clone_large_tree_in_bounded_transactions();
+    test_test_compress_lz_round_trip();
+    test_test_compress_compressed_cluster();
+    test_test_compress_remade_image_reads_own_clusters();
+    test_test_dedup_write_time_sharing();
+    test_test_dedup_offline_pass();
+    test_test_csum_crc32c_vectors();
+    test_test_csum_corrupt_metadata_detected();
+    test_test_fsck_clean_then_leaks();
+    test_test_mkfs_sparse_image_and_lazy_groups();
+    test_test_import_host_tree();
+    test_test_import_large_tree_and_failure();
+    test_test_export_dir_and_tar();
+    test_test_walk_parallel_pre_and_post();
+    test_test_path_lookup_batch_matches_single();
+    test_test_stats_counters_merge_and_dump();
+    test_test_stress_mixed_ops_keep_invariants();
+    test_test_handle_two_images_at_once();
+    test_test_handle_more_images_than_nested_slots();
+    test_test_stripe_three_files_round_robin();
+    test_test_tier_metadata_and_data_apart();
+    test_test_tier_lookups_leave_data_unsynced();
+
+    // Baselines are per machine, so only `make bench-check` names one.
+    // Loose bounds: the baseline catches large regressions, not noise.
+    CTEST_BENCH_BASELINE(getenv("CTEST_BENCH_FILE"), 400);
+    bench_test_bench_path_lookup_depth8();
+    bench_test_bench_bread_cached();
+    bench_test_bench_bread_home();
 
     CTEST_RESULTS();
     CTEST_EXIT();
@@ -0,0 +1,23 @@
+#include <stdio.h>
+#include "image.h"
+#include "dedup.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 1;
+    }
+    struct vvsfs *fs = vvsfs_open(argv[1], 0);
+    if (!fs) {
+        perror(argv[1]);
+        return 1;
+    }
+    int remapped = dedup_image(fs);
+    vvsfs_close(fs);
+    if (remapped < 0) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 1;
+    }
+    printf("%d blocks deduplicated\n", remapped);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "image.h"
+#include "export.h"
+
+int main(int argc, char *argv[]) {
+    const char *tar = NULL, *dir = NULL;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:C:")) != -1) {
+        if (opt == 'f')
+            tar = optarg;
+        else if (opt == 'C')
+            dir = optarg;
+        else
+            break;
+    }
+    if (optind != argc - 1 || !tar == !dir) {
+        fprintf(stderr, "usage: %s (-f archive.tar | -f - | -C host-dir) image\n",
+                argv[0]);
+        return 2;
+    }
+    struct vvsfs *fs = vvsfs_open(argv[optind], 0);
+    if (!fs) {
+        perror(argv[optind]);
+        return 2;
+    }
+
+    struct export_result res;
+    int r;
+    if (dir) {
+        r = export_dir(fs, dir, &res);
+    } else {
+        int fd = strcmp(tar, "-") == 0
+                 ? STDOUT_FILENO
+                 : open(tar, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        r = fd < 0 ? -1 : export_tar(fs, fd, &res);
+        if (fd > STDOUT_FILENO)
+            close(fd);
+    }
+    vvsfs_close(fs);
+    if (r < 0) {
+        fprintf(stderr, "%s: export failed\n", argv[0]);
+        return 1;
+    }
+    fprintf(stderr, "%u files, %u directories, %llu bytes (%llu zero-copy), "
+            "%u skipped\n", res.files, res.directories, res.bytes,
+            res.zero_copy_bytes, res.skipped);
+    return 0;
+}
@@ -0,0 +1,37 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "image.h"
+#include "fsck.h"
+
+int main(int argc, char *argv[]) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt != 'j')
+            break;
+        threads = atoi(optarg);
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-j threads] image\n", argv[0]);
+        return 2;
+    }
+    struct vvsfs *fs = vvsfs_open(argv[optind], 0);
+    if (!fs) {
+        perror(argv[optind]);
+        return 2;
+    }
+
+    struct fsck_result res;
+    int problems = fsck_image(fs, threads, stdout, &res);
+    vvsfs_close(fs);
+    if (problems < 0) {
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        return 2;
+    }
+    printf("%u inodes (%u directories), %u blocks in use\n",
+           res.inodes, res.directories, res.blocks);
+    printf("%u leaked inodes, %u leaked blocks, %u other errors\n",
+           res.leaked_inodes, res.leaked_blocks, res.errors);
+    return problems ? 1 : 0;
+}
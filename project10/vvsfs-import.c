@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "image.h"
+#include "dir.h"
+#include "import.h"
+
+int main(int argc, char *argv[]) {
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    while ((opt = getopt(argc, argv, "j:")) != -1) {
+        if (opt != 'j')
+            break;
+        threads = atoi(optarg);
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "usage: %s [-j threads] host-dir image\n", argv[0]);
+        return 2;
+    }
+
+    struct vvsfs *fs = mkfs(argv[optind + 1]);
+    if (!fs) {
+        perror(argv[optind + 1]);
+        return 2;
+    }
+    struct import_result res;
+    int r = import_tree(fs, argv[optind], threads, &res);
+    vvsfs_close(fs);
+    if (r < 0) {
+        fprintf(stderr, "%s: import of %s failed\n", argv[0], argv[optind]);
+        return 1;
+    }
+    printf("%u files, %u directories, %llu bytes imported, %u skipped\n",
+           res.files, res.directories, res.bytes, res.skipped);
+    return 0;
+}
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "image.h"
+#include "dir.h"
+#include "journal.h"
+#include "stress.h"
+
+/*
+ * Runs the stress mix once per thread count on a fresh image and
+ * prints one JSON line per run; exits 1 if any run broke an invariant.
+ *
+ *   vvsfs-stress [-j 1,2,4,8] [-n ops-per-thread] [-m mkdir,scan,alloc]
+ *                [-s seed] [image]
+ */
+int main(int argc, char *argv[]) {
+    struct stress_config cfg = {
+        .ops = 2000, .mkdir_pct = 30, .scan_pct = 20, .alloc_pct = 10,
+        .seed = 1,
+    };
+    char *counts = "1,2,4,8";
+    int opt;
+    while ((opt = getopt(argc, argv, "j:n:m:s:")) != -1) {
+        switch (opt) {
+        case 'j': counts   = optarg;                        break;
+        case 'n': cfg.ops  = atoi(optarg);                  break;
+        case 's': cfg.seed = (unsigned int)atoi(optarg);    break;
+        case 'm':
+            if (sscanf(optarg, "%d,%d,%d", &cfg.mkdir_pct, &cfg.scan_pct,
+                       &cfg.alloc_pct) == 3)
+                break;
+            // fall through
+        default:
+            fprintf(stderr, "usage: %s [-j threads,...] [-n ops] "
+                    "[-m mkdir,scan,alloc] [-s seed] [image]\n", argv[0]);
+            return 2;
+        }
+    }
+    const char *image = optind < argc ? argv[optind] : "stress.img";
+
+    int failed = 0;
+    char *list = strdup(counts);
+    for (char *save, *tok = strtok_r(list, ",", &save); tok;
+         tok = strtok_r(NULL, ",", &save)) {
+        cfg.threads = atoi(tok);
+        struct vvsfs *fs = mkfs(image);
+        if (!fs) {
+            perror(image);
+            return 2;
+        }
+        vvsfs_set_durability(fs, VVSFS_DURABILITY_NONE, 0);
+
+        struct stress_result res;
+        int problems = stress_run(fs, &cfg, stderr, &res);
+        vvsfs_close(fs);
+        unsigned long ops = (unsigned long)cfg.threads * cfg.ops;
+        double rate = res.seconds > 0 ? ops / res.seconds : 0;
+        printf("{\"threads\":%d,\"ops\":%lu,\"seconds\":%.3f,"
+               "\"ops_per_sec\":%.0f,\"ops_per_sec_per_thread\":%.0f,"
+               "\"mkdirs\":%lu,\"exists\":%lu,\"lookups\":%lu,\"scans\":%lu,"
+               "\"allocs\":%lu,\"problems\":%d}\n",
+               cfg.threads, ops, res.seconds, rate, rate / cfg.threads,
+               res.mkdirs, res.exists, res.lookups, res.scans, res.allocs,
+               problems);
+        fflush(stdout);
+        failed |= problems != 0;
+    }
+    free(list);
+    return failed ? 1 : 0;
+}
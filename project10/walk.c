@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include "inode.h"
+#include "dir.h"
+#include "walk.h"
+
+/*
+ * Parallel subtree walk. Each worker owns a deque of directories still
+ * to read: it pushes the subdirectories it finds and pops from the same
+ * end, so it works depth first on its own part of the tree, and an idle
+ * worker steals from the other end of someone else's deque, which
+ * holds the oldest and usually largest subtrees.
+ *
+ * fn is called with VVSFS_WALK_PRE for every entry (if flags has it)
+ * and with VVSFS_WALK_POST for every directory once everything below
+ * it has been visited (if flags has it). Calls come from several
+ * threads at once. A PRE call returning > 0 on a directory skips its
+ * contents; any call returning < 0 stops the walk and is returned.
+ * Inodes are read from disk, so the walk sees what has been iput().
+ */
+struct walk_dir {
+    unsigned int     ino;
+    int              depth;
+    char            *path;
+    char             name[16];
+    struct walk_dir *parent;
+    int              pending;   // own scan plus unfinished subdirectories
+};
+
+struct walk_deque {
+    pthread_mutex_t   lock;
+    struct walk_dir **items;
+    unsigned int      head, tail, cap;
+};
+
+struct walk {
+    struct vvsfs     *fs;
+    vvsfs_walk_fn     fn;
+    void             *arg;
+    int               flags;
+    int               nworkers;
+    struct walk_deque deques[VVSFS_WALK_MAX_THREADS];
+    unsigned int      outstanding;
+    int               result;
+};
+
+struct walk_worker {
+    struct walk *w;
+    int          id;
+};
+
+static int
+deque_push(struct walk_deque *q, struct walk_dir *d)
+{
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap) {
+        // Slide live items down before growing.
+        unsigned int live = q->tail - q->head;
+        if (q->head > 0 && live < q->cap / 2) {
+            memmove(q->items, q->items + q->head, live * sizeof *q->items);
+        } else {
+            unsigned int cap = q->cap ? q->cap * 2 : 64;
+            struct walk_dir **items = realloc(q->items, cap * sizeof *items);
+            if (!items) {
+                pthread_mutex_unlock(&q->lock);
+                return -1;
+            }
+            q->items = items;
+            q->cap   = cap;
+            if (q->head > 0)
+                memmove(q->items, q->items + q->head, live * sizeof *q->items);
+        }
+        q->head = 0;
+        q->tail = live;
+    }
+    q->items[q->tail++] = d;
+    pthread_mutex_unlock(&q->lock);
+    return 0;
+}
+
+static struct walk_dir *
+deque_pop(struct walk_deque *q, int steal)
+{
+    struct walk_dir *d = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->head < q->tail)
+        d = steal ? q->items[q->head++] : q->items[--q->tail];
+    pthread_mutex_unlock(&q->lock);
+    return d;
+}
+
+static void
+walk_stop(struct walk *w, int r)
+{
+    int zero = 0;
+    __atomic_compare_exchange_n(&w->result, &zero, r, 0,
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static int
+walk_stopped(struct walk *w)
+{
+    return __atomic_load_n(&w->result, __ATOMIC_RELAXED) != 0;
+}
+
+static int
+walk_call(struct walk *w, int order, const char *path, const char *name,
+          unsigned int ino, unsigned int parent, int depth,
+          const struct inode *in)
+{
+    if (!(w->flags & order))
+        return 0;
+    struct vvsfs_walk_entry ent = {
+        .path = path, .name = name, .inode_num = ino,
+        .parent = parent, .depth = depth, .inode = in,
+    };
+    int r = w->fn(&ent, order, w->arg);
+    if (r < 0)
+        walk_stop(w, r);
+    return r;
+}
+
+// Drops one pending count; the last one runs POST and moves up.
+static void
+walk_done(struct walk *w, struct walk_dir *d)
+{
+    while (d && __atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        struct walk_dir *parent = d->parent;
+        if (!walk_stopped(w)) {
+            struct inode in;
+            read_inode(w->fs, &in, d->ino);
+            in.inode_num = d->ino;
+            walk_call(w, VVSFS_WALK_POST, d->path, d->name, d->ino,
+                      parent ? parent->ino : d->ino, d->depth, &in);
+        }
+        free(d->path);
+        free(d);
+        d = parent;
+    }
+}
+
+static struct walk_dir *
+walk_dir_new(struct walk_dir *parent, const char *path, const char *name,
+             unsigned int ino)
+{
+    struct walk_dir *d = calloc(1, sizeof *d);
+    if (!d || !(d->path = strdup(path))) {
+        free(d);
+        return NULL;
+    }
+    snprintf(d->name, sizeof d->name, "%s", name);
+    d->ino     = ino;
+    d->depth   = parent ? parent->depth + 1 : 0;
+    d->parent  = parent;
+    d->pending = 1;
+    return d;
+}
+
+static void
+walk_scan(struct walk_worker *self, struct walk_dir *d)
+{
+    struct walk *w = self->w;
+    struct inode dir;
+    struct directory it;
+    struct directory_entry ent;
+    char path[4096];
+
+    read_inode(w->fs, &dir, d->ino);
+    dir.inode_num = d->ino;
+    directory_init(&it, &dir);
+    while (!walk_stopped(w) && directory_get(&it, &ent) == 0) {
+        if (strcmp(ent.name, ".") == 0 || strcmp(ent.name, "..") == 0)
+            continue;
+        snprintf(path, sizeof path, "%s/%s",
+                 strcmp(d->path, "/") == 0 ? "" : d->path, ent.name);
+
+        struct inode in;
+        read_inode(w->fs, &in, ent.inode_num);
+        in.inode_num = ent.inode_num;
+        int r = walk_call(w, VVSFS_WALK_PRE, path, ent.name, ent.inode_num,
+                          d->ino, d->depth + 1, &in);
+        if (r != 0 || !(in.flags & INODE_FLAG_DIR))
+            continue;
+
+        struct walk_dir *child = walk_dir_new(d, path, ent.name, ent.inode_num);
+        if (!child) {
+            walk_stop(w, -1);
+            break;
+        }
+        __atomic_add_fetch(&d->pending, 1, __ATOMIC_ACQ_REL);
+        __atomic_add_fetch(&w->outstanding, 1, __ATOMIC_ACQ_REL);
+        if (deque_push(&w->deques[self->id], child) < 0) {
+            walk_stop(w, -1);
+            __atomic_sub_fetch(&w->outstanding, 1, __ATOMIC_ACQ_REL);
+            walk_done(w, child);
+            break;
+        }
+    }
+}
+
+static void *
+walk_worker(void *arg)
+{
+    struct walk_worker *self = arg;
+    struct walk *w = self->w;
+
+    for (;;) {
+        struct walk_dir *d = deque_pop(&w->deques[self->id], 0);
+        for (int i = 1; !d && i < w->nworkers; i++)
+            d = deque_pop(&w->deques[(self->id + i) % w->nworkers], 1);
+        if (!d) {
+            if (__atomic_load_n(&w->outstanding, __ATOMIC_ACQUIRE) == 0)
+                return NULL;
+            sched_yield();
+            continue;
+        }
+        if (!walk_stopped(w))
+            walk_scan(self, d);
+        walk_done(w, d);
+        __atomic_sub_fetch(&w->outstanding, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+int
+vvsfs_walk(struct vvsfs *fs, const char *root, vvsfs_walk_fn fn, void *arg,
+           int flags, int nthreads)
+{
+    int ino = path_lookup(fs, root);
+    if (ino < 0)
+        return -1;
+    if (nthreads < 1)
+        nthreads = 1;
+    if (nthreads > VVSFS_WALK_MAX_THREADS)
+        nthreads = VVSFS_WALK_MAX_THREADS;
+
+    struct walk *w = calloc(1, sizeof *w);
+    if (!w)
+        return -1;
+    w->fs       = fs;
+    w->fn       = fn;
+    w->arg      = arg;
+    w->flags    = flags;
+    w->nworkers = nthreads;
+    for (int i = 0; i < nthreads; i++)
+        pthread_mutex_init(&w->deques[i].lock, NULL);
+
+    struct inode in;
+    read_inode(fs, &in, ino);
+    in.inode_num = ino;
+    const char *name = strrchr(root, '/') ? strrchr(root, '/') + 1 : root;
+    int r = walk_call(w, VVSFS_WALK_PRE, root, name, ino, ino, 0, &in);
+    if (r == 0 && (in.flags & INODE_FLAG_DIR)) {
+        struct walk_dir *d = walk_dir_new(NULL, root, name, ino);
+        if (!d || deque_push(&w->deques[0], d) < 0) {
+            free(d);
+            walk_stop(w, -1);
+        } else {
+            w->outstanding = 1;
+            struct walk_worker workers[VVSFS_WALK_MAX_THREADS];
+            pthread_t tids[VVSFS_WALK_MAX_THREADS];
+            int started = 1;
+            for (int i = 0; i < nthreads; i++)
+                workers[i] = (struct walk_worker){ .w = w, .id = i };
+            for (; started < nthreads; started++)
+                if (pthread_create(&tids[started], NULL, walk_worker,
+                                   &workers[started]) != 0)
+                    break;
+            walk_worker(&workers[0]);
+            for (int i = 1; i < started; i++)
+                pthread_join(tids[i], NULL);
+        }
+    }
+
+    r = w->result;
+    for (int i = 0; i < nthreads; i++) {
+        free(w->deques[i].items);
+        pthread_mutex_destroy(&w->deques[i].lock);
+    }
+    free(w);
+    return r;
+}
@@ -0,0 +1,25 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "inode.h"
+
+#define VVSFS_WALK_PRE          1
+#define VVSFS_WALK_POST         2
+#define VVSFS_WALK_MAX_THREADS  64
+
+struct vvsfs_walk_entry {
+    const char         *path;
+    const char         *name;
+    unsigned int        inode_num;
+    unsigned int        parent;
+    int                 depth;
+    const struct inode *inode;
+};
+
+typedef int (*vvsfs_walk_fn)(const struct vvsfs_walk_entry *ent,
+                             int order, void *arg);
+
+int vvsfs_walk(struct vvsfs *fs, const char *root, vvsfs_walk_fn fn,
+               void *arg, int flags, int nthreads);
+
+#endif